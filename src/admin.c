@@ -284,6 +284,7 @@ struct _client_functions admin_mount_ops =
 
 int admin_mount_request (client_t *client)
 {
+    struct source_shard *shard;
     source_t *source;
     const char *mount = client->mount;
     char *uri = (void*)client->aux_data;
@@ -309,12 +310,12 @@ int admin_mount_request (client_t *client)
         return 0;
     }
 
-    avl_tree_rlock(global.source_tree);
+    shard = source_index_rlock (mount);
     source = source_find_mount_raw(mount);
 
     if (source == NULL)
     {
-        avl_tree_unlock(global.source_tree);
+        source_index_unlock (shard);
         if (strncmp (cmd->request, "stats", 5) == 0)
             return command_stats (client, uri);
         if (strncmp (cmd->request, "listclients", 11) == 0)
@@ -330,7 +331,7 @@ int admin_mount_request (client_t *client)
         int ret = 0;
 
         thread_rwlock_wlock (&source->lock);
-        avl_tree_unlock (global.source_tree);
+        source_index_unlock (shard);
 
         // see if we should move workers. avoid excessive write lock bubbles in worker run queue
         worker_t *src_worker = source->client->worker;
@@ -537,9 +538,9 @@ static int admin_function (const char *function, char *buf, unsigned int len)
 {
     if (strcmp (function, "reopenlog") == 0)
     {
-        ice_config_t *config = config_grab_config();
+        ice_config_t *config = config_get_config();
 
-        restart_logging (config);
+        reopen_logging (config);
         config_release_config();
         snprintf (buf, len, "Re-opening log files");
         return 0;
@@ -651,10 +652,7 @@ static int command_manage_relay (client_t *client, int response)
         else
             relay->flags &= ~RELAY_RUNNING;
         if (client)
-        {
-            client->schedule_ms = 0;
-            worker_wakeup (client->worker);
-        }
+            client_wakeup (client);
         thread_rwlock_unlock (&source->lock);
         msg = "relay has been changed";
     }
@@ -767,14 +765,13 @@ static int command_show_listeners (client_t *client, source_t *source, int respo
 
 static int command_show_image (client_t *client, const char *mount)
 {
-    source_t *source;
+    struct source_shard *shard = source_index_rlock (mount);
+    source_t *source = source_find_mount_raw (mount);
 
-    avl_tree_rlock (global.source_tree);
-    source = source_find_mount_raw (mount);
     if (source && source->format && source->format->get_image)
     {
         thread_rwlock_rlock (&source->lock);
-        avl_tree_unlock (global.source_tree);
+        source_index_unlock (shard);
         if (source->format->get_image (client, source->format) == 0)
         {
             thread_rwlock_unlock (&source->lock);
@@ -783,7 +780,7 @@ static int command_show_image (client_t *client, const char *mount)
         thread_rwlock_unlock (&source->lock);
     }
     else
-        avl_tree_unlock (global.source_tree);
+        source_index_unlock (shard);
     return client_send_404 (client, "No image available");
 }
 
@@ -1002,10 +999,12 @@ static int command_fallback (client_t *client, source_t *source, int response)
         const char *fallback;
         char buffer[200];
         if (COMMAND_REQUIRE(client, "fallback", fallback) < 0)
+        {
+            config_release_config ();
             return client_send_400 (client, "missing arg, fallback");
+        }
 
-        xmlFree (mountinfo->fallback_mount);
-        mountinfo->fallback_mount = (char *)xmlCharStrdup (fallback);
+        config_replace_string (config, &mountinfo->fallback_mount, fallback);
         snprintf (buffer, sizeof (buffer), "Fallback for \"%s\" configured", mountinfo->mountname);
         config_release_config ();
         return html_success (client, buffer);
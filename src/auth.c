@@ -119,12 +119,13 @@ void auth_check_http (client_t *client)
 
 static auth_client *auth_client_setup (const char *mount, client_t *client)
 {
-    ice_config_t *config = config_get_config_unlocked();
+    ice_config_t *config = config_get_config();
     auth_client *auth_user = calloc (1, sizeof(auth_client));
 
     auth_user->mount = strdup (mount);
     auth_user->hostname = strdup (config->hostname);
     auth_user->port = config->port;
+    config_release_config();
     auth_user->client = client;
     if (client)
     {
@@ -413,9 +414,10 @@ int move_listener (client_t *client, struct _fbinfo *finfo)
     memcpy (&where, finfo, sizeof (where));
     if (finfo->fallback)
         where.fallback = strdup (finfo->fallback);
-    avl_tree_rlock (global.source_tree);
     do
     {
+        struct source_shard *shard;
+
         len = sizeof buffer;
         util_expand_pattern (where.fallback, where.mount, buffer, &len);
         where.mount = buffer;
@@ -424,20 +426,24 @@ int move_listener (client_t *client, struct _fbinfo *finfo)
 
         if (rate == 0 && minfo && minfo->limit_rate)
             rate = minfo->limit_rate;
+        shard = source_index_rlock (where.mount);
         source = source_find_mount_raw (where.mount);
 
         if (source == NULL && minfo == NULL)
+        {
+            source_index_unlock (shard);
             break;
+        }
         if (source)
         {
             thread_rwlock_wlock (&source->lock);
+            source_index_unlock (shard);
             if (source_available (source))
             {
                 // an unused on-demand relay will still have an unitialised type
                 if (source->format->type == finfo->type || source->format->type == FORMAT_TYPE_UNDEFINED)
                 {
                     config_release_config();
-                    avl_tree_unlock (global.source_tree);
                     source_setup_listener (source, client);
                     source->listeners++;
                     client->flags |= CLIENT_HAS_MOVED;
@@ -448,6 +454,8 @@ int move_listener (client_t *client, struct _fbinfo *finfo)
             }
             thread_rwlock_unlock (&source->lock);
         }
+        else
+            source_index_unlock (shard);
         if (minfo && minfo->fallback_mount)
         {
             free (where.fallback);
@@ -458,7 +466,6 @@ int move_listener (client_t *client, struct _fbinfo *finfo)
             break;
     } while (loop--);
 
-    avl_tree_unlock (global.source_tree);
     config_release_config();
     if (where.mount && ((client->flags & CLIENT_IS_SLAVE) == 0))
     {
@@ -493,6 +500,8 @@ static int add_authenticated_listener (const char *mount, mount_proxy *mountinfo
     /* some win32 setups do not do TCP win scaling well, so allow an override */
     if (mountinfo && mountinfo->so_sndbuf > 0)
         sock_set_send_buffer (client->connection.sock, mountinfo->so_sndbuf);
+    if (mountinfo && mountinfo->zerocopy)
+        connection_zerocopy_enable (&client->connection);
 
     /* check whether we are processing a streamlist request for slaves */
     if (strcmp (mount, "/admin/streams") == 0)
@@ -384,6 +384,7 @@ static auth_result url_remove_listener (auth_client *auth_user)
     mount = util_url_escape (post);
     ipaddr = util_url_escape (client->connection.ip);
 
+    /* bytes the socket has taken, any still held for a send is not counted yet */
     int ret = snprintf (post, sizeof (post),
             "action=listener_remove&server=%s&port=%d&client=%" PRIu64 "&mount=%s"
             "&user=%s&pass=%s&ip=%s&duration=%lu&agent=%s&sent=%" PRIu64,
@@ -833,9 +834,10 @@ static auth_result auth_url_listuser (auth_t *auth, xmlNodePtr srcnode)
 static void *alloc_thread_data (auth_t *auth)
 {
     auth_thread_data *atd = calloc (1, sizeof (auth_thread_data));
-    ice_config_t *config = config_get_config_unlocked();
+    ice_config_t *config = config_get_config();
     auth_url *url = auth->state;
     atd->server_id = strdup (config->server_id);
+    config_release_config();
 
     atd->curl = curl_easy_init ();
     curl_easy_setopt (atd->curl, CURLOPT_USERAGENT, atd->server_id);
@@ -24,10 +24,10 @@
 #include <glob.h>
 #endif
 #include <errno.h>
-#include <fnmatch.h>
 #include "thread/thread.h"
 #include "timing/timing.h"
 #include "cfgfile.h"
+#include "mountmatch.h"
 #include "refbuf.h"
 #include "client.h"
 #include "logging.h"
@@ -60,6 +60,8 @@
 #define CONFIG_DEFAULT_CHUID 0
 #define CONFIG_MASTER_UPDATE_INTERVAL 120
 #define CONFIG_YP_URL_TIMEOUT 10
+#define CONFIG_DEFAULT_SSL_SESSION_CACHE 10000
+#define CONFIG_DEFAULT_SSL_SESSION_TIMEOUT 1800
 #define CONFIG_DEFAULT_CIPHER_LIST "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES256-GCM-SHA384:DHE-RSA-AES128-GCM-SHA256:DHE-DSS-AES128-GCM-SHA256:kEDH+AESGCM:ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA:ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA384:ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-AES256-SHA:DHE-RSA-AES128-SHA256:DHE-RSA-AES128-SHA:DHE-DSS-AES128-SHA256:DHE-RSA-AES256-SHA256:DHE-DSS-AES256-SHA:DHE-RSA-AES256-SHA:ECDHE-RSA-DES-CBC3-SHA:ECDHE-ECDSA-DES-CBC3-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:AES:DES-CBC3-SHA:HIGH:!aNULL:!eNULL:!EXPORT:!DES:!RC4:!MD5:!PSK:!aECDH:!EDH-DSS-DES-CBC3-SHA:!EDH-RSA-DES-CBC3-SHA:!KRB5-DES-CBC3-SHA"
 
 #ifndef _WIN32
@@ -78,23 +80,56 @@
 #define MIMETYPESFILE ".\\mime.types"
 #endif
 
-static ice_config_t _current_configuration;
+/* The configuration is an immutable snapshot, replaced as a whole on a reload.
+ * A reader publishes the snapshot it is using in a per-thread hold, and checks
+ * it is still the current one, so no shared lock is taken for reading. A reload
+ * publishes the new snapshot and retires the old, which is freed once no thread
+ * holds it. Nested gets in a thread use the snapshot already held.
+ */
+static ice_config_t *_current_configuration;
+static ice_config_t *_retired_configs;
 static ice_config_locks _locks;
+static int config_running;
 uint64_t config_updated = (uint64_t)0;
 
+struct config_hold
+{
+    struct config_hold *next;
+    ice_config_t *snap;     // not freed while set here
+    int depth;
+    int grabbed;            // depth at which config_lock was taken
+};
+
+static struct config_hold *_holds;
+static pthread_key_t _hold_key;
+
+struct config_garbage
+{
+    struct config_garbage *next;
+    void *ptr;
+};
+
+#ifdef HAVE_ATOMIC_BUILTINS
+#define config_ptr_load(p)      __atomic_load_n (p, __ATOMIC_SEQ_CST)
+#define config_ptr_store(p,v)   __atomic_store_n (p, v, __ATOMIC_SEQ_CST)
+#define config_hold_lock()      do {} while(0)
+#define config_hold_unlock()    do {} while(0)
+#else
+/* no atomics, so setting a hold and checking them are serialised instead */
+#define config_ptr_load(p)      (*(p))
+#define config_ptr_store(p,v)   (*(p) = (v))
+#define config_hold_lock()      thread_spin_lock (&_locks.hold_lock)
+#define config_hold_unlock()    thread_spin_unlock (&_locks.hold_lock)
+#endif
+
 static void _set_defaults(ice_config_t *c);
 static int  _parse_root (xmlNodePtr node, ice_config_t *config);
 
 static void create_locks(void)
 {
-    thread_rwlock_create(&_locks.config_lock);
+    thread_mutex_create(&_locks.config_lock);
     thread_spin_create(&_locks.mount_lock);
-}
-
-static void release_locks(void)
-{
-    thread_rwlock_destroy(&_locks.config_lock);
-    thread_spin_destroy(&_locks.mount_lock);
+    thread_spin_create(&_locks.hold_lock);
 }
 
 
@@ -327,15 +362,83 @@ int parse_xml_tags (xmlNodePtr parent, const struct cfg_tag *args)
 }
 
 
+static void config_hold_exit (void *arg)
+{
+    struct config_hold *hold = arg, **p;
+
+    thread_spin_lock (&_locks.hold_lock);
+    for (p = &_holds; *p; p = &(*p)->next)
+    {
+        if (*p == hold)
+        {
+            *p = hold->next;
+            break;
+        }
+    }
+    thread_spin_unlock (&_locks.hold_lock);
+    free (hold);
+}
+
+
+static struct config_hold *config_hold_get (void)
+{
+    struct config_hold *hold = pthread_getspecific (_hold_key);
+
+    if (hold == NULL)
+    {
+        hold = calloc (1, sizeof (struct config_hold));
+        if (hold == NULL)
+            abort();
+        pthread_setspecific (_hold_key, hold);
+        thread_spin_lock (&_locks.hold_lock);
+        hold->next = _holds;
+        _holds = hold;
+        thread_spin_unlock (&_locks.hold_lock);
+    }
+    return hold;
+}
+
+
+static int config_snapshot_held (ice_config_t *config)
+{
+    struct config_hold *hold;
+    int held = 0;
+
+    thread_spin_lock (&_locks.hold_lock);
+    for (hold = _holds; hold; hold = hold->next)
+    {
+        if (config_ptr_load (&hold->snap) == config)
+        {
+            held = 1;
+            break;
+        }
+    }
+    thread_spin_unlock (&_locks.hold_lock);
+    return held;
+}
+
+
 void config_initialize(void) {
     create_locks();
+    pthread_key_create (&_hold_key, config_hold_exit);
+    _current_configuration = calloc (1, sizeof (ice_config_t));
+    if (_current_configuration == NULL)
+        abort();
+    config_running = 1;
 }
 
+/* other threads may still be finishing, so the snapshot memory and locks are
+ * left, only the settings are released */
 void config_shutdown(void) {
-    config_get_config();
-    config_clear(&_current_configuration);
+    ice_config_t *config;
+
+    if (config_running == 0)
+        return;
+    config_running = 0;
+    config_reclaim();
+    config = config_grab_config();
+    config_clear(config);
     config_release_config();
-    release_locks();
 }
 
 void config_init_configuration(ice_config_t *configuration)
@@ -470,6 +573,13 @@ void config_clear(ice_config_t *c)
     aliases *alias, *nextalias;
     int i;
 
+    while (c->_garbage)
+    {
+        struct config_garbage *g = c->_garbage;
+        c->_garbage = g->next;
+        xmlFree (g->ptr);
+        free (g);
+    }
     free(c->config_filename);
 
     xmlFree (c->server_id);
@@ -490,6 +600,9 @@ void config_clear(ice_config_t *c)
     if (c->cipher_list) xmlFree(c->cipher_list);
     if (c->pidfile) xmlFree(c->pidfile);
     if (c->banfile) xmlFree(c->banfile);
+    if (c->worker_cpus) xmlFree (c->worker_cpus);
+    if (c->worker_nodes) xmlFree (c->worker_nodes);
+    if (c->acceptor_cpus) xmlFree (c->acceptor_cpus);
     if (c->allowfile) xmlFree (c->allowfile);
     if (c->agentfile) xmlFree (c->agentfile);
     if (c->preroll_log.name) xmlFree(c->preroll_log.name);
@@ -526,6 +639,7 @@ void config_clear(ice_config_t *c)
         c->redirect_hosts = config_clear_redirect (c->redirect_hosts);
 
     avl_tree_free (c->mounts_tree, config_clear_mount_from_tree);
+    mount_match_free (c->mounts_match);
     while (c->mounts)
     {
         mount_proxy *to_go = c->mounts;
@@ -564,7 +678,7 @@ void config_clear(ice_config_t *c)
 int config_initial_parse_file(const char *filename)
 {
     /* Since we're already pointing at it, we don't need to copy it in place */
-    return config_parse_file(filename, &_current_configuration);
+    return config_parse_file(filename, _current_configuration);
 }
 
 int config_parse_file(const char *filename, ice_config_t *configuration)
@@ -617,33 +731,114 @@ ice_config_locks *config_locks(void)
 
 void config_release_config(void)
 {
-    thread_rwlock_unlock(&(_locks.config_lock));
+    struct config_hold *hold = pthread_getspecific (_hold_key);
+
+    if (hold == NULL || hold->depth == 0)
+        return;
+    if (hold->grabbed == hold->depth)
+    {
+        hold->grabbed = 0;
+        thread_mutex_unlock (&_locks.config_lock);
+    }
+    if (--hold->depth == 0)
+        config_ptr_store (&hold->snap, NULL);
 }
 
 ice_config_t *config_get_config(void)
 {
-    thread_rwlock_rlock(&(_locks.config_lock));
-    return &_current_configuration;
+    struct config_hold *hold = config_hold_get();
+
+    if (hold->depth++ == 0)
+    {
+        ice_config_t *config;
+
+        config_hold_lock();
+        do
+        {
+            config = config_ptr_load (&_current_configuration);
+            config_ptr_store (&hold->snap, config);
+        } while (config != config_ptr_load (&_current_configuration));
+        config_hold_unlock();
+    }
+    return hold->snap;
 }
 
+/* for making changes, only one thread at a time */
 ice_config_t *config_grab_config(void)
 {
-    thread_rwlock_wlock(&(_locks.config_lock));
-    return &_current_configuration;
+    struct config_hold *hold = config_hold_get();
+    ice_config_t *config;
+
+    thread_mutex_lock (&_locks.config_lock);
+    config = config_get_config();
+    hold->grabbed = hold->depth;
+    return config;
 }
 
-/* MUST be called with the lock held! */
-void config_set_config (ice_config_t *new_config, ice_config_t *old_config)
+/* MUST be called with the lock held! The new settings are taken over by a new
+ * snapshot, the previous one is retired */
+void config_set_config (ice_config_t *new_config)
 {
-    if (old_config)
-        memcpy (old_config, &_current_configuration, sizeof(ice_config_t));
-    memcpy(&_current_configuration, new_config, sizeof(ice_config_t));
+    ice_config_t *config = malloc (sizeof (ice_config_t)), *old;
+
+    if (config == NULL)
+        abort();
+    memcpy (config, new_config, sizeof (ice_config_t));
+    old = _current_configuration;
+    config_hold_lock();
+    config_ptr_store (&_current_configuration, config);
+    config_hold_unlock();
+    old->_retired_next = _retired_configs;
+    _retired_configs = old;
     config_updated = timing_get_time();
 }
 
+/* free the retired snapshots no longer held by any thread */
+void config_reclaim (void)
+{
+    ice_config_t **p;
+
+    thread_mutex_lock (&_locks.config_lock);
+    p = &_retired_configs;
+    while (*p)
+    {
+        ice_config_t *config = *p;
+
+        if (config_snapshot_held (config))
+        {
+            p = &config->_retired_next;
+            continue;
+        }
+        *p = config->_retired_next;
+        config_clear (config);
+        free (config);
+        DEBUG0 ("previous configuration released");
+    }
+    thread_mutex_unlock (&_locks.config_lock);
+}
+
+/* replace a string setting of the running snapshot. Readers do not take the
+ * lock, so the new value goes out in one store and the old one, which they may
+ * still be using, is freed with the snapshot. Called with the lock held */
+void config_replace_string (ice_config_t *config, char **setting, const char *value)
+{
+    struct config_garbage *g;
+    char *old = config_ptr_load (setting);
+
+    config_ptr_store (setting, value ? (char *)xmlCharStrdup (value) : NULL);
+    if (old == NULL)
+        return;
+    g = malloc (sizeof (struct config_garbage));
+    if (g == NULL)
+        abort();
+    g->ptr = old;
+    g->next = config->_garbage;
+    config->_garbage = g;
+}
+
 ice_config_t *config_get_config_unlocked(void)
 {
-    return &_current_configuration;
+    return config_ptr_load (&_current_configuration);
 }
 
 
@@ -663,10 +858,13 @@ static void _set_defaults(ice_config_t *configuration)
     configuration->server_id = (char *)xmlCharStrdup (ICECAST_VERSION_STRING);
     configuration->admin = (char *)xmlCharStrdup (CONFIG_DEFAULT_ADMIN);
     configuration->cipher_list = (char *)xmlCharStrdup (CONFIG_DEFAULT_CIPHER_LIST);
+    configuration->ssl_session_cache = CONFIG_DEFAULT_SSL_SESSION_CACHE;
+    configuration->ssl_session_timeout = CONFIG_DEFAULT_SSL_SESSION_TIMEOUT;
     configuration->client_limit = CONFIG_DEFAULT_CLIENT_LIMIT;
     configuration->source_limit = CONFIG_DEFAULT_SOURCE_LIMIT;
     configuration->queue_size_limit = CONFIG_DEFAULT_QUEUE_SIZE_LIMIT;
     configuration->workers_count = 1;
+    configuration->acceptor_count = 1;
     configuration->client_timeout = CONFIG_DEFAULT_CLIENT_TIMEOUT;
     configuration->header_timeout = CONFIG_DEFAULT_HEADER_TIMEOUT;
     configuration->source_timeout = CONFIG_DEFAULT_SOURCE_TIMEOUT;
@@ -1028,6 +1226,8 @@ static int _parse_paths (xmlNodePtr node, void *arg)
         { "ssl-cafile",             config_get_str, &config->ca_file },
         { "ssl_certificate",        config_get_str, &config->cert_file },
         { "ssl-allowed-ciphers",    config_get_str, &config->cipher_list },
+        { "ssl-session-cache",      config_get_int, &config->ssl_session_cache },
+        { "ssl-session-timeout",    config_get_int, &config->ssl_session_timeout },
         { "webroot",        config_get_str, &config->webroot_dir },
         { "adminroot",      config_get_str, &config->adminroot_dir },
         { "alias",          _parse_alias,   config },
@@ -1110,6 +1310,8 @@ static int _parse_mount (xmlNodePtr node, void *arg)
         { "metadata-interval",  config_get_int,     &mount->mp3_meta_interval },
         { "mp3-metadata-interval",
                                 config_get_int,     &mount->mp3_meta_interval },
+        { "mp3-metadata-cache", config_get_bool,    &mount->mp3_meta_cache },
+        { "flv-cache",          config_get_bool,    &mount->flv_cache },
         { "ogg-passthrough",    config_get_bool,    &mount->ogg_passthrough },
         { "admin_comments_only",config_get_bool,    &mount->admin_comments_only },
         { "allow-url-ogg-metadata",
@@ -1118,6 +1320,7 @@ static int _parse_mount (xmlNodePtr node, void *arg)
         { "ban-client",         config_get_int,     &mount->ban_client },
         { "intro-skip-replay",  config_get_int,     &mount->intro_skip_replay },
         { "so-sndbuf",          config_get_int,     &mount->so_sndbuf },
+        { "zerocopy",           config_get_bool,    &mount->zerocopy },
         { "hidden",             config_get_bool,    &mount->hidden },
         { "authentication",     auth_get_authenticator, &mount->auth },
         { "on-connect",         config_get_str,     &mount->on_connect },
@@ -1197,7 +1400,6 @@ static int _parse_mount (xmlNodePtr node, void *arg)
 
     if (config_mount_template (mount->mountname))
     {
-        // may need some priority order imposed at some point
         mount->next = config->mounts;
         config->mounts = mount;
     }
@@ -1375,8 +1577,19 @@ static int _parse_limits (xmlNodePtr node, void *arg)
         { "min-queue-size", config_get_qsizing, &config->min_queue_size },
         { "burst-size",     config_get_qsizing, &config->burst_size },
         { "workers",        config_get_int,     &config->workers_count },
+        { "acceptors",      config_get_int,     &config->acceptor_count },
+        { "worker-cpus",    config_get_str,     &config->worker_cpus },
+        { "worker-nodes",   config_get_str,     &config->worker_nodes },
+        { "acceptor-cpus",  config_get_str,     &config->acceptor_cpus },
+        { "io-uring",       config_get_bool,    &config->io_uring },
         { "client-timeout", config_get_int,     &config->client_timeout },
         { "header-timeout", config_get_int,     &config->header_timeout },
+        { "connect-rate",   config_get_int,     &config->connect_rate },
+        { "connect-burst",  config_get_int,     &config->connect_burst },
+        { "connect-net-rate",
+                            config_get_int,     &config->connect_net_rate },
+        { "connect-net-burst",
+                            config_get_int,     &config->connect_net_burst },
         { "source-timeout", config_get_int,     &config->source_timeout },
         { "inactivity-timeout", config_get_int, &config->inactivity_timeout },
         { NULL, NULL, NULL },
@@ -1385,6 +1598,8 @@ static int _parse_limits (xmlNodePtr node, void *arg)
         return -1;
     if (config->workers_count < 1)   config->workers_count = 1;
     if (config->workers_count > 400) config->workers_count = 400;
+    if (config->acceptor_count < 1)  config->acceptor_count = 1;
+    if (config->acceptor_count > 64) config->acceptor_count = 64;
     return 0;
 }
 
@@ -1523,6 +1738,7 @@ static int _parse_root (xmlNodePtr node, ice_config_t *config)
     config->master_relay_auth = 1;
     if (parse_xml_tags (node, icecast_tags))
         return -1;
+    config->mounts_match = mount_match_compile (config->mounts);
 
     if (config->max_redirects == 0 && config->master_redirect)
         config->max_redirects = 1;
@@ -1568,18 +1784,7 @@ mount_proxy *config_find_mount (ice_config_t *_c, const char *mount)
 
     int missing = avl_get_by_key (config->mounts_tree, &findit, &result);
     if (missing)
-    {
-        mount_proxy *to_return = NULL;
-        mountinfo = config->mounts;
-        while (mountinfo)
-        {
-            if (fnmatch (mountinfo->mountname, mount, 0) == 0)
-                to_return = mountinfo;
-            mountinfo = mountinfo->next;
-        }
-        if (mountinfo == NULL)
-            mountinfo = to_return;
-    }
+        mountinfo = mount_match_find (config->mounts_match, mount);
     else
         mountinfo = result;
     if (_c == NULL)
@@ -125,6 +125,7 @@ typedef struct _mount_proxy {
     int no_mount; /* Do we permit direct requests of this mountpoint? (or only
                      indirect, through fallbacks) */
     int so_sndbuf;      /* TCP send buffer size for new clients */
+    int zerocopy;       /* send queue blocks to listeners with MSG_ZEROCOPY */
     uint32_t burst_size;
     uint32_t min_queue_size;     /* minimum length of queue */
     uint32_t queue_size_limit;
@@ -134,6 +135,8 @@ typedef struct _mount_proxy {
     char *charset;  /* character set if not utf8 */
     int allow_chunked; /* allow chunked transfers */
     int mp3_meta_interval; /* outgoing per-stream metadata interval */
+    int mp3_meta_cache; /* keep queue blocks with the metadata inserted for the interval */
+    int flv_cache; /* keep queue blocks wrapped in flv tags for flv listeners */
     int max_send_size;
     int filter_theora; /* prevent theora pages getting queued */
     int url_ogg_meta; /* enable to allow updates via url requests for ogg */
@@ -261,10 +264,19 @@ typedef struct ice_config_tag
     unsigned int queue_size_limit;
     int min_queue_size;
     int workers_count;
+    int acceptor_count;
+    char *worker_cpus;
+    char *worker_nodes;
+    char *acceptor_cpus;
+    int io_uring;
     uint32_t burst_size;
     int client_timeout;
     int header_timeout;
     int source_timeout;
+    int connect_rate;
+    int connect_burst;
+    int connect_net_rate;
+    int connect_net_burst;
     int ice_login;
     int64_t max_bandwidth;
     int max_listeners;
@@ -308,6 +320,7 @@ typedef struct ice_config_tag
 
     mount_proxy *mounts;
     avl_tree *mounts_tree;
+    struct mount_match *mounts_match;   // the templates in mounts, compiled
 
     char *server_id;
     char *base_dir;
@@ -320,6 +333,8 @@ typedef struct ice_config_tag
     char *key_file;
     char *ca_file;
     char *cipher_list;
+    int ssl_session_cache;
+    int ssl_session_timeout;
     char *webroot_dir;
     char *adminroot_dir;
     struct _aliases *aliases;
@@ -338,11 +353,15 @@ typedef struct ice_config_tag
     int    yp_url_timeout[MAX_YP_DIRECTORIES];
     int    yp_touch_interval[MAX_YP_DIRECTORIES];
     int num_yp_directories;
+
+    struct ice_config_tag *_retired_next;   // replaced, waiting for readers to move on
+    struct config_garbage *_garbage;        // replaced settings, freed with the snapshot
 } ice_config_t;
 
 typedef struct {
-    rwlock_t config_lock;
+    mutex_t config_lock;    // serialises changes, readers do not take it
     spin_t mount_lock;
+    spin_t hold_lock;       // list of per-thread config holds
 } ice_config_locks;
 
 void config_initialize(void);
@@ -351,7 +370,9 @@ void config_shutdown(void);
 int config_parse_file(const char *filename, ice_config_t *configuration);
 int config_initial_parse_file(const char *filename);
 int config_parse_cmdline(int arg, char **argv);
-void config_set_config (ice_config_t *new_config, ice_config_t *old_config);
+void config_set_config (ice_config_t *new_config);
+void config_reclaim (void);
+void config_replace_string (ice_config_t *config, char **setting, const char *value);
 listener_t *config_clear_listener (listener_t *listener);
 relay_server *config_clear_relay (relay_server *relay);
 void config_clear(ice_config_t *config);
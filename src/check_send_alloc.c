@@ -0,0 +1,467 @@
+/* -*- c-basic-offset: 4; -*- */
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* check_send_alloc.c
+ *
+ * Check that sending the stream to a listener does not touch the heap once
+ * things have settled. Queue blocks of mp3 frames are sent over a loopback
+ * socket through the mp3 format handler, as the source does for its listeners,
+ * for plain, icy metadata, chunked, iceblock and flv listeners, both directly
+ * and through the held paths for batched and zerocopy sends. Each case is run
+ * once to fill the pools and then again counting calls to the allocator, any
+ * call is a failure. What the other end receives is kept for the direct sends
+ * and the batched and zerocopy sends of the same listener type must match it
+ * byte for byte. Run with make check.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include "global.h"
+#include "refbuf.h"
+#include "client.h"
+#include "connection.h"
+#include "format.h"
+#include "format_mp3.h"
+#include "mpeg.h"
+#include "flv.h"
+#include "sendbatch.h"
+#include "source.h"
+#include "logging.h"
+
+#define CATMODULE "check"
+
+#define CHECK_BLOCKS        32      // queue blocks, linked in a ring
+#define CHECK_FRAMES        3       // mp3 frames in a block
+#define CHECK_FRAME_LEN     417     // 128k 44.1kHz mpeg1 layer 3
+#define CHECK_PASSES        200     // times round the ring when counting
+#define CHECK_PASS_BLOCKS   6       // blocks sent to the listener in one go
+#define CHECK_INTERVAL      2000    // icy metadata interval
+#define CHECK_CAPTURE       ((size_t)CHECK_BLOCKS * (CHECK_PASSES + 2) * CHECK_FRAMES * CHECK_FRAME_LEN * 5 / 4)
+
+
+#ifdef __GLIBC__
+/* everything goes through these so calls can be counted while the stream is
+ * being sent, the glibc allocator does the work */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t num, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void  __libc_free (void *ptr);
+
+static int counting;
+static unsigned long alloc_calls;
+
+void *malloc (size_t size)
+{
+    if (counting) alloc_calls++;
+    return __libc_malloc (size);
+}
+
+void *calloc (size_t num, size_t size)
+{
+    if (counting) alloc_calls++;
+    return __libc_calloc (num, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    if (counting) alloc_calls++;
+    return __libc_realloc (ptr, size);
+}
+
+void free (void *ptr)
+{
+    if (counting && ptr) alloc_calls++;
+    __libc_free (ptr);
+}
+#endif
+
+
+/* logging.c reports fatal errors through this, normally from main.c */
+void fatal_error (const char *perr)
+{
+    fprintf (stderr, "%s\n", perr);
+}
+
+
+struct check
+{
+    const char *name;
+    unsigned int client_flags;
+    int interval;
+    int zerocopy;
+    int batch;
+    int capture;    // listener type, the first case of each records the output
+};
+
+/* output of the direct send of a listener type */
+struct capture
+{
+    const char *name;
+    char *data;
+    size_t len;
+};
+
+static struct capture captures [5];
+static struct capture *capture;
+static size_t capture_pos;
+static long capture_differs;
+static int capture_record;
+
+static refbuf_t *queue [CHECK_BLOCKS];
+static struct metadata_block meta [2];
+static format_plugin_t plugin;
+static sock_t reader;
+static uint64_t frame_no;
+
+
+static refbuf_t *check_meta_refbuf (const char *s, int pad)
+{
+    int len = strlen (s), size = pad ? ((len + 15) & ~15) + 1 : len;
+    refbuf_t *r = refbuf_new (size);
+
+    memset (r->data, 0, size);
+    if (pad)
+    {
+        r->data[0] = (size - 1) / 16;
+        memcpy (r->data + 1, s, len);
+    }
+    else
+        memcpy (r->data, s, len);
+    return r;
+}
+
+
+/* make a ring of queue blocks, metadata changing every 8 blocks */
+static void check_queue_setup (void)
+{
+    int i, f;
+
+    meta[0].icy = check_meta_refbuf ("StreamTitle='first';", 1);
+    meta[1].icy = check_meta_refbuf ("StreamTitle='second';", 1);
+    meta[0].iceblock = check_meta_refbuf ("\001first", 0);
+    meta[1].iceblock = check_meta_refbuf ("\001second", 0);
+    for (i = 0; i < 2; i++)
+    {
+        meta[i].flv = flv_meta_allocate (200);
+        flv_meta_append_string (meta[i].flv, "title", i ? "second" : "first");
+        flv_meta_append_string (meta[i].flv, NULL, NULL);
+    }
+    for (i = 0; i < CHECK_BLOCKS; i++)
+    {
+        refbuf_t *r = refbuf_new (CHECK_FRAMES * CHECK_FRAME_LEN);
+
+        for (f = 0; f < CHECK_FRAMES; f++)
+        {
+            unsigned char *frame = (unsigned char *)r->data + f * CHECK_FRAME_LEN;
+
+            memset (frame, (int)(frame_no & 0xFF), CHECK_FRAME_LEN);
+            frame[0] = 0xFF; frame[1] = 0xFB; frame[2] = 0x90; frame[3] = 0x00;
+            frame_no++;
+        }
+        r->flags |= SOURCE_QUEUE_BLOCK;
+        r->chunk_hdrlen = connection_chunk_header (r->chunk_hdr, r->len);
+        r->associated = &meta [(i / 8) & 1];
+        queue [i] = r;
+    }
+    for (i = 0; i < CHECK_BLOCKS; i++)
+        queue [i]->next = queue [(i + 1) % CHECK_BLOCKS];
+}
+
+
+/* keep what arrived if recording, else compare it with the recorded output */
+static void check_capture (const char *buf, size_t len)
+{
+    if (capture_record)
+    {
+        if (capture_pos + len > CHECK_CAPTURE)
+            len = CHECK_CAPTURE - capture_pos;
+        memcpy (capture->data + capture_pos, buf, len);
+    }
+    else if (capture_differs < 0)
+    {
+        size_t i = 0;
+
+        while (i < len && capture_pos + i < capture->len && buf[i] == capture->data [capture_pos + i])
+            i++;
+        if (i < len)
+            capture_differs = (long)(capture_pos + i);
+    }
+    capture_pos += len;
+}
+
+
+static void check_drain (int flags)
+{
+    char buf [16384];
+    ssize_t got;
+
+    while ((got = recv (reader, buf, sizeof buf, flags)) > 0)
+        check_capture (buf, got);
+}
+
+
+/* a connected pair over loopback, zerocopy needs tcp */
+static sock_t check_socket_pair (void)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof sa;
+    sock_t listener, writer;
+
+    memset (&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    listener = socket (AF_INET, SOCK_STREAM, 0);
+    if (listener == SOCK_ERROR || bind (listener, (struct sockaddr *)&sa, sizeof sa) < 0 ||
+            listen (listener, 1) < 0 || getsockname (listener, (struct sockaddr *)&sa, &len) < 0)
+        return SOCK_ERROR;
+    writer = socket (AF_INET, SOCK_STREAM, 0);
+    if (writer == SOCK_ERROR || connect (writer, (struct sockaddr *)&sa, sizeof sa) < 0)
+        return SOCK_ERROR;
+    reader = accept (listener, NULL, NULL);
+    sock_close (listener);
+    if (reader == SOCK_ERROR)
+        return SOCK_ERROR;
+    sock_set_blocking (writer, 0);
+    return writer;
+}
+
+
+/* send blocks in passes of a few at a time, the way a worker runs a listener
+ * through source_queue_advance, returns blocks sent */
+static unsigned int check_send (client_t *client, send_batch_t *batch, unsigned int blocks)
+{
+    unsigned int sent = 0, stalls = 0;
+
+    while (sent < blocks && stalls < 1000 && client->connection.error == 0)
+    {
+        int loop = CHECK_PASS_BLOCKS, ret = 0;
+
+        client->connection.send_batch = batch;
+        while (loop && sent < blocks)
+        {
+            refbuf_t *refbuf = client->refbuf;
+
+            ret = 0;
+            if (client->pos < refbuf->len)
+            {
+                client->connection.shared_block = refbuf;
+                ret = plugin.write_buf_to_client (client);
+                client->connection.shared_block = NULL;
+            }
+            if (client->pos < refbuf->len)
+            {
+                if (ret <= 0)
+                    break;
+                loop--;         // part sent, as for icy metadata, carry on with the rest
+                continue;
+            }
+            client->refbuf = refbuf->next;
+            client->pos = 0;
+            sent++;
+            loop--;
+        }
+        client->connection.send_batch = NULL;
+        if (batch)
+            send_batch_flush (batch);
+        if (client->connection.held)
+            connection_send_held (&client->connection);
+        if (loop == CHECK_PASS_BLOCKS)
+            stalls++;
+        else
+            stalls = 0;
+        check_drain (MSG_DONTWAIT);
+    }
+    return sent;
+}
+
+
+/* write out anything still held and read the rest of the stream, returns 0 if
+ * it matches the recorded output */
+static int check_output (const struct check *c, client_t *client)
+{
+    connection_t *con = &client->connection;
+    int stalls = 0;
+
+    while ((con->held || con->batch_queued) && con->error == 0 && stalls < 1000)
+    {
+        if (connection_send_held (con) < 0)
+            stalls++;
+        check_drain (MSG_DONTWAIT);
+    }
+    shutdown (con->sock, SHUT_WR);
+    check_drain (0);
+    if (capture_record)
+    {
+        capture->len = capture_pos;
+        if (capture_pos > CHECK_CAPTURE)
+        {
+            printf ("%-12s output of %lu bytes is too large to keep\n", c->name, (unsigned long)capture_pos);
+            return 1;
+        }
+        return 0;
+    }
+    if (capture_differs < 0 && capture_pos != capture->len)
+        capture_differs = (long)(capture_pos < capture->len ? capture_pos : capture->len);
+    if (capture_differs < 0)
+        return 0;
+    printf ("%-12s output of %lu bytes differs from %s (%lu bytes) at byte %ld\n", c->name,
+            (unsigned long)capture_pos, capture->name, (unsigned long)capture->len, capture_differs);
+    return 1;
+}
+
+
+static int check_run (const struct check *c, send_batch_t *batch)
+{
+    client_t *client = calloc (1, sizeof (client_t));
+    unsigned long calls = 0;
+    unsigned int sent;
+    int failed = 0;
+
+    client->connection.sock = check_socket_pair ();
+    client->connection.ip = strdup ("127.0.0.1");
+    client->flags = c->client_flags;
+    client->throttle = 1;
+    if (client->connection.sock == SOCK_ERROR)
+    {
+        printf ("%-12s unable to connect over loopback, %s\n", c->name, strerror (errno));
+        return 1;
+    }
+    if (c->zerocopy && connection_zerocopy_enable (&client->connection) < 0)
+    {
+        printf ("%-12s skipped, no zerocopy\n", c->name);
+        goto done;
+    }
+    if (c->batch && batch == NULL)
+    {
+        printf ("%-12s skipped, no batched sends\n", c->name);
+        goto done;
+    }
+    client->refbuf = refbuf_new (4096);     // for the response headers
+    client->refbuf->len = 0;
+    if (c->client_flags & CLIENT_WANTS_FLV)
+        plugin.create_client_data (&plugin, client);
+    else
+    {
+        mp3_client_data *client_mp3 = calloc (1, sizeof (mp3_client_data));
+        client_mp3->interval = c->interval;
+        client->format_data = client_mp3;
+    }
+    refbuf_release (client->refbuf);
+    client->refbuf = queue [0];
+    client->pos = 0;
+
+    capture = &captures [c->capture];
+    capture_record = capture->data ? 0 : 1;
+    if (capture_record)
+    {
+        capture->name = c->name;
+        capture->data = malloc (CHECK_CAPTURE);
+        if (capture->data == NULL)
+            abort();
+    }
+    capture_pos = 0;
+    capture_differs = -1;
+
+    // twice round to fill the pools and caches, then count
+    sent = check_send (client, c->batch ? batch : NULL, CHECK_BLOCKS * 2);
+    if (sent == CHECK_BLOCKS * 2)
+    {
+#ifdef __GLIBC__
+        alloc_calls = 0;
+        counting = 1;
+#endif
+        sent = check_send (client, c->batch ? batch : NULL, CHECK_BLOCKS * CHECK_PASSES);
+#ifdef __GLIBC__
+        counting = 0;
+        calls = alloc_calls;
+#endif
+    }
+    if (sent < CHECK_BLOCKS * CHECK_PASSES)
+    {
+        printf ("%-12s stalled after %u blocks\n", c->name, sent);
+        failed = 1;
+    }
+    else
+    {
+        failed = check_output (c, client);
+        printf ("%-12s %u blocks, %lu bytes, %lu allocator calls\n", c->name, sent,
+                (unsigned long)capture_pos, calls);
+        if (calls)
+            failed = 1;
+    }
+    if (client->free_client_data)
+        client->free_client_data (client);
+    else
+        free (client->format_data);
+done:
+    connection_close (&client->connection);
+    connection_linger (0);
+    sock_close (reader);
+    free (client);
+    return failed;
+}
+
+
+int main (void)
+{
+    static const struct check checks[] =
+    {
+        { "plain",      0,                  0,                  0, 0, 0 },
+        { "icy",        0,                  CHECK_INTERVAL,     0, 0, 1 },
+        { "chunked",    CLIENT_CHUNKED,     0,                  0, 0, 2 },
+        { "iceblocks",  CLIENT_WANTS_META,  0,                  0, 0, 3 },
+        { "flv",        CLIENT_WANTS_FLV,   0,                  0, 0, 4 },
+        { "plain-batch", 0,                 0,                  0, 1, 0 },
+        { "icy-batch",  0,                  CHECK_INTERVAL,     0, 1, 1 },
+        { "chunk-batch", CLIENT_CHUNKED,    0,                  0, 1, 2 },
+        { "flv-batch",  CLIENT_WANTS_FLV,   0,                  0, 1, 4 },
+        { "plain-zc",   0,                  0,                  1, 0, 0 },
+        { "icy-zc",     0,                  CHECK_INTERVAL,     1, 0, 1 },
+        { "chunk-zc",   CLIENT_CHUNKED,     0,                  1, 0, 2 },
+        { "flv-zc",     CLIENT_WANTS_FLV,   0,                  1, 0, 4 },
+        { NULL }
+    };
+    send_batch_t *batch;
+    int i, failed = 0;
+
+#ifndef __GLIBC__
+    printf ("allocator calls cannot be counted here\n");
+    return 77;  // skipped
+#endif
+    thread_initialize ();
+    global_initialize ();
+    sock_initialize ();
+    connection_initialize ();
+    refbuf_initialize ();
+
+    plugin.mount = "/check.mp3";
+    plugin.type = FORMAT_TYPE_MPEG;
+    format_mp3_get_plugin (&plugin);
+    check_queue_setup ();
+    batch = send_batch_create (16);
+
+    for (i = 0; checks[i].name; i++)
+        failed |= check_run (&checks[i], batch);
+
+    send_batch_destroy (batch);
+    for (i = 0; i < 5; i++)
+        free (captures[i].data);
+    printf ("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
@@ -24,9 +24,16 @@
 #endif
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "thread/thread.h"
 #include "avl/avl.h"
@@ -46,6 +53,8 @@
 #include "slave.h"
 #include "global.h"
 #include "util.h"
+#include "sendbatch.h"
+#include "objpool.h"
 
 #undef CATMODULE
 #define CATMODULE "client"
@@ -53,10 +62,93 @@
 int worker_count = 0, worker_min_count;
 worker_t *worker_balance_to_check, *worker_least_used, *worker_incoming = NULL;
 
+#define WORKER_STEAL_LOAD       400     /* per-mille busy before others take clients */
+#define WORKER_STEAL_MAX        200     /* most clients moved in one go */
+#define WORKER_NODES_MAX        64      /* NUMA nodes tracked for placement */
+
+#define WORKER_BATCH_ENTRIES    512     /* sends submitted in one go */
+
+#define CLIENT_POOL_LIMIT       64      /* clients and parsers cached per thread */
+
+static char *worker_cpus, *worker_nodes;
+static int worker_placement_changed = 1;
+static int worker_send_batching;
+
 FD_t logger_fd[2];
 
 static void logger_commits (int id);
 
+/* released clients and request parsers are reused, each worker keeping those it
+ * releases. New ones are mostly made by the acceptors so come via the depot */
+static objpool_t client_pool, parser_pool;
+
+
+void client_initialize (void)
+{
+    objpool_initialize (&client_pool, "client", CLIENT_POOL_LIMIT);
+    objpool_initialize (&parser_pool, "parser", CLIENT_POOL_LIMIT);
+}
+
+
+void client_shutdown (void)
+{
+    objpool_shutdown (&client_pool);
+    objpool_shutdown (&parser_pool);
+}
+
+
+client_t *client_new (void)
+{
+    client_t *client = objpool_get (&client_pool);
+
+    if (client == NULL)
+    {
+        client = calloc (1, sizeof (client_t));
+        if (client == NULL)
+            abort();
+    }
+    else
+        memset (client, 0, sizeof (client_t));
+    return client;
+}
+
+
+void client_free (client_t *client)
+{
+    objpool_put (&client_pool, client);
+}
+
+
+http_parser_t *client_parser_new (void)
+{
+    http_parser_t *parser = objpool_get (&parser_pool);
+
+    if (parser == NULL)
+    {
+        parser = httpp_create_parser();
+        if (parser == NULL)
+            abort();
+    }
+    httpp_initialize (parser, NULL);
+    return parser;
+}
+
+
+void client_parser_release (http_parser_t *parser)
+{
+    if (parser == NULL)
+        return;
+    httpp_clear (parser);
+    objpool_put (&parser_pool, parser);
+}
+
+
+void client_pool_counts (int parsers, uint64_t *hits, uint64_t *misses, uint64_t *cached)
+{
+    *hits = *misses = *cached = 0;
+    objpool_counts (parsers ? &parser_pool : &client_pool, hits, misses, cached);
+}
+
 
 void client_register (client_t *client)
 {
@@ -105,6 +197,11 @@ void client_destroy(client_t *client)
     if (client->flags & CLIENT_AUTHENTICATED)
         DEBUG1 ("client still in auth \"%s\"", httpp_getvar (client->parser, HTTPP_VAR_URI));
 
+    /* anything still held for sending goes out now if it can, so the log
+     * shows what the socket took */
+    if (client->connection.held)
+        connection_send_held (&client->connection);
+
     /* write log entry if ip is set (some things don't set it, like outgoing 
      * slave requests
      */
@@ -118,8 +215,7 @@ void client_destroy(client_t *client)
         client->flags &= ~CLIENT_IP_BAN_LIFT;
     }
 
-    if (client->parser)
-        httpp_destroy (client->parser);
+    client_parser_release (client->parser);
 
     /* we need to free client specific format data (if any) */
     if (client->free_client_data)
@@ -147,7 +243,7 @@ void client_destroy(client_t *client)
             global_unlock ();
             connection_close (&client->connection);
 
-            free(client);
+            client_free (client);
             return;
         }
         global_unlock ();
@@ -392,7 +488,7 @@ int client_send_bytes (client_t *client, const void *buf, unsigned len)
     int (*con_send)(struct connection_tag *handle, const void *buf, size_t len) = connection_send;
     int ret;
 #ifdef HAVE_OPENSSL
-    if (client->connection.ssl)
+    if (plain_send_connection (&client->connection) == 0)
         con_send = connection_send_ssl;
 #endif
     ret = con_send (&client->connection, buf, len);
@@ -476,30 +572,140 @@ static uint64_t worker_check_time_ms (worker_t *worker)
 }
 
 
+/* Clients are handed to a worker on an intrusive multi-producer, single consumer
+ * queue (as described by D. Vyukov), so other threads never wait on the worker
+ * lock, which is held while the worker walks its clients. Only the worker pops.
+ * The workers_lock is held by producers so the worker cannot go away.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define pending_exchange(p,v)       __atomic_exchange_n (p, v, __ATOMIC_ACQ_REL)
+#define pending_load(p)             __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define pending_store(p,v)          __atomic_store_n (p, v, __ATOMIC_RELEASE)
+#define pending_count_add(w,n)      (void)__atomic_add_fetch (&(w)->pending_count, n, __ATOMIC_SEQ_CST)
+#define worker_pending_count(w)     __atomic_load_n (&(w)->pending_count, __ATOMIC_SEQ_CST)
+#define pending_lock(w)             do {} while(0)
+#define pending_unlock(w)           do {} while(0)
+#else
+/* no atomics, so the queue is serialised on a lock of its own */
+static worker_pending_t *pending_exchange (worker_pending_t **p, worker_pending_t *v)
+{
+    worker_pending_t *old = *p;
+    *p = v;
+    return old;
+}
+#define pending_load(p)             (*(p))
+#define pending_store(p,v)          (*(p) = (v))
+#define pending_count_add(w,n)      ((w)->pending_count += (n))
+#define worker_pending_count(w)     ((w)->pending_count)
+#define pending_lock(w)             thread_spin_lock (&(w)->pending_lock)
+#define pending_unlock(w)           thread_spin_unlock (&(w)->pending_lock)
+#endif
+
+static void worker_pending_init (worker_t *worker)
+{
+    worker->pending_stub.next = NULL;
+    worker->pending_head = worker->pending_tail = &worker->pending_stub;
+#ifndef HAVE_ATOMIC_BUILTINS
+    thread_spin_create (&worker->pending_lock);
+#endif
+}
+
+
+static void worker_pending_push (worker_t *worker, worker_pending_t *node)
+{
+    worker_pending_t *prev;
+
+    node->next = NULL;
+    prev = pending_exchange (&worker->pending_head, node);
+    pending_store (&prev->next, node);
+}
+
+
+/* only called by the worker, returns NULL if empty or if a push is part way
+ * through, in which case the producer will signal the worker once complete */
+static client_t *worker_pending_pop (worker_t *worker)
+{
+    worker_pending_t *tail, *next;
+
+    pending_lock (worker);
+    tail = worker->pending_tail;
+    next = pending_load (&tail->next);
+    if (tail == &worker->pending_stub)
+    {
+        if (next == NULL)
+        {
+            pending_unlock (worker);
+            return NULL;
+        }
+        worker->pending_tail = tail = next;
+        next = pending_load (&next->next);
+    }
+    if (next == NULL)
+    {
+        if (tail != pending_load (&worker->pending_head))
+        {
+            pending_unlock (worker);
+            return NULL;
+        }
+        worker_pending_push (worker, &worker->pending_stub);
+        next = pending_load (&tail->next);
+        if (next == NULL)
+        {
+            pending_unlock (worker);
+            return NULL;
+        }
+    }
+    worker->pending_tail = next;
+    pending_unlock (worker);
+    return (client_t *)((char *)tail - offsetof (client_t, pending));
+}
+
+
+/* pick the worker with the least measured load, or fewest clients if similar. The
+ * least busy on each NUMA node is also recorded for those workers placed on one
+ */
 static worker_t *find_least_busy_handler (int log)
 {
     worker_t *min = workers;
-    int min_count = INT_MAX;
+    int min_count = INT_MAX, min_load = INT_MAX;
 
     if (workers && workers->next)
     {
-        worker_t *handler = workers;
+        worker_t *handler = workers, *near [WORKER_NODES_MAX] = { NULL };
+        int near_count [WORKER_NODES_MAX], near_load [WORKER_NODES_MAX];
 
         while (handler)
         {
             thread_spin_lock (&handler->lock);
-            int cur_count = handler->count + handler->pending_count;
+            int cur_count = handler->count + worker_pending_count (handler);
+            int cur_load = handler->load;
+            int node = handler->node;
             thread_spin_unlock (&handler->lock);
 
-            if (log) DEBUG2 ("handler %p has %d clients", handler, cur_count);
-            if (cur_count < min_count)
+            if (log) DEBUG4 ("handler %p has %d clients, load %d, node %d", handler, cur_count, cur_load, node);
+            if (cur_load + WORKER_LOAD_SLACK < min_load ||
+                    (cur_load < min_load + WORKER_LOAD_SLACK && cur_count < min_count))
             {
                 min = handler;
                 min_count = cur_count;
+                min_load = cur_load;
+            }
+            if (node >= 0 && node < WORKER_NODES_MAX && (near [node] == NULL ||
+                        cur_load + WORKER_LOAD_SLACK < near_load [node] ||
+                        (cur_load < near_load [node] + WORKER_LOAD_SLACK && cur_count < near_count [node])))
+            {
+                near [node] = handler;
+                near_count [node] = cur_count;
+                near_load [node] = cur_load;
             }
             handler = handler->next;
         }
         worker_min_count = min_count;
+        for (handler = workers; handler; handler = handler->next)
+        {
+            int node = handler->node;
+            handler->least_near = (node >= 0 && node < WORKER_NODES_MAX) ? near [node] : NULL;
+        }
     }
     return min;
 }
@@ -511,14 +717,25 @@ worker_t *worker_selected (void)
 }
 
 
-/* worker mutex should be already locked */
+/* like worker_selected but keeping to the NUMA node of the worker provided, if it
+ * has been placed on one. Caller holds workers_lock
+ */
+worker_t *worker_selected_near (worker_t *worker)
+{
+    if (worker && worker->least_near)
+        return worker->least_near;
+    return worker_least_used;
+}
+
+
+/* queue the client for the worker, the caller signals the worker */
 static void worker_add_client (worker_t *worker, client_t *client)
 {
-    ++worker->pending_count;
-    client->next_on_worker = NULL;
-    *worker->pending_clients_tail = client;
-    worker->pending_clients_tail = &client->next_on_worker;
     client->worker = worker;
+    pending_lock (worker);
+    pending_count_add (worker, 1);
+    worker_pending_push (worker, &client->pending);
+    pending_unlock (worker);
 }
 
 
@@ -526,11 +743,10 @@ int client_change_worker (client_t *client, worker_t *dest_worker)
 {
     if (dest_worker->running == 0)
         return 0;
-    client->next_on_worker = NULL;
 
-    thread_spin_lock (&dest_worker->lock);
+    if (client->connection.batch_queued)
+        send_batch_flush (client->connection.batch_queued); // keep the stream in order
     worker_add_client (dest_worker, client);
-    thread_spin_unlock (&dest_worker->lock);
     worker_wakeup (dest_worker);
 
     return 1;
@@ -544,12 +760,9 @@ void client_add_worker (client_t *client)
     thread_rwlock_rlock (&workers_lock);
     /* add client to the handler with the least number of clients */
     handler = worker_selected();
-    thread_spin_lock (&handler->lock);
-    thread_rwlock_unlock (&workers_lock);
-
     worker_add_client (handler, client);
-    thread_spin_unlock (&handler->lock);
     worker_wakeup (handler);
+    thread_rwlock_unlock (&workers_lock);
 }
 
 
@@ -559,12 +772,9 @@ void client_add_incoming (client_t *client)
 
     thread_rwlock_rlock (&workers_lock);
     handler = worker_incoming;
-    thread_spin_lock (&handler->lock);
-    thread_rwlock_unlock (&workers_lock);
-
     worker_add_client (handler, client);
-    thread_spin_unlock (&handler->lock);
     worker_wakeup (handler);
+    thread_rwlock_unlock (&workers_lock);
 }
 
 
@@ -600,38 +810,579 @@ void worker_control_create (FD_t wakeup_fd[])
 }
 
 
-static client_t **worker_add_pending_clients (worker_t *worker)
+/* The worker control feed is an eventfd where available, in which case both
+ * descriptors are the same. A flag records that the feed has been signalled
+ * but not yet drained by the worker so that repeated wakeups can skip the write.
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define worker_signalled_set(w)     __atomic_exchange_n (&(w)->wakeup_signalled, 1, __ATOMIC_SEQ_CST)
+#define worker_signalled_clear(w)   (void)__atomic_exchange_n (&(w)->wakeup_signalled, 0, __ATOMIC_SEQ_CST)
+#else
+#define worker_signalled_set(w)     (0)
+#define worker_signalled_clear(w)   do {} while(0)
+#endif
+
+static void worker_control_open (worker_t *worker)
+{
+#ifdef HAVE_EVENTFD
+    int fd = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (fd >= 0)
+    {
+        worker->wakeup_fd[0] = worker->wakeup_fd[1] = fd;
+        return;
+    }
+    WARN1 ("eventfd failed, using pipe (%s)", strerror (errno));
+#endif
+    worker_control_create (&worker->wakeup_fd[0]);
+}
+
+
+static void worker_control_close (worker_t *worker)
+{
+    if (worker->wakeup_fd[1] != worker->wakeup_fd[0])
+        sock_close (worker->wakeup_fd[1]);
+    sock_close (worker->wakeup_fd[0]);
+}
+
+
+/* Clients on a worker are kept on a hashed timer wheel keyed on schedule_ms, so
+ * that a pass only visits those due. Clients scheduled beyond one turn of the
+ * wheel stay in their slot and are skipped until due. Clients that are not
+ * active are waiting on another thread, so they are held on an idle list and
+ * rechecked when the worker is woken. The links are only valid while the worker
+ * lock is held and a client taken for processing is on neither.
+ */
+#define WORKER_WHEEL_SLOTS      1024        /* power of 2 */
+#define WORKER_WHEEL_TICK_MS    4
+
+static void worker_timer_link (client_t **headp, client_t *client)
+{
+    client->timer_next = *headp;
+    if (*headp)
+        (*headp)->timer_prevp = &client->timer_next;
+    client->timer_prevp = headp;
+    *headp = client;
+}
+
+
+static void worker_timer_unlink (client_t *client)
+{
+    if (client->timer_prevp)
+    {
+        *client->timer_prevp = client->timer_next;
+        if (client->timer_next)
+            client->timer_next->timer_prevp = client->timer_prevp;
+        client->timer_next = NULL;
+        client->timer_prevp = NULL;
+    }
+}
+
+
+static void worker_timer_arm (worker_t *worker, client_t *client)
+{
+    uint64_t tick = client->schedule_ms / WORKER_WHEEL_TICK_MS;
+
+    if ((client->flags & CLIENT_ACTIVE) == 0)
+    {
+        worker_timer_link (&worker->idle_clients, client);
+        return;
+    }
+    if (tick < worker->wheel_tick)
+        tick = worker->wheel_tick;
+    worker_timer_link (&worker->wheel [tick & (WORKER_WHEEL_SLOTS-1)], client);
+}
+
+
+/* move the clients due by due_ms onto the run list. All active clients are run
+ * when the worker is stopping */
+static void worker_timer_expire (worker_t *worker, client_t **runp, uint64_t due_ms)
+{
+    uint64_t tick = worker->wheel_tick, last = due_ms / WORKER_WHEEL_TICK_MS, end = last;
+    unsigned int count = 0;
+
+    if (last < tick)
+        last = end = tick;
+    if (worker->running == 0 || last - tick >= WORKER_WHEEL_SLOTS)
+        end = tick + WORKER_WHEEL_SLOTS - 1;
+    for (; tick <= end; tick++)
+    {
+        client_t **p = &worker->wheel [tick & (WORKER_WHEEL_SLOTS-1)];
+
+        while (*p)
+        {
+            client_t *client = *p;
+
+            if (worker->running && client->schedule_ms > due_ms)
+            {
+                p = &client->timer_next;
+                continue;
+            }
+            worker_timer_unlink (client);
+            if ((client->flags & CLIENT_ACTIVE) == 0)
+            {
+                worker_timer_link (&worker->idle_clients, client);
+                continue;
+            }
+            *runp = client;
+            runp = &client->timer_next;
+            if (++count >= 9000 && worker->running)
+            {
+                /* enough for one pass, resume from here */
+                worker->wheel_tick = (tick < last) ? tick : last;
+                return;
+            }
+        }
+    }
+    worker->wheel_tick = last;
+}
+
+
+/* time of the earliest client on the wheel */
+static uint64_t worker_timer_next (worker_t *worker)
+{
+    uint64_t tick = worker->wheel_tick, next = worker->time_ms + 60000;
+    unsigned int i;
+
+    for (i = 0; i < WORKER_WHEEL_SLOTS; i++, tick++)
+    {
+        client_t *client = worker->wheel [tick & (WORKER_WHEEL_SLOTS-1)];
+
+        for (; client; client = client->timer_next)
+            if (client->schedule_ms < next)
+                next = client->schedule_ms;
+        if (next < (tick+1) * WORKER_WHEEL_TICK_MS)
+            break;
+    }
+    return next;
+}
+
+
+/* recheck the idle clients, another thread may of made them active */
+static void worker_timer_wake_idle (worker_t *worker)
+{
+    client_t *client = worker->idle_clients;
+
+    while (client)
+    {
+        client_t *next = client->timer_next;
+        if (client->flags & CLIENT_ACTIVE)
+        {
+            worker_timer_unlink (client);
+            worker_timer_arm (worker, client);
+        }
+        client = next;
+    }
+}
+
+
+/* schedule a client to be run as soon as possible, for use by threads other than
+ * the one processing the client */
+void client_wakeup (client_t *client)
+{
+    worker_t *worker;
+
+    while (1)
+    {
+        worker = client->worker;
+        if (worker == NULL)
+            return;
+        thread_spin_lock (&worker->lock);
+        if (client->worker == worker)
+            break;
+        thread_spin_unlock (&worker->lock);   // moved to another worker, retry
+    }
+    client->schedule_ms = 0;
+    if (client->timer_prevp)
+    {
+        worker_timer_unlink (client);
+        worker_timer_arm (worker, client);
+    }
+    thread_spin_unlock (&worker->lock);
+    worker_wakeup (worker);
+}
+
+
+#ifdef HAVE_EPOLL
+/* Each worker has an epoll set containing the control feed and the sockets of
+ * the clients on the worker. Clients are still driven by schedule_ms, socket
+ * readiness just allows a client to be processed before it is due, so any
+ * failure here only means the client relies on its schedule.
+ *
+ * The event data refers to a slot on the worker, not the client itself, as a
+ * client can be handed off or released during processing and any event still
+ * queued for it is then dropped by the generation check.
+ */
+#define WORKER_POLL_EVENTS      256
+#define WORKER_POLL_CONTROL     ((uint64_t)-1)
+#define WORKER_POLL_NONE        ((unsigned int)-1)
+
+struct worker_poll_slot
+{
+    client_t *client;
+    sock_t sock;
+    unsigned int gen;
+    unsigned int ready;
+    unsigned int next_free;
+};
+
+
+static void worker_poll_create (worker_t *worker)
+{
+    struct epoll_event ev;
+
+    worker->poll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (worker->poll_fd < 0)
+    {
+        ERROR0 ("epoll failed, descriptor limit?");
+        abort();
+    }
+    worker->poll_slot_free = WORKER_POLL_NONE;
+    ev.events = EPOLLIN;
+    ev.data.u64 = WORKER_POLL_CONTROL;
+    epoll_ctl (worker->poll_fd, EPOLL_CTL_ADD, worker->wakeup_fd[0], &ev);
+}
+
+
+static void worker_poll_destroy (worker_t *worker)
+{
+    close (worker->poll_fd);
+    free (worker->poll_slots);
+    free (worker->poll_ready);
+}
+
+
+static void worker_poll_watch (worker_t *worker, unsigned int idx)
 {
+    struct worker_poll_slot *slot = &worker->poll_slots [idx];
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = ((uint64_t)slot->gen << 32) | idx;
+    if (epoll_ctl (worker->poll_fd, EPOLL_CTL_ADD, slot->sock, &ev) < 0)
+    {
+        if (errno != EEXIST || epoll_ctl (worker->poll_fd, EPOLL_CTL_MOD, slot->sock, &ev) < 0)
+            slot->sock = SOCK_ERROR;
+    }
+}
+
+
+static void worker_poll_add (worker_t *worker, client_t *client)
+{
+    struct worker_poll_slot *slot;
+    unsigned int idx;
+
+    client->poll_slot = -1;
+    if (client->connection.sock == SOCK_ERROR)
+        return;
+    if (worker->poll_slot_free == WORKER_POLL_NONE)
+    {
+        unsigned int i, size = worker->poll_slots_size ? worker->poll_slots_size * 2 : 256;
+
+        worker->poll_slots = realloc (worker->poll_slots, size * sizeof (struct worker_poll_slot));
+        worker->poll_ready = realloc (worker->poll_ready, size * sizeof (uint64_t));
+        if (worker->poll_slots == NULL || worker->poll_ready == NULL)
+            abort();
+        for (i = worker->poll_slots_size; i < size; i++)
+        {
+            memset (&worker->poll_slots[i], 0, sizeof (struct worker_poll_slot));
+            worker->poll_slots[i].next_free = i+1;
+        }
+        worker->poll_slots [size-1].next_free = WORKER_POLL_NONE;
+        worker->poll_slot_free = worker->poll_slots_size;
+        worker->poll_slots_size = size;
+    }
+    idx = worker->poll_slot_free;
+    slot = &worker->poll_slots [idx];
+    worker->poll_slot_free = slot->next_free;
+    slot->client = client;
+    slot->sock = client->connection.sock;
+    slot->ready = 0;
+    client->poll_slot = idx;
+    worker_poll_watch (worker, idx);
+}
+
+
+static void worker_poll_remove (worker_t *worker, int idx)
+{
+    struct worker_poll_slot *slot;
+
+    if (idx < 0)
+        return;
+    slot = &worker->poll_slots [idx];
+    if (slot->sock != SOCK_ERROR)
+    {
+        struct epoll_event ev;
+        epoll_ctl (worker->poll_fd, EPOLL_CTL_DEL, slot->sock, &ev);
+    }
+    slot->client = NULL;
+    slot->ready = 0;
+    slot->gen++;
+    slot->next_free = worker->poll_slot_free;
+    worker->poll_slot_free = idx;
+}
+
+
+/* called after processing, the socket may of been closed or replaced */
+static void worker_poll_check (worker_t *worker, client_t *client)
+{
+    struct worker_poll_slot *slot;
+
+    if (client->poll_slot < 0)
+    {
+        if (client->connection.sock != SOCK_ERROR)
+            worker_poll_add (worker, client);
+        return;
+    }
+    slot = &worker->poll_slots [client->poll_slot];
+    if (slot->sock == client->connection.sock)
+        return;
+    slot->sock = client->connection.sock;   // old one is dropped from the set on close
+    slot->gen++;
+    if (slot->sock != SOCK_ERROR)
+        worker_poll_watch (worker, client->poll_slot);
+}
+
+
+/* wait on the worker epoll set, returns > 0 if the control feed needs reading */
+static int worker_poll_wait (worker_t *worker, int duration)
+{
+    struct epoll_event events [WORKER_POLL_EVENTS];
+    int i, control = 0, ret = epoll_wait (worker->poll_fd, events, WORKER_POLL_EVENTS, duration);
+
+    for (i = 0; i < ret; i++)
+    {
+        uint64_t id = events[i].data.u64;
+        unsigned int idx = (unsigned int)id;
+        struct worker_poll_slot *slot;
+
+        if (id == WORKER_POLL_CONTROL)
+        {
+            control = 1;
+            continue;
+        }
+        if (idx >= worker->poll_slots_size)
+            continue;
+        slot = &worker->poll_slots [idx];
+        if (slot->client == NULL || slot->gen != (unsigned int)(id >> 32) || slot->ready)
+            continue;
+        slot->ready = 1;
+        if (worker->poll_ready_count < worker->poll_slots_size)
+            worker->poll_ready [worker->poll_ready_count++] = id;
+    }
+    return control;
+}
+
+
+/* take the active clients reported by the poller off the timer wheel and onto the
+ * run list, worker lock is held */
+static client_t **worker_poll_collect (worker_t *worker, client_t **runp)
+{
+    unsigned int i;
+
+    for (i = 0; i < worker->poll_ready_count; i++)
+    {
+        uint64_t id = worker->poll_ready [i];
+        struct worker_poll_slot *slot = &worker->poll_slots [(unsigned int)id];
+        client_t *client = slot->client;
+
+        if (client == NULL || slot->gen != (unsigned int)(id >> 32))
+            continue;   // left the worker or replaced socket
+        slot->ready = 0;
+        if (client->timer_prevp == NULL || (client->flags & CLIENT_ACTIVE) == 0)
+            continue;   // already due or waiting on another thread
+        worker_timer_unlink (client);
+        *runp = client;
+        runp = &client->timer_next;
+    }
+    worker->poll_ready_count = 0;
+    return runp;
+}
+
+#else
+#define worker_poll_create(w)           do {} while(0)
+#define worker_poll_destroy(w)          do {} while(0)
+#define worker_poll_add(w,c)            do {} while(0)
+#define worker_poll_remove(w,i)         do { (void)(i); } while(0)
+#define worker_poll_check(w,c)          do {} while(0)
+#define worker_poll_collect(w,r)        (r)
+#endif
+
+
+// process the client with the worker spin lock dropped, returns non-zero if the client
+// is no longer on this worker, in which case it has been removed from the list.
+//
+static int worker_client_run (worker_t *worker, client_t *client, int sync_time)
+{
+    client_t **prevp = client->prevp_on_worker, *nx = client->next_on_worker;
+    int ret, slot = -1;
+
+#ifdef HAVE_EPOLL
+    slot = client->poll_slot;
+#endif
+    thread_spin_unlock (&worker->lock);
+    if (sync_time)
+    {
+        // update these periodically to keep in sync
+        worker->time_ms = worker_check_time_ms (worker);
+        worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
+    }
+    errno = 0;
+    ret = client->ops->process (client);
+    if (ret)
+        worker_poll_remove (worker, slot);   // client may already be on another worker
+    else
+        worker_poll_check (worker, client);
+    if (ret < 0)
+    {
+        client->worker = NULL;
+        if (client->ops->release)
+            client->ops->release (client);
+    }
     thread_spin_lock (&worker->lock);
-    if (worker->pending_clients)
-    {
-        unsigned count;
-        client_t **p;
-
-        p = worker->last_p;
-        *worker->last_p = worker->pending_clients;
-        worker->last_p = worker->pending_clients_tail;
-        worker->count += worker->pending_count;
-        count = worker->pending_count;
-        worker->pending_clients = NULL;
-        worker->pending_clients_tail = &worker->pending_clients;
-        worker->pending_count = 0;
-        thread_spin_unlock (&worker->lock);
-        DEBUG2 ("Added %d pending clients to %p", count, worker);
-        return p;  /* only these new ones scheduled so process from here */
+    if (ret)
+    {
+        worker->count--;
+        *prevp = nx;
+        if (nx)
+            nx->prevp_on_worker = prevp;
+        else
+            worker->last_p = prevp; /* was the last client */
+    }
+    return ret;
+}
+
+
+// enter and exit with spin lock enabled
+//
+static void worker_add_pending_clients (worker_t *worker)
+{
+    int count = 0;
+    client_t *client, **p = worker->last_p, **prevp;
+
+    while ((client = worker_pending_pop (worker)))
+    {
+        client->next_on_worker = NULL;
+        client->prevp_on_worker = worker->last_p;
+        *worker->last_p = client;
+        worker->last_p = &client->next_on_worker;
+        client->timer_prevp = NULL;
+        worker_timer_arm (worker, client);
+        count++;
+    }
+    if (count == 0)
+        return;
+    worker->count += count;
+    pending_count_add (worker, -count);
+    thread_spin_unlock (&worker->lock);
+    for (prevp = p; *prevp; prevp = &(*prevp)->next_on_worker)
+        worker_poll_add (worker, *prevp);
+    DEBUG2 ("Added %d pending clients to %p", count, worker);
+    thread_spin_lock (&worker->lock);
+}
+
+
+/* Workers measure the time spent processing, and once a second an underloaded
+ * worker looks for a busy one and asks it for a batch of clients. The busy worker
+ * hands them over itself, as only it can safely take clients off its lists.
+ */
+static void worker_steal_check (worker_t *worker)
+{
+    worker_t *w, *victim = NULL;
+    int total = 0, n = 0;
+
+    if (worker->running == 0 || is_worker_incoming (worker))
+        return;
+    if (thread_rwlock_tryrlock (&workers_lock) != 0)
+        return;
+    for (w = workers; w; w = w->next, n++)
+    {
+        total += w->load;
+        if (w != worker && (victim == NULL || w->load > victim->load))
+            victim = w;
+    }
+    if (victim && victim->load > WORKER_STEAL_LOAD && worker->load < total / n &&
+            victim->load - worker->load > WORKER_STEAL_LOAD/2)
+    {
+        thread_spin_lock (&victim->lock);
+        if (victim->steal_to == NULL && victim->running && victim->count > 1)
+        {
+            // aim to take half the difference, assuming similar cost per client
+            long want = (long)victim->count * (victim->load - worker->load) / (2 * victim->load);
+
+            if (want > victim->count / 4)
+                want = victim->count / 4;
+            if (want > WORKER_STEAL_MAX)
+                want = WORKER_STEAL_MAX;
+            if (want > 0)
+            {
+                victim->steal_to = worker;
+                victim->steal_count = (int)want;
+                DEBUG4 ("worker %p (load %d) requests %ld from %p", worker, worker->load, want, victim);
+            }
+        }
+        thread_spin_unlock (&victim->lock);
     }
+    thread_rwlock_unlock (&workers_lock);
+}
+
+
+/* hand a batch of clients over to the worker that asked for them. Enter and exit
+ * with the spin lock held, only called when no client is being processed */
+static void worker_donate_clients (worker_t *worker)
+{
+    worker_t *dest = worker->steal_to;
+    client_t *client, *next, *batch = NULL;
+    int moved = 0;
+
+    if (thread_rwlock_tryrlock (&workers_lock) != 0)
+        return;     // try again next time around
+    worker->steal_to = NULL;
+    for (client = worker->clients; client && moved < worker->steal_count; client = next)
+    {
+        next = client->next_on_worker;
+        // only those that are waiting on the timer, others are busy with other threads
+        if ((client->flags & CLIENT_ACTIVE) == 0 || client->timer_prevp == NULL)
+            continue;
+        worker_timer_unlink (client);
+        *client->prevp_on_worker = next;
+        if (next)
+            next->prevp_on_worker = client->prevp_on_worker;
+        else
+            worker->last_p = client->prevp_on_worker;
+        worker->count--;
+        client->timer_next = batch;
+        batch = client;
+        moved++;
+    }
+    worker->steal_count = 0;
     thread_spin_unlock (&worker->lock);
-    worker->wakeup_ms = worker->time_ms + 60000;
-    return &worker->clients;
+
+    while ((client = batch))
+    {
+        batch = client->timer_next;
+        client->timer_next = NULL;
+#ifdef HAVE_EPOLL
+        worker_poll_remove (worker, client->poll_slot);
+#endif
+        worker_add_client (dest, client);
+    }
+    if (moved)
+    {
+        worker_wakeup (dest);
+        DEBUG4 ("moved %d clients from %p (load %d) to %p", moved, worker, worker->load, dest);
+    }
+    thread_rwlock_unlock (&workers_lock);
+    thread_spin_lock (&worker->lock);
 }
 
 
-// enter with spin lock enabled, exit without
+// enter and exit with spin lock enabled
 //
-static client_t **worker_wait (worker_t *worker)
+static void worker_wait (worker_t *worker)
 {
     int ret, duration = 2;
 
+    worker->wakeup_ms = worker_timer_next (worker);
     if (worker->running)
     {
         uint64_t tm = worker_check_time_ms (worker);
@@ -639,32 +1390,64 @@ static client_t **worker_wait (worker_t *worker)
             duration = (int)(worker->wakeup_ms - tm);
         if (duration > 60000) /* make duration at most 60s */
             duration = 60000;
+#ifdef HAVE_EPOLL
+        if (worker->poll_ready_count)
+            duration = 0;
+#endif
     }
     thread_spin_unlock (&worker->lock);
 
+    worker->busy_us += timing_get_time_us() - worker->busy_start_us;
+    if (worker->time_ms >= worker->load_mark_ms + 1000)
+    {
+        uint64_t elapsed = worker->time_ms - worker->load_mark_ms;
+
+        worker->load = (int)((worker->busy_us - worker->busy_mark_us) / elapsed);
+        worker->busy_mark_us = worker->busy_us;
+        worker->load_mark_ms = worker->time_ms;
+        worker_steal_check (worker);
+    }
+
+#ifdef HAVE_EPOLL
+    ret = worker_poll_wait (worker, duration);
+#else
     ret = util_timed_wait_for_fd (worker->wakeup_fd[0], duration);
+#endif
     if (ret > 0) /* may of been several wakeup attempts */
     {
         char ca[100];
+        int r;
         do
         {
-            ret = pipe_read (worker->wakeup_fd[0], ca, sizeof ca);
-            if (ret > 0)
+            r = pipe_read (worker->wakeup_fd[0], ca, sizeof ca);
+            if (r > 0)
                 break;
-            if (ret < 0 && sock_recoverable (sock_error()))
+            if (r < 0 && sock_recoverable (sock_error()))
                 break;
-            sock_close (worker->wakeup_fd[1]);
-            sock_close (worker->wakeup_fd[0]);
-            worker_control_create (&worker->wakeup_fd[0]);
+            worker_control_close (worker);
+            worker_control_open (worker);
+#ifdef HAVE_EPOLL
+            {
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.u64 = WORKER_POLL_CONTROL;
+                epoll_ctl (worker->poll_fd, EPOLL_CTL_ADD, worker->wakeup_fd[0], &ev);
+            }
+#endif
             worker_wakeup (worker);
             WARN0 ("Had to recreate worker control feed");
         } while (1);
+        worker_signalled_clear (worker);  // drained, so the next wakeup must signal
     }
 
     worker->time_ms = timing_get_time();
     worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
+    worker->busy_start_us = timing_get_time_us();
 
-    return worker_add_pending_clients (worker);
+    thread_spin_lock (&worker->lock);
+    if (ret > 0)
+        worker_timer_wake_idle (worker);
+    worker_add_pending_clients (worker);
 }
 
 
@@ -672,121 +1455,191 @@ static void worker_relocate_clients (worker_t *worker)
 {
     if (workers == NULL)
         return;
-    while (worker->count || worker->pending_count)
+    while (worker->count || worker_pending_count (worker))
     {
-        client_t *client = worker->clients, **prevp = &worker->clients;
+        client_t *client, *next;
+        int moved = 0;
 
-        worker->wakeup_ms = worker->time_ms + 150;
         worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
-        while (client)
+        thread_spin_lock (&worker->lock);
+        client = worker->clients;
+        worker->clients = NULL;
+        worker->last_p = &worker->clients;
+        worker->count = 0;
+        for (; client; client = next)
         {
+            next = client->next_on_worker;
+#ifdef HAVE_EPOLL
+            worker_poll_remove (worker, client->poll_slot);
+#endif
+            worker_timer_unlink (client);
             if (client->flags & CLIENT_ACTIVE)
             {
-                client->worker = workers;
-                prevp = &client->next_on_worker;
+                worker_add_client (workers, client);
+                moved++;
             }
             else
-            {
-                *prevp = client->next_on_worker;
-                worker_add_client (worker, client);
-                worker->count--;
-            }
-            client = *prevp;
+                worker_add_client (worker, client);  // requeue until active
         }
-        if (worker->clients)
-        {
-            thread_spin_lock (&workers->lock);
-            *workers->pending_clients_tail = worker->clients;
-            workers->pending_clients_tail = prevp;
-            workers->pending_count += worker->count;
-            thread_spin_unlock (&workers->lock);
+        thread_spin_unlock (&worker->lock);
+        if (moved)
             worker_wakeup (workers);
-            worker->clients = NULL;
-            worker->last_p = &worker->clients;
-            worker->count = 0;
-        }
         thread_spin_lock (&worker->lock);
         worker_wait (worker);
+        thread_spin_unlock (&worker->lock);
     }
 }
 
+/* bind the worker thread to where it has been placed, called by the worker
+ * itself with the worker lock held
+ */
+static void worker_apply_placement (worker_t *worker)
+{
+    int cpu = worker->cpu, node = worker->node;
+
+    worker->placement_pending = 0;
+    thread_spin_unlock (&worker->lock);
+    if (util_thread_affinity (cpu, node) < 0)
+        WARN3 ("unable to place worker %p on cpu %d node %d", worker, cpu, node);
+    else if (cpu >= 0 || node >= 0)
+        INFO3 ("worker %p placed on cpu %d node %d", worker, cpu, node);
+    thread_spin_lock (&worker->lock);
+}
+
+
+/* work out the placement for a worker. The incoming worker is index 0, the others
+ * are numbered in order of starting. Caller holds workers_lock
+ */
+static void worker_place (worker_t *worker, int index)
+{
+    int cpu, node;
+
+    util_thread_placement (worker_cpus, worker_nodes, index, &cpu, &node);
+    thread_spin_lock (&worker->lock);
+    if (worker->cpu != cpu || worker->node != node)
+    {
+        worker->cpu = cpu;
+        worker->node = node;
+        worker->placement_pending = 1;
+        worker_placement_changed = 1;
+    }
+    thread_spin_unlock (&worker->lock);
+}
+
+
+/* set the cpu and node lists workers are placed by, and reapply to running workers */
+void workers_placement (const char *cpus, const char *nodes)
+{
+    worker_t *w;
+    int index;
+
+    thread_rwlock_wlock (&workers_lock);
+    free (worker_cpus);
+    free (worker_nodes);
+    worker_cpus = cpus ? strdup (cpus) : NULL;
+    worker_nodes = nodes ? strdup (nodes) : NULL;
+    if (worker_incoming)
+        worker_place (worker_incoming, 0);
+    for (w = workers, index = worker_count; w; w = w->next, index--)
+        worker_place (w, index);
+    for (w = workers; w; w = w->next)
+        if (w->placement_pending) worker_wakeup (w);
+    if (worker_incoming && worker_incoming->placement_pending)
+        worker_wakeup (worker_incoming);
+    thread_rwlock_unlock (&workers_lock);
+}
+
+
+/* enable or disable batching of listener sends, workers pick this up on their next pass */
+void workers_send_batching (int enable)
+{
+    worker_send_batching = enable;
+}
+
+
+/* create or drop the send batch, called by the worker itself */
+static void worker_send_batch_update (worker_t *worker)
+{
+    worker->send_batching = worker_send_batching;
+    if (worker->send_batching && worker->send_batch == NULL)
+    {
+        worker->send_batch = send_batch_create (WORKER_BATCH_ENTRIES);
+        if (worker->send_batch)
+            INFO1 ("worker %p batching listener sends with io_uring", worker);
+    }
+    if (worker->send_batching == 0 && worker->send_batch)
+    {
+        send_batch_destroy (worker->send_batch);
+        worker->send_batch = NULL;
+        INFO1 ("worker %p sending directly", worker);
+    }
+}
+
+
+/* report where the workers are placed as a single stat, incoming first */
+static void worker_placement_stats (void)
+{
+    char buf [2000];
+    int len = 0, index = 0;
+    worker_t *w = worker_incoming;
+
+    buf[0] = '\0';
+    worker_placement_changed = 0;
+    while (w && len < (int)sizeof (buf) - 40)
+    {
+        if (w->cpu >= 0)
+            len += snprintf (buf+len, sizeof (buf)-len, "%s%d:cpu%d/node%d", index ? " " : "", index, w->cpu, w->node);
+        else if (w->node >= 0)
+            len += snprintf (buf+len, sizeof (buf)-len, "%s%d:node%d", index ? " " : "", index, w->node);
+        else
+            len += snprintf (buf+len, sizeof (buf)-len, "%s%d:any", index ? " " : "", index);
+        w = (w == worker_incoming) ? workers : w->next;
+        index++;
+    }
+    stats_event (NULL, "worker_placement", buf);
+}
+
+
 void *worker (void *arg)
 {
     worker_t *worker = arg;
     long prev_count = -1;
-    client_t **prevp = &worker->clients;
-    uint64_t c = 0;
 
     thread_rwlock_rlock (&global.workers_rw);
     worker->running = 1;
     worker->wakeup_ms = (int64_t)0;
     worker->time_ms = timing_get_time();
+    worker->wheel_tick = worker->time_ms / WORKER_WHEEL_TICK_MS;
+    worker->load_mark_ms = worker->time_ms;
+    worker->busy_start_us = timing_get_time_us();
 
+    thread_spin_lock (&worker->lock);
     while (1)
     {
-        client_t *client = *prevp;
-        uint64_t sched_ms = worker->time_ms + 12;
+        client_t *client, *run = NULL, **runp = &run;
+        uint64_t c = 0;
 
-        c = 0;
-        thread_spin_lock (&worker->lock);
-        while (client)
+        if (worker->steal_to)
+            worker_donate_clients (worker);
+        if (worker->placement_pending)
+            worker_apply_placement (worker);
+        if (worker->send_batching != worker_send_batching)
+            worker_send_batch_update (worker);
+
+        /* only those with socket activity or due are processed */
+        runp = worker_poll_collect (worker, runp);
+        worker_timer_expire (worker, runp, worker->time_ms + 12);
+
+        while ((client = run))
         {
+            run = client->timer_next;
+            client->timer_next = NULL;
             if (client->worker != worker) abort();
-            /* process client details but skip those that are not ready yet */
-            if (client->flags & CLIENT_ACTIVE)
-            {
-                int ret = 0;
-                client_t *nx = client->next_on_worker;
-
-                int process = 1;
-                if (worker->running)  // force all active clients to run on worker shutdown
-                {
-                    if (client->schedule_ms <= sched_ms)
-                    {
-                        if (c > 9000 && client->wakeup == NULL)
-                            process = 0;
-                    }
-                    else if (client->wakeup == NULL || *client->wakeup == 0)
-                    {
-                        process = 0;
-                    }
-                }
-
-                if (process)
-                {
-                    thread_spin_unlock (&worker->lock);
-                    if ((c & 511) == 0)
-                    {
-                        // update these periodically to keep in sync
-                        worker->time_ms = worker_check_time_ms (worker);
-                        worker->current_time.tv_sec = (time_t)(worker->time_ms/1000);
-                    }
-                    c++;
-                    errno = 0;
-                    ret = client->ops->process (client);
-                    if (ret < 0)
-                    {
-                        client->worker = NULL;
-                        if (client->ops->release)
-                            client->ops->release (client);
-                    }
-                    if (ret)
-                    {
-                        thread_spin_lock (&worker->lock);
-                        worker->count--;
-                        if (nx == NULL) /* is this the last client */
-                            worker->last_p = prevp;
-                        client = *prevp = nx;
-                        continue;
-                    }
-                    thread_spin_lock (&worker->lock);
-                }
-                if (ret == 0 && (client->flags & CLIENT_ACTIVE) && client->schedule_ms < worker->wakeup_ms)
-                    worker->wakeup_ms = client->schedule_ms;
-            }
-            prevp = &client->next_on_worker;
-            client = *prevp;
+            if (worker_client_run (worker, client, (c & 511) == 0) == 0)
+                worker_timer_arm (worker, client);
+            c++;
         }
+        send_batch_flush (worker->send_batch);
         if (prev_count != worker->count)
         {
             DEBUG2 ("%p now has %d clients", worker, worker->count);
@@ -794,12 +1647,14 @@ void *worker (void *arg)
         }
         if (worker->running == 0)
         {
-            if (worker->count == 0 && worker->pending_count == 0)
+            if (worker->count == 0 && worker_pending_count (worker) == 0)
                 break;
         }
-        prevp = worker_wait (worker);
+        worker_wait (worker);
     }
     thread_spin_unlock (&worker->lock);
+    send_batch_destroy (worker->send_batch);
+    worker->send_batch = NULL;
     worker_relocate_clients (worker);
     INFO0 ("shutting down");
     thread_rwlock_unlock (&global.workers_rw);
@@ -828,6 +1683,8 @@ void worker_balance_trigger (time_t now)
         if (worker_balance_to_check == NULL)
             worker_balance_to_check = workers;
     }
+    if (worker_placement_changed)
+        worker_placement_stats ();
     thread_rwlock_unlock (&workers_lock);
 }
 
@@ -836,16 +1693,20 @@ static void worker_start (void)
 {
     worker_t *handler = calloc (1, sizeof(worker_t));
 
-    worker_control_create (&handler->wakeup_fd[0]);
+    worker_control_open (handler);
+    worker_poll_create (handler);
+    handler->wheel = calloc (WORKER_WHEEL_SLOTS, sizeof (client_t *));
 
-    handler->pending_clients_tail = &handler->pending_clients;
+    worker_pending_init (handler);
     thread_spin_create (&handler->lock);
     handler->last_p = &handler->clients;
+    handler->cpu = handler->node = -1;
 
     thread_rwlock_wlock (&workers_lock);
     if (worker_incoming == NULL)
     {
         worker_incoming = handler;
+        worker_place (handler, 0);
         handler->move_allocations = 1000000;    // should stay fixed for this one
         handler->thread = thread_create ("worker", worker, handler, THREAD_ATTACHED);
         thread_rwlock_unlock (&workers_lock);
@@ -856,6 +1717,7 @@ static void worker_start (void)
     handler->next = workers;
     workers = handler;
     worker_count++;
+    worker_place (handler, worker_count);
     worker_least_used = worker_balance_to_check = workers;
     thread_rwlock_unlock (&workers_lock);
 
@@ -888,6 +1750,18 @@ static void worker_stop (void)
 
         if (handler)
         {
+            worker_t *w;
+
+            for (w = workers; w; w = w->next)
+            {
+                thread_spin_lock (&w->lock);
+                if (w->steal_to == handler)
+                    w->steal_to = NULL;
+                if (w->least_near == handler)
+                    w->least_near = NULL;
+                thread_spin_unlock (&w->lock);
+            }
+            worker_placement_changed = 1;
             thread_spin_lock (&handler->lock);
             handler->running = 0;
             thread_spin_unlock (&handler->lock);
@@ -897,9 +1771,13 @@ static void worker_stop (void)
 
             thread_join (handler->thread);
             thread_spin_destroy (&handler->lock);
+#ifndef HAVE_ATOMIC_BUILTINS
+            thread_spin_destroy (&handler->pending_lock);
+#endif
 
-            sock_close (handler->wakeup_fd[1]);
-            sock_close (handler->wakeup_fd[0]);
+            worker_poll_destroy (handler);
+            free (handler->wheel);
+            worker_control_close (handler);
             free (handler);
             thread_rwlock_wlock (&workers_lock);
         }
@@ -923,6 +1801,17 @@ void workers_adjust (int new_count)
 
 void worker_wakeup (worker_t *worker)
 {
+    if (worker_signalled_set (worker))
+        return;     // worker has yet to drain the previous signal
+#ifdef HAVE_EVENTFD
+    if (worker->wakeup_fd[1] == worker->wakeup_fd[0])
+    {
+        uint64_t v = 1;
+        if (write (worker->wakeup_fd[1], &v, sizeof v) < 0 && errno != EAGAIN)
+            worker_signalled_clear (worker);
+        return;
+    }
+#endif
     pipe_write (worker->wakeup_fd[1], "W", 1);
 }
 
@@ -22,6 +22,12 @@
 typedef struct _client_tag client_t;
 typedef struct _worker_t worker_t;
 
+/* link for the queue of clients handed over to a worker */
+typedef struct worker_pending_tag
+{
+    struct worker_pending_tag *next;
+} worker_pending_t;
+
 #include "cfgfile.h"
 #include "connection.h"
 #include "refbuf.h"
@@ -36,15 +42,37 @@ struct _worker_t
     int move_allocations;
     spin_t lock;
     FD_t wakeup_fd[2];
-
-    client_t *pending_clients;
-    client_t **pending_clients_tail,
-             *clients;
+    int wakeup_signalled;
+    worker_pending_t *pending_head,     // pushed to by other threads
+                     *pending_tail,     // popped by the worker
+                     pending_stub;
+#ifndef HAVE_ATOMIC_BUILTINS
+    spin_t pending_lock;
+#endif
+#ifdef HAVE_EPOLL
+    int poll_fd;
+    struct worker_poll_slot *poll_slots;
+    uint64_t *poll_ready;
+    unsigned int poll_slots_size, poll_slot_free, poll_ready_count;
+#endif
+
+    client_t *clients;
     client_t **last_p;
+    client_t **wheel, *idle_clients;
+    uint64_t wheel_tick;
     thread_type *thread;
     struct timespec current_time;
     uint64_t time_ms;
     uint64_t wakeup_ms;
+    uint64_t busy_us, busy_start_us, busy_mark_us, load_mark_ms;
+    int load;                       // per-mille of the last second spent processing
+    struct _worker_t *steal_to;     // underloaded worker wanting some clients
+    int steal_count;
+    int cpu, node;                  // placement, -1 for no preference
+    int placement_pending;          // thread affinity to be applied
+    struct _worker_t *least_near;   // least busy worker on the same node
+    struct send_batch *send_batch;  // listener sends submitted once per pass
+    int send_batching;              // batching setting last applied
     struct _worker_t *next;
 };
 
@@ -62,7 +90,6 @@ struct _client_functions
 struct _client_tag
 {
     uint64_t schedule_ms;
-    char *wakeup;
 
     /* various states the client could be in */
     unsigned int flags;
@@ -70,7 +97,12 @@ struct _client_tag
     /* position in first buffer */
     unsigned int pos;
 
-    client_t *next_on_worker;
+    client_t *next_on_worker, **prevp_on_worker;
+    client_t *timer_next, **timer_prevp;
+    worker_pending_t pending;
+#ifdef HAVE_EPOLL
+    int poll_slot;
+#endif
 
     /* functions to process client */
     struct _client_functions *ops;
@@ -126,6 +158,14 @@ struct _client_tag
     unsigned int throttle;
 };
 
+void client_initialize (void);
+void client_shutdown (void);
+client_t *client_new (void);
+void client_free (client_t *client);
+http_parser_t *client_parser_new (void);
+void client_parser_release (http_parser_t *parser);
+void client_pool_counts (int parsers, uint64_t *hits, uint64_t *misses, uint64_t *cached);
+
 void client_register (client_t *client);
 void client_destroy(client_t *client);
 int  client_add_cors (client_t *client, char *buf, int remain);
@@ -149,7 +189,11 @@ const char *client_keepalive_header (client_t *client);
 int  client_change_worker (client_t *client, worker_t *dest_worker);
 void client_add_worker (client_t *client);
 void client_add_incoming (client_t *client);
+void client_wakeup (client_t *client);
 worker_t *worker_selected (void);
+worker_t *worker_selected_near (worker_t *worker);
+void workers_placement (const char *cpus, const char *nodes);
+void workers_send_batching (int enable);
 void worker_balance_trigger (time_t now);
 void workers_adjust (int new_count);
 void worker_wakeup (worker_t *worker);
@@ -157,6 +201,9 @@ void worker_logger_init (void);
 void worker_logger (int stop);
 int  is_worker_incoming (worker_t *w);
 
+/* worker loads, in per-mille busy, within this are treated as the same */
+#define WORKER_LOAD_SLACK           50
+
 
 /* client flags bitmask */
 #define CLIENT_ACTIVE               (1)
@@ -48,6 +48,14 @@
 #include <sys/signalfd.h>
 #include <signal.h>
 #endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#define CONNECTION_SENDFILE     1
+#endif
+#if defined(HAVE_MSG_ZEROCOPY) && defined(HAVE_ATOMIC_BUILTINS)
+#include <linux/errqueue.h>
+#define CONNECTION_ZEROCOPY     1
+#endif
 
 #include "compat.h"
 
@@ -60,8 +68,11 @@
 #include "cfgfile.h"
 #include "global.h"
 #include "util.h"
+#include "ipfilter.h"
+#include "connlimit.h"
 #include "connection.h"
 #include "refbuf.h"
+#include "objpool.h"
 #include "client.h"
 #include "stats.h"
 #include "logging.h"
@@ -74,6 +85,7 @@
 #include "source.h"
 #include "format.h"
 #include "format_mp3.h"
+#include "sendbatch.h"
 #include "event.h"
 #include "admin.h"
 #include "auth.h"
@@ -103,16 +115,77 @@ static int  _handle_stats_request (client_t *client);
 
 static spin_t _connection_lock;
 static uint64_t _current_id = 0;
-thread_type *conn_tid;
+static uint64_t _rate_limited = 0;
 int sigfd;
 
+/* Incoming connections are accepted by a pool of threads, each polling its own share
+ * of the listening sockets. When SO_REUSEPORT is available, each listening address
+ * has a socket per acceptor so the kernel spreads new connections across them.
+ */
+typedef struct
+{
+    int id;
+    int count;
+    int cpu;        // placement from acceptor-cpus, -1 for anywhere
+    int node;
+    thread_type *thread;
+    sock_t *socks;
+    listener_t **conns;
+} acceptor_t;
+
+static acceptor_t *acceptors;
+static int acceptor_count;
+
+#define LINGER_SECS         30      /* how long a closed connection waits for its sends */
+#define HELD_POOL_LIMIT     64      /* held sends cached per thread */
+
+/* closed connections with data still to go, held or in zerocopy sends */
+struct connection_linger
+{
+    sock_t sock;
+    time_t expire;
+    struct connection_held *held;
+    struct connection_zc *zc;
+    struct connection_linger *next;
+};
+
+static spin_t linger_lock;
+static struct connection_linger *lingering;
+static objpool_t held_pool;
+
+#define ACCEPT_BATCH_MAX        64
+
 static int ssl_ok;
 #ifdef HAVE_OPENSSL
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #ifndef SSL_OP_NO_COMPRESSION
 #define SSL_OP_NO_COMPRESSION 0
 #endif
 static SSL_CTX *ssl_ctx;
 static mutex_t *ssl_mutexes = NULL;
+
+/* session ticket keys, the current one for issuing and the previous one still
+ * accepted for a while so rotation does not force a full handshake. These are
+ * kept across certificate reloads */
+struct ssl_ticket_key
+{
+    unsigned char name [16];
+    unsigned char aes [32];
+    unsigned char hmac [32];
+    time_t created;
+};
+static struct ssl_ticket_key ssl_ticket_keys [2];
+static spin_t ssl_ticket_lock;
+static int ssl_ticket_lifetime;
+static uint64_t ssl_ticket_unknown;
+
+/* counts from previous contexts, so stats carry over a reload */
+static uint64_t ssl_accepts_prev, ssl_resumed_prev;
 #if !defined(WIN32) && OPENSSL_VERSION_NUMBER < 0x10000000
 static unsigned long ssl_id_function (void);
 #endif
@@ -153,7 +226,7 @@ struct _client_functions http_req_stats_ops =
 };
 
 /* filtering client connection based on IP */
-cache_file_contents banned_ip, allowed_ip;
+static ip_filter_t banned_ip, allowed_ip;
 
 /* filtering listener connection based on useragent */
 cache_file_contents useragents;
@@ -221,39 +294,24 @@ static DH *get_dh2048()
 #endif  // END DH CODE
 
 
-static int compare_banned_ip (void *arg, void *a, void *b)
-{
-    struct node_IP_time *this = (struct node_IP_time *)a;
-    struct node_IP_time *that = (struct node_IP_time *)b;
-    int ret = strcmp (&this->ip[0], &that->ip[0]);
-
-    if (ret && that->a.timeout)
-    {
-        cache_file_contents *c = arg;
-        time_t threshold = c->file_recheck - 60;
-
-        if (c->deletions_count < 9 && that->a.timeout < threshold)
-        {
-            c->deletions [c->deletions_count] = that;
-            c->deletions_count++;
-        }
-    }
-    return ret;
-}
-
-
 void connection_initialize(void)
 {
     thread_spin_create (&_connection_lock);
+    thread_spin_create (&linger_lock);
+    objpool_initialize (&held_pool, "held", HELD_POOL_LIMIT);
 
-    memset (&banned_ip, 0, sizeof (banned_ip));
-    memset (&allowed_ip, 0, sizeof (allowed_ip));
+    ip_filter_initialize ();
+    ip_filter_init (&banned_ip);
+    ip_filter_init (&allowed_ip);
+    connect_limit_initialize ();
     memset (&useragents, 0, sizeof (useragents));
 
-    conn_tid = NULL;
+    acceptors = NULL;
+    acceptor_count = 0;
     connection_running = 0;
 #ifdef HAVE_OPENSSL
     ssl_ctx = NULL;
+    thread_spin_create (&ssl_ticket_lock);
 #if OPENSSL_API_COMPAT < 0x10100000L
     SSL_load_error_strings();                /* readable error messages */
 #endif
@@ -277,9 +335,17 @@ void connection_initialize(void)
 void connection_shutdown(void)
 {
     connection_listen_sockets_close (NULL, 1);
+    ip_filter_destroy (&banned_ip);
+    ip_filter_destroy (&allowed_ip);
+    connect_limit_shutdown ();
     thread_spin_destroy (&_connection_lock);
+    connection_linger (0);
+    thread_spin_destroy (&linger_lock);
+    objpool_shutdown (&held_pool);
 #ifdef HAVE_OPENSSL
     SSL_CTX_free (ssl_ctx);
+    thread_spin_destroy (&ssl_ticket_lock);
+    memset (ssl_ticket_keys, 0, sizeof (ssl_ticket_keys));
 #if !defined(WIN32) && OPENSSL_VERSION_NUMBER < 0x10000000
     CRYPTO_set_id_callback(NULL);
 #endif
@@ -329,6 +395,126 @@ static void ssl_locking_function (int mode, int n, const char *file, int line)
 #endif
 
 
+/* copy out the ticket key to use, returns 1 for the current key, 2 if the
+ * previous key so the client should get a new ticket, 0 if none matches
+ * and -1 on error
+ */
+static int ssl_ticket_key_find (const unsigned char *name, int enc, struct ssl_ticket_key *key)
+{
+    struct ssl_ticket_key *k = ssl_ticket_keys;
+    time_t now = time (NULL);
+    int ret = 0;
+
+    thread_spin_lock (&ssl_ticket_lock);
+    if (enc)
+    {
+        if (now - k->created >= ssl_ticket_lifetime)
+        {
+            struct ssl_ticket_key fresh;
+
+            if (RAND_bytes (fresh.name, sizeof fresh.name) > 0 && RAND_bytes (fresh.aes, sizeof fresh.aes) > 0 &&
+                    RAND_bytes (fresh.hmac, sizeof fresh.hmac) > 0)
+            {
+                fresh.created = now;
+                k[1] = k[0];
+                k[0] = fresh;
+            }
+            else if (k->created == 0)
+                ret = -1;
+        }
+        if (ret == 0)
+        {
+            *key = k[0];
+            ret = 1;
+        }
+    }
+    else
+    {
+        int i;
+        for (i = 0; i < 2; i++, k++)
+        {
+            if (k->created && now - k->created < 2 * ssl_ticket_lifetime && memcmp (name, k->name, sizeof k->name) == 0)
+            {
+                *key = *k;
+                ret = i ? 2 : 1;
+                break;
+            }
+        }
+        if (ret == 0)
+            ssl_ticket_unknown++;
+    }
+    thread_spin_unlock (&ssl_ticket_lock);
+    return ret;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ssl_ticket_key_cb (SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int ssl_ticket_key_cb (SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+#endif
+{
+    struct ssl_ticket_key key;
+    int ret = ssl_ticket_key_find (name, enc, &key);
+
+    if (ret <= 0)
+        return ret;
+    if (enc)
+    {
+        memcpy (name, key.name, sizeof key.name);
+        if (RAND_bytes (iv, EVP_CIPHER_iv_length (EVP_aes_256_cbc())) <= 0)
+            return -1;
+    }
+    if (EVP_CipherInit_ex (ectx, EVP_aes_256_cbc(), NULL, key.aes, iv, enc) == 0)
+        return -1;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string (OSSL_MAC_PARAM_KEY, key.hmac, sizeof key.hmac);
+    params[1] = OSSL_PARAM_construct_utf8_string (OSSL_MAC_PARAM_DIGEST, "sha256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_CTX_set_params (hctx, params) == 0)
+        return -1;
+#else
+    if (HMAC_Init_ex (hctx, key.hmac, sizeof key.hmac, EVP_sha256(), NULL) == 0)
+        return -1;
+#endif
+    return ret;
+}
+
+
+/* resumption of earlier sessions, either from the server side cache or from
+ * tickets held by the client, avoids the full handshake on reconnects */
+static void ssl_session_setup (SSL_CTX *ctx, ice_config_t *config)
+{
+    SSL_CTX_set_session_id_context (ctx, (const unsigned char *)"icecast", 7);
+    SSL_CTX_set_timeout (ctx, config->ssl_session_timeout);
+    if (config->ssl_session_cache > 0)
+    {
+        SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size (ctx, config->ssl_session_cache);
+    }
+    else
+        SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_OFF);
+
+    thread_spin_lock (&ssl_ticket_lock);
+    ssl_ticket_lifetime = config->ssl_session_timeout;
+    thread_spin_unlock (&ssl_ticket_lock);
+    if (config->ssl_session_timeout > 0)
+    {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb (ctx, ssl_ticket_key_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb (ctx, ssl_ticket_key_cb);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        SSL_CTX_set_num_tickets (ctx, 1);
+#endif
+    }
+    else
+        SSL_CTX_set_options (ctx, SSL_OP_NO_TICKET);
+}
+
+
 static void get_ssl_certificate (ice_config_t *config)
 {
     ssl_ok = 0;
@@ -348,6 +534,11 @@ static void get_ssl_certificate (ice_config_t *config)
 #endif
         ssl_opts = SSL_CTX_get_options (new_ssl_ctx);
         SSL_CTX_set_options (new_ssl_ctx, ssl_opts|SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3|SSL_OP_NO_COMPRESSION|SSL_OP_CIPHER_SERVER_PREFERENCE|SSL_OP_ALL);
+#ifdef SSL_OP_ENABLE_KTLS
+        // let the kernel do the record layer after the handshake if it can, openssl
+        // stays in userspace for those sockets or ciphers where it cannot
+        SSL_CTX_set_options (new_ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
 
         // Enable DH and ECDH
         // See: https://john.nachtimwald.com/2014/10/01/enable-dh-and-ecdh-in-openssl-server/
@@ -406,8 +597,13 @@ static void get_ssl_certificate (ice_config_t *config)
             INFO1 ("SSL certificate chain found at %s", config->ca_file);
 
         INFO1 ("SSL using ciphers %s", config->cipher_list);
+        ssl_session_setup (new_ssl_ctx, config);
         if (ssl_ctx)
+        {
+            ssl_accepts_prev += SSL_CTX_sess_accept_good (ssl_ctx);
+            ssl_resumed_prev += SSL_CTX_sess_hits (ssl_ctx);
             SSL_CTX_free (ssl_ctx);
+        }
         ssl_ctx = new_ssl_ctx;
         return;
     } while (0);
@@ -422,6 +618,25 @@ static void get_ssl_certificate (ice_config_t *config)
 }
 
 
+/* once the handshake is done, check whether the kernel has taken over the
+ * sending side. If so then plain writes to the socket get encrypted, so writev
+ * and sendfile can be used as for non-ssl connections.
+ */
+static void connection_ssl_offload (connection_t *con)
+{
+    if ((con->sslflags & 6) || SSL_is_init_finished (con->ssl) == 0 || SSL_want (con->ssl) != SSL_NOTHING)
+        return;
+    con->sslflags |= 4;     // only check once
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    if (BIO_get_ktls_send (SSL_get_wbio (con->ssl)))
+    {
+        con->sslflags |= 2;
+        DEBUG1 ("kernel TLS used for sending to %s", con->ip);
+    }
+#endif
+}
+
+
 /* handlers for reading and writing a connection_t when there is ssl
  * configured on the listening port
  */
@@ -451,6 +666,7 @@ int connection_read_ssl (connection_t *con, void *buf, size_t len)
             DEBUG2("error %d, %s", code, err);
             return -1;
     }
+    connection_ssl_offload (con);
     return bytes;
 }
 
@@ -482,6 +698,8 @@ int connection_send_ssl (connection_t *con, const void *buf, size_t len)
     }
     if (bytes > 0)
         con->sent_bytes += bytes;
+    if (bytes == (int)len)
+        connection_ssl_offload (con);
     return bytes;
 }
 #else
@@ -523,11 +741,509 @@ int connection_read (connection_t *con, void *buf, size_t len)
     return bytes;
 }
 
+#ifdef CONNECTION_ZEROCOPY
+
+#define ZC_HELD_MAX         128     /* block references awaiting completion per connection */
+#define ZC_MIN_SEND         4096    /* smaller sends are not worth pinning */
+#define ZC_MAX_WAIT         200     /* ms a listener may wait to gather a send */
+
+/* Each zerocopy send is numbered by the kernel in sequence, and completions are
+ * reported on the socket error queue as ranges of those. The blocks a send is
+ * from are held until then, so the source cannot free pages still being sent.
+ */
+struct connection_zc
+{
+    uint32_t next_seq;
+    unsigned int count;
+    unsigned char waited;   // the last pass waited for more data to gather
+    struct
+    {
+        uint32_t seq;
+        refbuf_t *block;
+    } held [ZC_HELD_MAX];
+};
+
+
+int connection_zerocopy_enable (connection_t *con)
+{
+    int on = 1;
+
+    if (con->zc)
+        return 0;
+    if (not_ssl_connection (con) == 0)
+        return -1;      // ssl sends are copied anyway, kernel TLS included
+    if (setsockopt (con->sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on) < 0)
+        return -1;
+    con->zc = calloc (1, sizeof (struct connection_zc));
+    if (con->zc == NULL)
+        abort();
+    return 0;
+}
+
+
+/* Queue blocks are often smaller than is worth pinning, 320k mp3 is about 1400
+ * bytes a block, so a listener that has caught up waits once for enough data
+ * to gather into one send. Returns the ms to wait, 0 to send now */
+int connection_zerocopy_wait (connection_t *con, uint64_t queued, unsigned long rate)
+{
+    struct connection_zc *zc = con->zc;
+    uint64_t ms;
+
+    if (zc == NULL)
+        return 0;
+    if (zc->waited || con->held || queued >= ZC_MIN_SEND || rate == 0)
+    {
+        zc->waited = 0;
+        return 0;
+    }
+    zc->waited = 1;
+    ms = (ZC_MIN_SEND - queued) * 1000 / rate;
+    return ms > ZC_MAX_WAIT ? ZC_MAX_WAIT : (ms ? (int)ms : 1);
+}
+
+
+static void zerocopy_done (struct connection_zc *zc, uint32_t lo, uint32_t hi)
+{
+    unsigned int i = 0;
+
+    while (i < zc->count)
+    {
+        if (zc->held[i].seq - lo <= hi - lo)
+        {
+            refbuf_release (zc->held[i].block);
+            zc->held[i] = zc->held[--zc->count];
+            continue;
+        }
+        i++;
+    }
+}
+
+
+/* collect completions from the error queue, releasing the blocks they cover */
+static void zerocopy_reap (sock_t sock, struct connection_zc *zc)
+{
+    char control [256];
+
+    while (zc->count)
+    {
+        struct msghdr msg;
+        struct cmsghdr *cm;
+
+        memset (&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg (sock, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0)
+            break;
+        for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm))
+        {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA (cm);
+
+            if ((cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) &&
+                    (cm->cmsg_level != SOL_IPV6 || cm->cmsg_type != IPV6_RECVERR))
+                continue;
+            if (serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                zerocopy_done (zc, serr->ee_info, serr->ee_data);
+        }
+    }
+}
+
+
+static void zerocopy_release_all (struct connection_zc *zc)
+{
+    while (zc->count)
+        refbuf_release (zc->held[--zc->count].block);
+    free (zc);
+}
+
+
+/* send the held pieces in one zerocopy send, each block sent from is held
+ * until the kernel is done with it. Returns -2 if a copying send is to be used
+ * instead */
+static int connection_held_zerocopy (connection_t *con)
+{
+    struct connection_zc *zc = con->zc;
+    struct connection_held *held = con->held;
+    struct msghdr msg;
+    unsigned int i, first;
+    int bytes, sent;
+
+    // at most a reference for each piece is needed
+    if (zc->count + held->count > ZC_HELD_MAX/2)
+        zerocopy_reap (con->sock, zc);
+    if (zc->count + held->count > ZC_HELD_MAX)
+        return -2;
+    memset (&msg, 0, sizeof msg);
+    msg.msg_iov = held->iov;
+    msg.msg_iovlen = held->count;
+    bytes = sendmsg (con->sock, &msg, MSG_ZEROCOPY|MSG_DONTWAIT|MSG_NOSIGNAL);
+    if (bytes < 0)
+    {
+        if (errno == ENOBUFS)
+            return -2;      // out of option memory for pinning, just copy
+        return -1;
+    }
+    for (i = 0, sent = 0, first = zc->count; i < held->count && sent < bytes; i++)
+    {
+        unsigned int j = first;
+
+        sent += IO_VECTOR_LEN (&held->iov [i]);
+        while (j < zc->count && zc->held [j].block != held->block [i])
+            j++;
+        if (j < zc->count)
+            continue;   // already held for this send
+        refbuf_addref (held->block [i]);
+        zc->held [zc->count].seq = zc->next_seq;
+        zc->held [zc->count].block = held->block [i];
+        zc->count++;
+    }
+    zc->next_seq++;
+    return bytes;
+}
+
+#else
+
+int connection_zerocopy_enable (connection_t *con)
+{
+    return -1;
+}
+
+int connection_zerocopy_wait (connection_t *con, uint64_t queued, unsigned long rate)
+{
+    return 0;
+}
+
+#endif
+
+
+/* the block that the data lies in, its chunk header or a rendering of it, so a
+ * reference on the block keeps the data in place */
+static refbuf_t *connection_block_of (refbuf_t *block, const char *buf, size_t len)
+{
+    refbuf_t *derived;
+
+    if (block == NULL)
+        return NULL;
+    if (buf >= block->data && buf + len <= block->data + block->len)
+        return block;
+    if (buf >= (char *)block && buf + len <= (char *)(block + 1))
+        return block;
+    for (derived = block->derived; derived; derived = derived->derived)
+        if (buf >= derived->data && buf + len <= derived->data + derived->len)
+            return block;
+    return NULL;
+}
+
+
+/* take the data to be sent later, with a reference on the shared block it is
+ * from or copied if small. Returns len or -1 if it cannot be taken now */
+static int connection_hold (connection_t *con, const void *buf, size_t len)
+{
+    struct connection_held *held = con->held;
+    refbuf_t *block = connection_block_of (con->shared_block, buf, len);
+    IOVEC *last;
+
+    if (len == 0)
+        return 0;
+    if (block == NULL && len > CONNECTION_HELD_FRAMING)
+        return -1;
+    if (held == NULL)
+    {
+        held = objpool_get (&held_pool);
+        if (held == NULL && (held = malloc (sizeof (*held))) == NULL)
+            abort();
+        held->count = held->framing_used = 0;
+        held->len = 0;
+        held->blocked = 0;
+        held->framing = NULL;
+        con->held = held;
+    }
+    if (block == NULL)
+    {
+        // framing is only appended to, a zerocopy send may still be reading earlier parts
+        if (held->framing == NULL || len > CONNECTION_HELD_FRAMING - held->framing_used)
+        {
+            if (held->count == CONNECTION_HELD_MAX)
+                return -1;
+            refbuf_release (held->framing);
+            held->framing = refbuf_new (CONNECTION_HELD_FRAMING);
+            held->framing_used = 0;
+        }
+        block = held->framing;
+        buf = memcpy (block->data + held->framing_used, buf, len);
+        held->framing_used += len;
+    }
+    last = held->count ? &held->iov [held->count - 1] : NULL;
+    if (last && held->block [held->count - 1] == block && (char *)IO_VECTOR_BASE(last) + IO_VECTOR_LEN(last) == buf)
+    {
+        IO_VECTOR_LEN(last) += len;     // carries on from the last piece
+        held->len += len;
+        return (int)len;
+    }
+    if (held->count == CONNECTION_HELD_MAX)
+        return -1;
+    refbuf_addref (block);
+    IO_VECTOR_BASE (&held->iov [held->count]) = (void *)buf;
+    IO_VECTOR_LEN (&held->iov [held->count]) = len;
+    held->block [held->count] = block;
+    held->count++;
+    held->len += len;
+    return (int)len;
+}
+
+
+/* drop what has been written from the front of the held data */
+static void held_consume (struct connection_held *held, unsigned int bytes)
+{
+    unsigned int done = 0;
+
+    held->len -= bytes;
+    while (done < held->count && bytes >= IO_VECTOR_LEN (&held->iov [done]))
+    {
+        bytes -= IO_VECTOR_LEN (&held->iov [done]);
+        refbuf_release (held->block [done]);
+        done++;
+    }
+    if (done < held->count && bytes)
+    {
+        IO_VECTOR_BASE (&held->iov [done]) = (char *)IO_VECTOR_BASE (&held->iov [done]) + bytes;
+        IO_VECTOR_LEN (&held->iov [done]) -= bytes;
+    }
+    if (done)
+    {
+        held->count -= done;
+        memmove (held->iov, held->iov + done, held->count * sizeof (IOVEC));
+        memmove (held->block, held->block + done, held->count * sizeof (refbuf_t *));
+    }
+}
+
+
+static void held_release (struct connection_held *held)
+{
+    if (held == NULL)
+        return;
+    while (held->count)
+        refbuf_release (held->block [--held->count]);
+    refbuf_release (held->framing);
+    objpool_put (&held_pool, held);
+}
+
+
+/* the socket has taken bytes of the held data, called as sends complete */
+void connection_held_sent (connection_t *con, int bytes)
+{
+    struct connection_held *held = con->held;
+
+    if (held == NULL)
+        return;
+    if (bytes > 0)
+    {
+        con->sent_bytes += bytes;
+        held_consume (held, bytes);
+    }
+    held->blocked = held->count ? 1 : 0;
+    if (held->count == 0)
+    {
+        con->held = NULL;
+        held_release (held);
+    }
+}
+
+
+/* sent_bytes only counts what the socket has taken, this adds what is held for
+ * a batched or gathered send, so is how far along the stream the sender is */
+uint64_t connection_bytes_taken (connection_t *con)
+{
+    return con->sent_bytes + (con->held ? con->held->len : 0);
+}
+
+
+/* write out any data held for the connection, returns 0 once there is none */
+int connection_send_held (connection_t *con)
+{
+    int bytes;
+
+    if (con->batch_queued)
+        send_batch_flush (con->batch_queued);
+    if (con->held == NULL)
+        return 0;
+    bytes = -2;
+#ifdef CONNECTION_ZEROCOPY
+    if (con->zc && con->held->len >= ZC_MIN_SEND)
+        bytes = connection_held_zerocopy (con);
+#endif
+    if (bytes == -2)
+        bytes = sock_writev (con->sock, con->held->iov, con->held->count);
+    if (bytes < 0)
+    {
+        if (!sock_recoverable (sock_error()))
+            con->error = 1;
+        con->held->blocked = 1;
+        return -1;
+    }
+    connection_held_sent (con, bytes);
+    return con->held ? -1 : 0;
+}
+
+
+/* called on close, the socket is kept open while there is still data held for
+ * it or zerocopy sends are outstanding. Returns 1 if it is to be closed later */
+static int connection_linger_add (connection_t *con)
+{
+    struct connection_linger *l;
+    struct connection_held *held = con->held;
+    struct connection_zc *zc = con->zc;
+
+    con->held = NULL;
+    con->zc = NULL;
+    if (held && con->error)
+    {
+        held_release (held);
+        held = NULL;
+    }
+#ifdef CONNECTION_ZEROCOPY
+    if (zc)
+    {
+        zerocopy_reap (con->sock, zc);
+        if (zc->count == 0)
+        {
+            free (zc);
+            zc = NULL;
+        }
+        else if (held == NULL)
+            shutdown (con->sock, SHUT_WR);
+    }
+#endif
+    if (held == NULL && zc == NULL)
+        return 0;
+    l = calloc (1, sizeof (*l));
+    if (l == NULL)
+        abort();
+    l->sock = con->sock;
+    l->held = held;
+    l->zc = zc;
+    l->expire = time (NULL) + LINGER_SECS;
+    thread_spin_lock (&linger_lock);
+    l->next = lingering;
+    lingering = l;
+    thread_spin_unlock (&linger_lock);
+    return 1;
+}
+
+
+/* carry on writing the data held for closed connections, and close those that
+ * are done or have run out of time. All are closed if now is 0 */
+void connection_linger (time_t now)
+{
+    struct connection_linger *l, **trail = &lingering;
+
+    thread_spin_lock (&linger_lock);
+    while ((l = *trail))
+    {
+        if (l->held && now)
+        {
+            int bytes = sock_writev (l->sock, l->held->iov, l->held->count);
+
+            if (bytes > 0)
+                held_consume (l->held, bytes);
+            if ((bytes < 0 && !sock_recoverable (sock_error())) || l->held->count == 0)
+            {
+                held_release (l->held);
+                l->held = NULL;
+#ifdef CONNECTION_ZEROCOPY
+                if (l->zc)
+                    shutdown (l->sock, SHUT_WR);
+#endif
+            }
+        }
+#ifdef CONNECTION_ZEROCOPY
+        if (l->zc)
+        {
+            zerocopy_reap (l->sock, l->zc);
+            if (l->zc->count == 0)
+            {
+                free (l->zc);
+                l->zc = NULL;
+            }
+        }
+#endif
+        if ((l->held || l->zc) && now && now < l->expire)
+        {
+            trail = &l->next;
+            continue;
+        }
+        if (l->held)
+            DEBUG1 ("%u bytes not sent on close", l->held->len);
+#ifdef CONNECTION_ZEROCOPY
+        if (l->zc)
+        {
+            WARN1 ("%u zerocopy sends still outstanding on close", l->zc->count);
+            zerocopy_release_all (l->zc);
+        }
+#endif
+        *trail = l->next;
+        sock_close (l->sock);
+        held_release (l->held);
+        free (l);
+    }
+    thread_spin_unlock (&linger_lock);
+}
+
+
+/* data from the shared block is taken without copying, for the worker to send
+ * in its batch or to be gathered into a zerocopy send. Returns -2 if the send is
+ * to be made directly */
+static int connection_send_hold (connection_t *con, const void *buf, size_t len)
+{
+    int bytes;
+
+    if (con->held && con->held->blocked && con->batch_queued == NULL)
+    {
+        // the socket was full, retry that first
+        if (con->send_batch)
+        {
+            send_batch_queue (con->send_batch, con);
+            return -1;
+        }
+        if (connection_send_held (con) < 0)
+            return -1;
+    }
+    bytes = connection_hold (con, buf, len);
+    if (bytes < 0)
+    {
+        if (con->held == NULL)
+            return -2;
+        if (con->send_batch || connection_send_held (con) < 0)
+            return -1;
+        return -2;
+    }
+    if (con->send_batch)
+    {
+        if (con->held && con->batch_queued == NULL)
+            send_batch_queue (con->send_batch, con);
+    }
+#ifdef CONNECTION_ZEROCOPY
+    else if (con->held && con->held->len >= ZC_MIN_SEND)
+        connection_send_held (con);
+#endif
+    return bytes;
+}
+
+
 int connection_send (connection_t *con, const void *buf, size_t len)
 {
+    int bytes;
+
     if (connection_unreadable (con))
         return -1;
-    int bytes = sock_write_bytes (con->sock, buf, len);
+    if (con->shared_block && (con->send_batch || con->zc))
+    {
+        bytes = connection_send_hold (con, buf, len);
+        if (bytes != -2)
+            return bytes;
+    }
+    if (con->held && connection_send_held (con) < 0)
+        return -1;
+    bytes = sock_write_bytes (con->sock, buf, len);
     if (bytes < 0)
     {
         if (!sock_recoverable (sock_error()))
@@ -539,12 +1255,52 @@ int connection_send (connection_t *con, const void *buf, size_t len)
 }
 
 
+/* send len bytes of the file fd from offset straight to the socket. Returns the
+ * bytes sent, 0 at end of file, -1 if none could be sent and -2 if the kernel
+ * cannot do this for the connection or file, in which case the data is to be
+ * read and sent as usual.
+ */
+int connection_sendfile (connection_t *con, int fd, uint64_t offset, size_t len)
+{
+#ifdef CONNECTION_SENDFILE
+    off_t off = offset;
+    ssize_t bytes;
+
+    if (plain_send_connection (con) == 0)
+        return -2;
+    if (connection_unreadable (con))
+        return -1;
+    if (con->held && connection_send_held (con) < 0)
+        return -1;
+    bytes = sendfile (con->sock, fd, &off, len);
+    if (bytes < 0)
+    {
+        int err = sock_error();
+        if (err == EINVAL || err == ENOSYS)
+            return -2;
+        if (!sock_recoverable (err))
+            con->error = 1;
+        return -1;
+    }
+    con->sent_bytes += bytes;
+    return (int)bytes;
+#else
+    return -2;
+#endif
+}
+
+
 void connection_bufs_init (struct connection_bufs *v, short start)
 {
-    memset (v, 0, sizeof (struct connection_bufs));
-    if (start && start < 500)
+    v->count = 0;
+    v->total = 0;
+    v->block = v->local;
+    v->max = CONNECTION_BUFS_LOCAL;
+    if (start > CONNECTION_BUFS_LOCAL && start < 500)
     {
         v->block = calloc (start, sizeof (IOVEC));
+        if (v->block == NULL)
+            abort();
         v->max = start;
     }
 }
@@ -552,8 +1308,12 @@ void connection_bufs_init (struct connection_bufs *v, short start)
 
 void connection_bufs_release (struct connection_bufs *v)
 {
-    free (v->block);
-    memset (v, 0, sizeof (struct connection_bufs));
+    if (v->block != v->local)
+        free (v->block);
+    v->count = 0;
+    v->total = 0;
+    v->block = v->local;
+    v->max = CONNECTION_BUFS_LOCAL;
 }
 
 
@@ -574,7 +1334,17 @@ int connection_bufs_append (struct connection_bufs *v, void *buf, unsigned int l
     if (v->count >= v->max)
     {
        int len = v->max + 16;
-       IOVEC *arr = realloc (v->block, (len*sizeof(IOVEC)));
+       IOVEC *arr;
+
+       if (v->block == v->local)
+       {
+           arr = malloc (len*sizeof(IOVEC));
+           if (arr) memcpy (arr, v->local, v->count*sizeof(IOVEC));
+       }
+       else
+           arr = realloc (v->block, (len*sizeof(IOVEC)));
+       if (arr == NULL)
+           abort();
        v->max = len;
        v->block = arr;
     }
@@ -616,6 +1386,73 @@ static int connbufs_locate_start (struct connection_bufs *vects, int skip, IOVEC
 }
 
 
+#ifdef HAVE_OPENSSL
+#define CONNBUFS_SSL_RECORD     SSL3_RT_MAX_PLAIN_LENGTH
+
+/* SSL_write per vector entry would mean a record, and probably a syscall, for
+ * each small piece like a chunk header or metadata. Gather up entries into a
+ * record sized block and write that instead, large entries are written as is.
+ * A write that needs retrying is redone from the same point, which gathers the
+ * same data again, as openssl requires.
+ */
+static int connbufs_send_ssl (connection_t *con, IOVEC *io, int count)
+{
+    int bytes = 0, off = 0;
+
+    while (count)
+    {
+        char *buf = (char *)IO_VECTOR_BASE(io) + off;
+        int len = IO_VECTOR_LEN(io) - off, v, sent;
+
+        if (count > 1 && len < CONNBUFS_SSL_RECORD)
+        {
+            IOVEC *p = io;
+            int c = count, o = off;
+
+            if (con->ssl_buf == NULL && (con->ssl_buf = malloc (CONNBUFS_SSL_RECORD)) == NULL)
+                abort();
+            for (len = 0; c && len < CONNBUFS_SSL_RECORD; )
+            {
+                int n = IO_VECTOR_LEN(p) - o;
+                if (n > CONNBUFS_SSL_RECORD - len)
+                    n = CONNBUFS_SSL_RECORD - len;
+                memcpy (con->ssl_buf + len, (char *)IO_VECTOR_BASE(p) + o, n);
+                len += n;
+                o += n;
+                if (o == IO_VECTOR_LEN(p))
+                {
+                    p++;
+                    c--;
+                    o = 0;
+                }
+            }
+            buf = con->ssl_buf;
+        }
+        sent = v = connection_send_ssl (con, buf, len);
+        if (v <= 0)
+            break;
+        bytes += v;
+        while (v)       // move along the vector by the amount sent
+        {
+            int n = IO_VECTOR_LEN(io) - off;
+            if (v < n)
+            {
+                off += v;
+                break;
+            }
+            v -= n;
+            io++;
+            count--;
+            off = 0;
+        }
+        if (sent < len)
+            break;
+    }
+    return bytes ? bytes : -1;
+}
+#endif
+
+
 int connection_bufs_send (connection_t *con, struct connection_bufs *vectors, int skip)
 {
     IOVEC *p = vectors->block, old_vals;
@@ -627,177 +1464,123 @@ int connection_bufs_send (connection_t *con, struct connection_bufs *vectors, in
 
     if (i >= 0)
     {
-        if (not_ssl_connection (con))
+        if (plain_send_connection (con))
         {
             if (connection_unreadable (con))
-                return -1;
-            ret = sock_writev (con->sock, p, vectors->count - i);
-            if (ret < 0 && !sock_recoverable (sock_error()))
-                con->error = 1;
-        }
-#ifdef HAVE_OPENSSL
-        else
-        {
-            IOVEC *io = p;
-            int bytes = 0;
-            for (; i < vectors->count; i++, io++)
+                ret = -1;
+            else
             {
-               int v = connection_send_ssl (con, IO_VECTOR_BASE(io), IO_VECTOR_LEN(io));
-               if (v > 0) bytes += v;
-               if (v < 0 || v < IO_VECTOR_LEN(io)) break;
+                IOVEC *io = p;
+                int bytes = 0, v = -2;
+
+                if (con->shared_block && (con->send_batch || con->zc))
+                {
+                    // take what can be held, the rest waits until the held data is sent
+                    for (; i < vectors->count; i++, io++)
+                    {
+                        v = connection_send_hold (con, IO_VECTOR_BASE(io), IO_VECTOR_LEN(io));
+                        if (v > 0) bytes += v;
+                        if (v < (int)IO_VECTOR_LEN(io)) break;
+                    }
+                }
+                if (v == -2 && (con->held == NULL || connection_send_held (con) == 0))
+                {
+                    v = sock_writev (con->sock, io, vectors->count - i);
+                    if (v < 0 && !sock_recoverable (sock_error()))
+                        con->error = 1;
+                    if (v > 0)
+                    {
+                        con->sent_bytes += v;
+                        bytes += v;
+                    }
+                }
+                if (bytes > 0)
+                    ret = bytes;
             }
-            if (bytes > 0)  ret = bytes;
         }
+#ifdef HAVE_OPENSSL
+        else
+            ret = connbufs_send_ssl (con, p, vectors->count - i);
 #endif
         if (offset)
             *p = old_vals;
-        if (ret > 0)
-            con->sent_bytes += ret;
     }
     return ret;
 }
 
 
-int connection_chunk_start (connection_t *con, struct connection_bufs *bufs, char *chunk_hdr, unsigned chunk_sz)
+/* write the chunk header for the size, without snprintf as this is per send or
+ * per queue block. Returns the header length, no nul is added */
+int connection_chunk_header (char *chunk_hdr, unsigned chunk_sz)
 {
-    int chunk_hdrlen = snprintf (chunk_hdr, CHUNK_HDR_SZ, "%x\r\n", chunk_sz);
+    static const char hex[] = "0123456789abcdef";
+    char digits [8];
+    int n = 0, len = 0;
 
-    return connection_bufs_append (bufs, chunk_hdr, chunk_hdrlen);
+    do
+    {
+        digits [n++] = hex [chunk_sz & 15];
+        chunk_sz >>= 4;
+    } while (chunk_sz);
+    while (n)
+        chunk_hdr [len++] = digits [--n];
+    chunk_hdr [len++] = '\r';
+    chunk_hdr [len++] = '\n';
+    return len;
 }
 
 
-int connection_chunk_end (connection_t *con, struct connection_bufs *bufs, char *chunk_hdr, unsigned chunk_sz)
+int connection_chunk_start (connection_t *con, struct connection_bufs *bufs, char *chunk_hdr, unsigned chunk_sz)
 {
-    char *p = strchr (chunk_hdr, '\r');
-    if (p && p[1] == '\n')
-        return connection_bufs_append (bufs, p, 2);
-    ERROR0 ("chunk has no EOL");
-    abort();
+    return connection_bufs_append (bufs, chunk_hdr, connection_chunk_header (chunk_hdr, chunk_sz));
 }
 
-
-
-static void add_banned_ip (cache_file_contents *c, const void *e, time_t now)
-{
-    if (c)
-    {
-        struct node_IP_time *banned;
-        const char *ip = e;
-#ifdef HAVE_FNMATCH_H
-        if (ip [strcspn (ip, "*?[")]) // if wildcard present
-        {
-            struct cache_list_node *entry = calloc (1, sizeof (*entry));
-            entry->content = strdup (ip);
-            entry->next = c->extra;
-            c->extra = entry;
-            DEBUG1 ("Adding wildcard entry \"%.30s\"", ip);
-            return;
-        }
-#endif
-        banned = calloc (1, sizeof (struct node_IP_time));
-        snprintf (&banned->ip[0], sizeof (banned->ip), "%s", ip);
-        banned->a.timeout = now;
-        DEBUG1 ("Adding literal entry \"%.30s\"", ip);
-        avl_insert (c->contents, banned);
-    }
+
+int connection_chunk_end (connection_t *con, struct connection_bufs *bufs, char *chunk_hdr, unsigned chunk_sz)
+{
+    static char chunk_eol[] = "\r\n";
+    return connection_bufs_append (bufs, chunk_eol, 2);
 }
 
+
+
 void connection_add_banned_ip (const char *ip, int duration)
 {
     time_t timeout = 0;
     if (duration > 0)
         timeout = time(NULL) + duration;
 
-    if (banned_ip.contents)
-    {
-        global_lock();
-        add_banned_ip (&banned_ip, ip, timeout);
-        global_unlock();
-    }
-    else
+    if (ip_filter_add (&banned_ip, ip, timeout) < 0)
         INFO0 ("No ban-file set up, missing tag in xml or no file referenced");
 }
 
 void connection_release_banned_ip (const char *ip)
 {
-    if (banned_ip.contents)
-    {
-        global_lock();
-        avl_delete (banned_ip.contents, (void*)ip, cached_treenode_free);
-        global_unlock();
-    }
+    ip_filter_remove (&banned_ip, ip);
 }
 
 void connection_stats (void)
 {
-    long banned_IPs = 0;
-    if (banned_ip.contents)
-        banned_IPs = (long)banned_ip.contents->length;
-    stats_event_args (NULL, "banned_IPs", "%ld", banned_IPs);
-}
-
-
-time_t cachefile_timecheck = (time_t)0;
-
-/* check specified ip against internal set of banned IPs
- * return -1 for no data, 0 for no match and 1 for match
- */
-static int search_banned_ip_locked (char *ip)
-{
-    int ret = 0;
-    if (banned_ip.extra)
-    {
-        struct cache_list_node *entry = banned_ip.extra;
-        while (entry)
-        {
-            if (cached_pattern_compare (ip, entry->content) == 0)
-                return 1;
-            entry = entry->next;
-        }
-    }
-    if (banned_ip.contents)
-    {
-        int i;
-        void *result;
-
-        banned_ip.deletions_count = 0;
-        if (avl_get_by_key (banned_ip.contents, ip, &result) == 0)
-        {
-            struct node_IP_time *match = result;
-            if (match->a.timeout == 0 || match->a.timeout > cachefile_timecheck)
-            {
-                if (match->a.timeout && cachefile_timecheck + 300 > match->a.timeout)
-                    match->a.timeout = cachefile_timecheck + 300;
-                ret = 1;
-            }
-            else
-                avl_delete (banned_ip.contents, ip, cached_treenode_free);
-        }
-        /* we may of seen others to remove */
-        for (i = 0; i < banned_ip.deletions_count; ++i)
-        {
-            struct node_IP_time *to_go = banned_ip.deletions[i];
-            INFO1 ("removing %s from ban list for now", &(to_go->ip[0]));
-            avl_delete (banned_ip.contents, &(to_go->ip[0]), cached_treenode_free);
-        }
-        banned_ip.deletions_count = 0;
-    }
-    return ret;
-}
+    uint64_t limited;
 
-
-static int search_banned_ip (char *ip)
-{
-    int ret;
+    stats_event_args (NULL, "banned_IPs", "%ld", ip_filter_count (&banned_ip));
     thread_spin_lock (&_connection_lock);
-    time_t t = cachefile_timecheck;
+    limited = _rate_limited;
     thread_spin_unlock (&_connection_lock);
-
-    cached_file_recheck (&banned_ip, t);
-    global_lock();
-    ret = search_banned_ip_locked (ip);
-    global_unlock();
-    return ret;
+    stats_event_args (NULL, "connections_rate_limited", "%" PRIu64, limited);
+#ifdef HAVE_OPENSSL
+    if (ssl_ctx)
+    {
+        uint64_t accepts = ssl_accepts_prev + SSL_CTX_sess_accept_good (ssl_ctx);
+        uint64_t resumed = ssl_resumed_prev + SSL_CTX_sess_hits (ssl_ctx);
+
+        // misses are handshakes done in full
+        stats_event_args (NULL, "ssl_session_hits", "%" PRIu64, resumed);
+        stats_event_args (NULL, "ssl_session_misses", "%" PRIu64, accepts - resumed);
+        stats_event_args (NULL, "ssl_session_cached", "%ld", SSL_CTX_sess_number (ssl_ctx));
+        stats_event_args (NULL, "ssl_ticket_unknown", "%" PRIu64, ssl_ticket_unknown);
+    }
+#endif
 }
 
 
@@ -805,16 +1588,15 @@ static int search_banned_ip (char *ip)
 static int accept_ip_address (char *ip)
 {
     time_t t = time (NULL);
-    thread_spin_lock (&_connection_lock);
-    cachefile_timecheck = t;
-    thread_spin_unlock (&_connection_lock);
 
-    if (search_banned_ip (ip) > 0)
+    ip_filter_recheck (&banned_ip, t);
+    if (ip_filter_search (&banned_ip, ip, t) > 0)
     {
         DEBUG1 ("%s banned", ip);
         return 0;
     }
-    if (cached_pattern_search (&allowed_ip, ip, t) == 0)
+    ip_filter_recheck (&allowed_ip, t);
+    if (ip_filter_search (&allowed_ip, ip, t) == 0)
     {
         DEBUG1 ("%s is not allowed", ip);
         return 0;
@@ -836,6 +1618,29 @@ static struct xforward_entry *_find_xforward_addr (ice_config_t *config, char *i
 }
 
 
+/* check the new connection against the per address and per network rates.
+ * A trusted proxy passes on many clients so it is not held to them */
+static int connection_rate_ok (const char *ip)
+{
+    int ret = connect_limit_check (ip, timing_get_time());
+
+    if (ret > 0)
+        return 1;
+    if (_find_xforward_addr (config_get_config(), (char*)ip) != NULL)
+    {
+        config_release_config();
+        return 1;
+    }
+    config_release_config();
+    if (ret < 0)
+        INFO1 ("%s is connecting too often, dropping connections", ip);
+    thread_spin_lock (&_connection_lock);
+    _rate_limited++;
+    thread_spin_unlock (&_connection_lock);
+    return 0;
+}
+
+
 static int _set_connection_peer (connection_t *con, sock_t sock)
 {
     struct sockaddr_storage sa;
@@ -953,212 +1758,229 @@ void connection_close_sigfd (void)
 #endif
 
 
-static sock_t wait_for_serversock (void)
+/* take the share of listening sockets for this acceptor, sockets are laid out so
+ * that consecutive ones are copies of the same address. */
+static void acceptor_setup (acceptor_t *a)
+{
+    int i;
+
+    global_lock();
+    a->count = 0;
+    a->socks = calloc (global.server_sockets + 1, sizeof (sock_t));
+    a->conns = calloc (global.server_sockets + 1, sizeof (listener_t *));
+    for (i = a->id; i < global.server_sockets; i += acceptor_count)
+    {
+        a->socks [a->count] = global.serversock [i];
+        a->conns [a->count] = global.server_conn [i];
+        a->count++;
+    }
+    global_unlock();
+}
+
+
+/* drop a failed listening socket from both the acceptor and global lists */
+static void acceptor_remove_socket (acceptor_t *a, int idx)
+{
+    listener_t *l = a->conns [idx];
+    sock_t sock = a->socks [idx];
+    int i;
+
+    WARN2("Had to remove a listening socket on port %d (%s)", l->port, l->bind_address ? l->bind_address : "default");
+    global_lock();
+    for (i = 0; i < global.server_sockets; i++)
+    {
+        if (global.serversock[i] != sock)
+            continue;
+        global.server_sockets--;
+        memmove (&global.serversock[i], &global.serversock[i+1], (global.server_sockets - i) * sizeof (sock_t));
+        memmove (&global.server_conn[i], &global.server_conn[i+1], (global.server_sockets - i) * sizeof (listener_t *));
+        config_clear_listener (l);
+        break;
+    }
+    global_unlock();
+    sock_close (sock);
+    a->count--;
+    memmove (&a->socks [idx], &a->socks [idx+1], (a->count - idx) * sizeof (sock_t));
+    memmove (&a->conns [idx], &a->conns [idx+1], (a->count - idx) * sizeof (listener_t *));
+}
+
+
+#ifdef HAVE_SIGNALFD
+static void connection_read_sigfd (void)
+{
+    struct signalfd_siginfo fdsi;
+    int ret  = read (sigfd, &fdsi, sizeof(struct signalfd_siginfo));
+    if (ret == sizeof(struct signalfd_siginfo))
+    {
+        switch (fdsi.ssi_signo)
+        {
+            case SIGINT:
+            case SIGTERM:
+                DEBUG0 ("signalfd received a termination");
+                global_lock();
+                global.running = ICE_HALTING;
+                global_unlock();
+                thread_spin_lock (&_connection_lock);
+                connection_running = 0;
+                thread_spin_unlock (&_connection_lock);
+                break;
+            case SIGHUP:
+                INFO0 ("HUP received, reread scheduled");
+                global_lock();
+                global.schedule_config_reread = 1;
+                global_unlock();
+                break;
+            default:
+                WARN1 ("unexpected signal (%d)", fdsi.ssi_signo);
+        }
+    }
+}
+#endif
+
+
+/* wait for incoming connections on the acceptor sockets, fills in the ready
+ * listening sockets and returns how many there are */
+static int acceptor_wait (acceptor_t *a, sock_t *ready)
 {
 #ifdef HAVE_POLL
-    int i, ret;
-    struct pollfd ufds [global.server_sockets + 1];
+    int i, ret, count = a->count, found = 0;
+    struct pollfd ufds [a->count + 1];
 
-    for(i=0; i < global.server_sockets; i++) {
-        ufds[i].fd = global.serversock[i];
+    for(i=0; i < a->count; i++) {
+        ufds[i].fd = a->socks[i];
         ufds[i].events = POLLIN;
         ufds[i].revents = 0;
     }
 #ifdef HAVE_SIGNALFD
     ufds[i].revents = 0;
-    if (sigfd >= 0)
+    if (a->id == 0 && sigfd >= 0)
     {
         ufds[i].fd = sigfd;
         ufds[i].events = POLLIN;
         ret = poll(ufds, i+1, 4000);
     }
     else
-        ret = poll(ufds, i, 4000);
+        ret = poll(ufds, i, 1000);
 #else
-    ret = poll(ufds, global.server_sockets, 333);
+    ret = poll(ufds, a->count, 333);
 #endif
 
     if (ret <= 0)
-        return SOCK_ERROR;
-    else {
-        int dst;
+        return 0;
 #ifdef HAVE_SIGNALFD
+    if (a->id == 0 && sigfd >= 0)
+    {
         if (ufds[i].revents & POLLIN)
-        {
-            struct signalfd_siginfo fdsi;
-            int ret  = read (sigfd, &fdsi, sizeof(struct signalfd_siginfo));
-            if (ret == sizeof(struct signalfd_siginfo))
-            {
-                switch (fdsi.ssi_signo)
-                {
-                    case SIGINT:
-                    case SIGTERM:
-                        DEBUG0 ("signalfd received a termination");
-                        global_lock();
-                        global.running = ICE_HALTING;
-                        global_unlock();
-                        thread_spin_lock (&_connection_lock);
-                        connection_running = 0;
-                        thread_spin_unlock (&_connection_lock);
-                        break;
-                    case SIGHUP:
-                        INFO0 ("HUP received, reread scheduled");
-                        global_lock();
-                        global.schedule_config_reread = 1;
-                        global_unlock();
-                        break;
-                    default:
-                        WARN1 ("unexpected signal (%d)", fdsi.ssi_signo);
-                }
-            }
-        }
+            connection_read_sigfd ();
         if (ufds[i].revents & (POLLNVAL|POLLERR))
         {
             ERROR0 ("signalfd descriptor became invalid, doing thread restart");
             slave_restart(); // something odd happened
             thread_sleep (250000);
         }
+    }
 #endif
-        for(i=0; i < global.server_sockets; i++) {
-            if(ufds[i].revents & POLLIN)
-                return ufds[i].fd;
-            if(ufds[i].revents & (POLLHUP|POLLERR|POLLNVAL))
-            {
-                if (ufds[i].revents & (POLLHUP|POLLERR))
-                {
-                    sock_close (global.serversock[i]);
-                }
-                listener_t *l = global.server_conn[i];
-                WARN2("Had to remove a listening socket on port %d (%s)", l->port, l->bind_address ? l->bind_address : "default");
-                global.serversock[i] = SOCK_ERROR;
-            }
-        }
-        /* remove any closed sockets */
-        for(i=0, dst=0; i < global.server_sockets; i++)
-        {
-            if (global.serversock[i] == SOCK_ERROR)
-                continue;
-            if (i!=dst)
-                global.serversock[dst] = global.serversock[i];
-            dst++;
-        }
-        global.server_sockets = dst;
-        return SOCK_ERROR;
+    for(i=0; i < count; i++) {
+        if(ufds[i].revents & POLLIN)
+            ready [found++] = ufds[i].fd;
     }
+    /* remove any failed sockets, backwards so the indexes stay valid */
+    for(i=count-1; i >= 0; i--) {
+        if((ufds[i].revents & POLLIN) == 0 && (ufds[i].revents & (POLLHUP|POLLERR|POLLNVAL)))
+            acceptor_remove_socket (a, i);
+    }
+    return found;
 #else
     fd_set rfds;
     struct timeval tv;
-    int i, ret;
+    int i, ret, found = 0;
     sock_t max = SOCK_ERROR;
 
     FD_ZERO(&rfds);
 
-    for(i=0; i < global.server_sockets; i++) {
-        FD_SET(global.serversock[i], &rfds);
-        if (max == SOCK_ERROR || global.serversock[i] > max)
-            max = global.serversock[i];
+    for(i=0; i < a->count; i++) {
+        FD_SET(a->socks[i], &rfds);
+        if (max == SOCK_ERROR || a->socks[i] > max)
+            max = a->socks[i];
     }
 
     tv.tv_sec = 0;
     tv.tv_usec = 333000;
 
     ret = select(max+1, &rfds, NULL, NULL, &tv);
-    if(ret < 0) {
-        return SOCK_ERROR;
-    }
-    else if(ret == 0) {
-        return SOCK_ERROR;
-    }
-    else {
-        for(i=0; i < global.server_sockets; i++) {
-            if(FD_ISSET(global.serversock[i], &rfds))
-                return global.serversock[i];
-        }
-        return SOCK_ERROR; /* Should be impossible, stop compiler warnings */
+    if (ret <= 0)
+        return 0;
+    for(i=0; i < a->count; i++) {
+        if(FD_ISSET(a->socks[i], &rfds))
+            ready [found++] = a->socks[i];
     }
+    return found;
 #endif
 }
 
 
-static client_t *accept_client (void)
+/* accept a connection on the listening socket. returns -1 when there are no more
+ * pending, 0 if the connection was dropped, 1 for a new client */
+static int accept_client (acceptor_t *a, sock_t serversock, client_t **clientp)
 {
-    sock_t sock, serversock = wait_for_serversock ();
     listener_t *server_conn = NULL;
+    sock_t sock;
     char addr [200];
+    int i;
 
-    if (serversock == SOCK_ERROR)
-        return NULL;
-
-    sock = sock_accept (serversock, addr, 200);
+    sock = sock_accept_nonblocking (serversock, addr, 200);
     if (sock == SOCK_ERROR)
     {
         if (sock_recoverable (sock_error()))
-            return NULL;
+            return -1;
         WARN2 ("accept() failed with error %d: %s", sock_error(), strerror(sock_error()));
         thread_sleep (500000);
-        return NULL;
+        return -1;
+    }
+    for (i=0; i < a->count; i++)
+    {
+        if (a->socks[i] == serversock)
+        {
+            server_conn = a->conns[i];
+            break;
+        }
     }
     do
     {
-        int i;
+        client_t *client;
         refbuf_t *r;
 
-        if (accept_ip_address (addr) == 0)
+        if (server_conn == NULL || connection_rate_ok (addr) == 0 || accept_ip_address (addr) == 0)
             break;
 
-        if (sock_set_blocking (sock, 0))
+        client = client_new ();
+        if (connection_init (&client->connection, sock, addr) < 0)
         {
-            WARN0 ("failed to set tcp options on client connection, dropping");
+            client_free (client);
             break;
         }
 
+        client->shared_data = r = refbuf_new (PER_CLIENT_REFBUF_SIZE);
+        r->len = 0; // for building up the request coming in
+
         global_lock ();
-        for (i=0; i < global.server_sockets; i++)
-        {
-            if (global.serversock[i] == serversock)
-            {
-                server_conn = global.server_conn[i];
-                server_conn->refcount++;
-                break;
-            }
-        }
+        server_conn->refcount++;
+        client_register (client);
         global_unlock ();
-        if (server_conn)
-        {
-            client_t *client = calloc (1, sizeof (client_t));
-
-            if (client == NULL || connection_init (&client->connection, sock, addr) < 0)
-            {
-                free (client);
-                break;
-            }
-
-            client->shared_data = r = refbuf_new (PER_CLIENT_REFBUF_SIZE);
-            r->len = 0; // for building up the request coming in
 
-            global_lock ();
-            client_register (client);
-            global_unlock ();
-
-            if (server_conn->shoutcast_compat)
-                client->ops = &shoutcast_source_ops;
-            else
-                client->ops = &http_request_ops;
-            client->server_conn = server_conn;
-            client->flags |= CLIENT_ACTIVE;
+        if (server_conn->shoutcast_compat)
+            client->ops = &shoutcast_source_ops;
+        else
+            client->ops = &http_request_ops;
+        client->server_conn = server_conn;
+        client->flags |= CLIENT_ACTIVE;
 
-            return client;
-        }
+        *clientp = client;
+        return 1;
     } while (0);
 
-    if (server_conn)
-    {
-        global_lock ();
-        config_clear_listener (server_conn);
-        global_unlock ();
-    }
     sock_close (sock);
-    return NULL;
+    return 0;
 }
 
 
@@ -1370,8 +2192,7 @@ static int http_client_request (client_t *client)
             client->refbuf = client->shared_data;
             client->shared_data = NULL;
             client->connection.discon.time = 0;
-            client->parser = httpp_create_parser();
-            httpp_initialize (client->parser, NULL);
+            client->parser = client_parser_new ();
             if (httpp_parse (client->parser, refbuf->data, refbuf->len))
             {
                 const char *str;
@@ -1483,62 +2304,62 @@ static int http_client_request (client_t *client)
 
 static void *connection_thread (void *arg)
 {
-    ice_config_t *config;
-
-#ifdef HAVE_SIGNALFD
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGHUP);
-    sigaddset(&mask, SIGTERM);
-    sigfd = signalfd(-1, &mask, 0);
-#endif
-
-    config = config_get_config ();
-    /* setup the banned/allowed IP filenames from the xml */
-    cached_file_init (&banned_ip,  config->banfile,   add_banned_ip, compare_banned_ip);
-    cached_file_init (&allowed_ip, config->allowfile, NULL, NULL);
-    cached_file_init (&useragents, config->agentfile, NULL, NULL);
-
-    connection_setup_sockets (config);
-    header_timeout = config->header_timeout;
-    config_release_config ();
+    acceptor_t *a = arg;
 
-    INFO0 ("connection thread started");
+    acceptor_setup (a);
+    if (a->count == 0 && a->id)
+    {
+        INFO1 ("no listening sockets for connection thread %d", a->id);
+        return NULL;
+    }
+    if (a->cpu >= 0 && util_thread_affinity (a->cpu, -1) < 0)
+        WARN2 ("unable to run connection thread %d on cpu %d", a->id, a->cpu);
+    INFO2 ("connection thread %d started with %d sockets", a->id, a->count);
 
     thread_spin_lock (&_connection_lock);
-    connection_running = 1;
-
     while (connection_running)
     {
+        sock_t ready [a->count + 1];
+        int i, found;
+
         thread_spin_unlock (&_connection_lock);
-        client_t *client = accept_client ();
-        if (client)
+        found = acceptor_wait (a, ready);
+        for (i = 0; i < found; i++)
         {
-            /* do a small delay here so the client has chance to send the request after
-             * getting a connect. */
-            client->counter = client->schedule_ms = timing_get_time();
-            client->connection.con_time = client->schedule_ms/1000;
-            client->connection.discon.time = client->connection.con_time + header_timeout;
-            client->schedule_ms += 9;
-            client_add_incoming (client);
-            stats_event_inc (NULL, "connections");
+            int batch = 0;
+
+            /* drain what is pending on this socket, within reason */
+            do
+            {
+                client_t *client = NULL;
+                int ret = accept_client (a, ready[i], &client);
+
+                if (ret < 0)
+                    break;
+                if (client)
+                {
+                    /* do a small delay here so the client has chance to send the request after
+                     * getting a connect. */
+                    client->counter = client->schedule_ms = timing_get_time();
+                    client->connection.con_time = client->schedule_ms/1000;
+                    client->connection.discon.time = client->connection.con_time + header_timeout;
+                    client->schedule_ms += 9;
+                    client_add_incoming (client);
+                    stats_event_inc (NULL, "connections");
+                }
+                if (global.new_connections_slowdown)
+                    thread_sleep (global.new_connections_slowdown * 5000);
+            } while (++batch < ACCEPT_BATCH_MAX);
         }
-        if (global.new_connections_slowdown)
-            thread_sleep (global.new_connections_slowdown * 5000);
         thread_spin_lock (&_connection_lock);
     }
-    connection_running = 0;
     thread_spin_unlock (&_connection_lock);
 
-    global_lock();
-    cached_file_clear (&banned_ip);
-    cached_file_clear (&allowed_ip);
-    cached_file_clear (&useragents);
-    global_unlock();
-    connection_close_sigfd ();
-
-    INFO0 ("connection thread finished");
+    free (a->socks);
+    free (a->conns);
+    a->socks = NULL;
+    a->conns = NULL;
+    INFO1 ("connection thread %d finished", a->id);
 
     return NULL;
 }
@@ -1546,28 +2367,88 @@ static void *connection_thread (void *arg)
 
 void connection_thread_startup ()
 {
+    ice_config_t *config;
+    char placement [1000];
+    int i, len = 0;
 #ifdef HAVE_SIGNALFD
     sigset_t mask;
     sigfillset(&mask);
     pthread_sigmask (SIG_SETMASK, &mask, NULL);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigfd = signalfd(-1, &mask, 0);
 #endif
-    if (conn_tid)
-        WARN0("id for connection thread still set");
+    if (acceptors)
+        WARN0("connection threads still set");
+
+    config = config_get_config ();
+    /* setup the banned/allowed IP filenames from the xml */
+    ip_filter_set_file (&banned_ip,  config->banfile);
+    ip_filter_set_file (&allowed_ip, config->allowfile);
+    cached_file_init (&useragents, config->agentfile, NULL, NULL);
+
+    connection_setup_sockets (config);
+    connect_limit_setup (config);
+    header_timeout = config->header_timeout;
+    acceptor_count = config->acceptor_count;
+    acceptors = calloc (acceptor_count, sizeof (acceptor_t));
+    if (acceptors == NULL)
+        abort();
+    placement[0] = '\0';
+    for (i = 0; i < acceptor_count; i++)
+    {
+        acceptor_t *a = &acceptors[i];
+
+        util_thread_placement (config->acceptor_cpus, NULL, i, &a->cpu, &a->node);
+        if (len < (int)sizeof (placement) - 40)
+        {
+            if (a->cpu < 0)
+                len += snprintf (placement+len, sizeof (placement)-len, "%s%d:any", i ? " " : "", i);
+            else
+                len += snprintf (placement+len, sizeof (placement)-len, "%s%d:cpu%d/node%d", i ? " " : "", i, a->cpu, a->node);
+        }
+    }
+    config_release_config ();
+    stats_event (NULL, "acceptor_placement", placement);
+
+    thread_spin_lock (&_connection_lock);
+    connection_running = 1;
+    thread_spin_unlock (&_connection_lock);
 
-    conn_tid = thread_create ("connection", connection_thread, NULL, THREAD_ATTACHED);
+    for (i = 0; i < acceptor_count; i++)
+    {
+        acceptors[i].id = i;
+        acceptors[i].thread = thread_create ("connection", connection_thread, &acceptors[i], THREAD_ATTACHED);
+    }
 }
 
 
 void connection_thread_shutdown ()
 {
-    if (conn_tid)
+    if (acceptors)
     {
+        int i;
+
         thread_spin_lock (&_connection_lock);
         connection_running = 0;
         thread_spin_unlock (&_connection_lock);
-        INFO0("shutting down connection thread");
-        thread_join (conn_tid);
-        conn_tid = NULL;
+        INFO0("shutting down connection threads");
+        for (i = 0; i < acceptor_count; i++)
+            if (acceptors[i].thread)
+                thread_join (acceptors[i].thread);
+        free (acceptors);
+        acceptors = NULL;
+        acceptor_count = 0;
+
+        ip_filter_clear (&banned_ip);
+        ip_filter_clear (&allowed_ip);
+        global_lock();
+        cached_file_clear (&useragents);
+        global_unlock();
+        connection_close_sigfd ();
     }
 }
 
@@ -1699,8 +2580,11 @@ int connection_check_pass (http_parser_t *parser, const char *user, const char *
         ret = _check_pass_http(parser, user, pass);
         if (!ret)
         {
-            ice_config_t *config = config_get_config_unlocked();
-            if (config->ice_login)
+            ice_config_t *config = config_get_config();
+            int ice_login = config->ice_login;
+
+            config_release_config();
+            if (ice_login)
             {
                 ret = _check_pass_ice(parser, pass);
                 if(ret)
@@ -1928,10 +2812,44 @@ void connection_listen_sockets_close (ice_config_t *config, int all_sockets)
 }
 
 
+/* apply the listener settings to a newly bound socket and add it to the listening
+ * set, returns 0 on success */
+static int connection_add_server_socket (listener_t *listener, sock_t sock, int *countp, int *arr_sizep)
+{
+    /* some win32 setups do not do TCP win scaling well, so allow an override */
+    if (listener->so_sndbuf)
+        sock_set_send_buffer (sock, listener->so_sndbuf);
+    if (listener->so_mss)
+        sock_set_mss (sock, listener->so_mss);
+    if (sock_listen (sock, listener->qlen) == SOCK_ERROR)
+    {
+        sock_close (sock);
+        return -1;
+    }
+    if (*countp >= *arr_sizep) // need to resize arrays?
+    {
+        void *tmp;
+        *arr_sizep += 10;
+        tmp = realloc (global.serversock, (*arr_sizep * sizeof (sock_t)));
+        if (tmp) global.serversock = tmp;
+
+        tmp = realloc (global.server_conn, (*arr_sizep * sizeof (listener_t*)));
+        if (tmp) global.server_conn = tmp;
+    }
+
+    sock_set_blocking (sock, 0);
+    global.serversock [*countp] = sock;
+    global.server_conn [*countp] = listener;
+    listener->refcount++;
+    (*countp)++;
+    return 0;
+}
+
+
 int connection_setup_sockets (ice_config_t *config)
 {
     static int sockets_setup = 2;
-    int count = 0, socket_count = 0, socket_attempt = 0, arr_size;
+    int count = 0, socket_count = 0, socket_attempt = 0, arr_size, copies = config->acceptor_count;
     listener_t *listener, **prev;
 
     global_lock();
@@ -1955,50 +2873,48 @@ int connection_setup_sockets (ice_config_t *config)
         INFO1 ("%d listening sockets already open", count);
     while (listener)
     {
+        sock_server_t sockets [copies];
+        int c;
+
         socket_count = 0;
         socket_attempt = 0;
 
-        sock_server_t sockets = sock_get_server_sockets (listener->port, listener->bind_address);
+        /* with several acceptors, each address gets a socket per acceptor */
+        for (c = 0; c < copies; c++)
+        {
+            sockets [c] = sock_get_server_sockets (listener->port, listener->bind_address);
+            if (copies > 1 && sockets [c] && sock_server_reuseport (sockets [c]) < 0)
+            {
+                // fixed at build time so only the first will get here
+                INFO0 ("shared listening sockets not supported, acceptors will share sockets instead");
+                copies = 1;
+                break;
+            }
+        }
 
         do
         {
             sock_t sock = SOCK_ERROR;
-            if (sock_get_next_server_socket (sockets, &sock) < 0)
+            if (sock_get_next_server_socket (sockets [0], &sock) < 0)
                 break;   // end of any available sockets
             socket_attempt++;
 
             if (sock == SOCK_ERROR)
                 continue;
-            /* some win32 setups do not do TCP win scaling well, so allow an override */
-            if (listener->so_sndbuf)
-                sock_set_send_buffer (sock, listener->so_sndbuf);
-            if (listener->so_mss)
-                sock_set_mss (sock, listener->so_mss);
-            if (sock_listen (sock, listener->qlen) == SOCK_ERROR)
-            {
-                sock_close (sock);
+            if (connection_add_server_socket (listener, sock, &count, &arr_size) < 0)
                 continue;
-            }
-            if (count >= arr_size) // need to resize arrays?
+            socket_count++;
+            for (c = 1; c < copies; c++)
             {
-                void *tmp;
-                arr_size += 10;
-                tmp = realloc (global.serversock, (arr_size*sizeof (sock_t)));
-                if (tmp) global.serversock = tmp;
-
-                tmp = realloc (global.server_conn, (arr_size*sizeof (listener_t*)));
-                if (tmp) global.server_conn = tmp;
+                sock = SOCK_ERROR;
+                sock_get_next_server_socket (sockets [c], &sock);
+                if (sock == SOCK_ERROR || connection_add_server_socket (listener, sock, &count, &arr_size) < 0)
+                    WARN1 ("unable to add shared listening socket for port %d", listener->port);
             }
-
-            sock_set_blocking (sock, 0);
-            global.serversock [count] = sock;
-            global.server_conn [count] = listener;
-            listener->refcount++;
-            socket_count++;
-            count++;
         } while(1);
 
-        sock_free_server_sockets (sockets);
+        for (c = 0; c < copies; c++)
+            sock_free_server_sockets (sockets [c]);
         if (socket_count != socket_attempt)
         {
             if (socket_count == 0)
@@ -2051,15 +2967,22 @@ int connection_reset (connection_t *con, uint64_t time_ms)
     con->sent_bytes = 0;
 #ifdef HAVE_OPENSSL
     if (con->ssl) { SSL_shutdown (con->ssl); SSL_free (con->ssl); con->ssl = NULL; }
+    free (con->ssl_buf);
+    con->ssl_buf = NULL;
 #endif
     return 0;
 }
 
 void connection_close(connection_t *con)
 {
+    if (con->batch_queued || con->held)
+        connection_send_held (con);
 #ifdef HAVE_OPENSSL
     if (con->ssl) { if ((con->sslflags & 1) == 0) SSL_shutdown (con->ssl); SSL_free (con->ssl); }
+    free (con->ssl_buf);
 #endif
+    if (connection_linger_add (con))
+        con->sock = SOCK_ERROR;     // closed later
     if (con->sock != SOCK_ERROR)
         sock_close (con->sock);
     free (con->ip);
@@ -27,6 +27,10 @@
 
 struct source_tag;
 struct ice_config_tag;
+struct send_batch;
+struct connection_held;
+struct connection_zc;
+struct _refbuf_tag;
 typedef struct connection_tag connection_t;
 
 #include "compat.h"
@@ -51,20 +55,54 @@ struct connection_tag
     char error;
     unsigned char readchk;
 
+    struct send_batch *send_batch;      // sends go via this batch when set
+    struct send_batch *batch_queued;    // batch with a send queued for this connection
+    struct connection_held *held;       // taken for sending but not yet written
+
+    struct connection_zc *zc;           // zerocopy sends awaiting completion, if enabled
+    struct _refbuf_tag *shared_block;   // shared block the next send may be from
+
 #ifdef HAVE_OPENSSL
     unsigned char sslflags;
     SSL *ssl;   /* SSL handler */
+    char *ssl_buf;  /* vector entries gathered for a single SSL_write */
 #endif
 
     char *ip;
 };
 
 
+#define CONNECTION_BUFS_LOCAL   10
+
+/* vectors for a send, held within the structure unless more are needed so one
+ * declared on the stack needs no allocation */
 struct connection_bufs
 {
     short count, max;
     int total;
     IOVEC *block;
+    IOVEC local [CONNECTION_BUFS_LOCAL];
+};
+
+#define CONNECTION_HELD_MAX     32
+#define CONNECTION_HELD_FRAMING 128
+
+/* Data from a shared queue block is not copied when it is taken for a batched
+ * or gathered send, the piece holds a reference on the block instead. Small
+ * pieces from elsewhere, like a chunk header, are copied into the framing block
+ * and hold a reference on that, so every piece stays in place until the socket,
+ * or a zerocopy send, is done with it. What the socket refuses stays here and is
+ * written before anything else.
+ */
+struct connection_held
+{
+    unsigned short count;               // pieces to send
+    unsigned short framing_used;
+    unsigned int len;                   // bytes in the pieces
+    unsigned char blocked;              // the socket has refused some of it
+    IOVEC iov [CONNECTION_HELD_MAX];
+    struct _refbuf_tag *block [CONNECTION_HELD_MAX];    // reference held for the piece
+    struct _refbuf_tag *framing;        // small pieces are copied into this
 };
 
 #ifdef WIN32
@@ -77,8 +115,11 @@ struct connection_bufs
 
 #ifdef HAVE_OPENSSL
 #define not_ssl_connection(x)    ((x)->ssl==NULL)
+/* plain socket writes are fine, either no ssl or the kernel encrypts them */
+#define plain_send_connection(x) ((x)->ssl==NULL || ((x)->sslflags & 2))
 #else
 #define not_ssl_connection(x)    (1)
+#define plain_send_connection(x) (1)
 #endif
 
 #define PRI_ConnID   PRIu64
@@ -106,10 +147,17 @@ int  connection_bufs_append (struct connection_bufs *vectors, void *buf, unsigne
 int  connection_bufs_read (connection_t *con, struct connection_bufs *vecs, int skip);
 int  connection_bufs_send (connection_t *con, struct connection_bufs *vecs, int skip);
 int  connection_unreadable (connection_t *con);
+int  connection_send_held (connection_t *con);
+void connection_held_sent (connection_t *con, int bytes);
+uint64_t connection_bytes_taken (connection_t *con);
+int  connection_zerocopy_enable (connection_t *con);
+int  connection_zerocopy_wait (connection_t *con, uint64_t queued, unsigned long rate);
+void connection_linger (time_t now);
 
 
 #define CHUNK_HDR_SZ            16
 
+int  connection_chunk_header (char *chunk_hdr, unsigned chunk_sz);
 int  connection_chunk_start (connection_t *con, struct connection_bufs *vecs, char *chunk_hdr, unsigned chunk_sz);
 int  connection_chunk_end (connection_t *con, struct connection_bufs *bufs, char *chunk_hdr, unsigned chunk_sz);
 
@@ -120,6 +168,7 @@ int  connection_send_ssl (connection_t *con, const void *buf, size_t len);
 #endif
 int  connection_read (connection_t *con, void *buf, size_t len);
 int  connection_send (connection_t *con, const void *buf, size_t len);
+int  connection_sendfile (connection_t *con, int fd, uint64_t offset, size_t len);
 void connection_thread_shutdown_req (void);
 
 int connection_check_pass (http_parser_t *parser, const char *user, const char *pass);
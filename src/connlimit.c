@@ -0,0 +1,216 @@
+/* -*- c-basic-offset: 4; -*- */
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* connlimit.c
+ *
+ * Token buckets on new connections, one for each address and one for each
+ * network (/24 for IPv4, /64 for IPv6), so a client stuck in a reconnect loop
+ * is turned away at accept without holding up anyone else. A bucket fills at
+ * the configured rate up to the burst size, and a connection takes one token.
+ *
+ * The buckets are kept in a fixed table of small sets indexed by hash. A new
+ * address takes over the least recently used bucket in its set. An idle
+ * bucket would be full anyway, so losing it changes nothing, and the table
+ * does not need any sweeping. The sets are shared by the acceptor threads,
+ * under striped locks.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+#include "thread/thread.h"
+#include "timing/timing.h"
+#include "connlimit.h"
+#include "logging.h"
+
+#define CATMODULE "connlimit"
+
+#define CONNECT_LIMIT_SETS      4096
+#define CONNECT_LIMIT_WAYS      4
+#define CONNECT_LIMIT_LOCKS     64
+
+#define CONNECT_KIND_ADDR       1
+#define CONNECT_KIND_NET        2
+
+struct connect_bucket
+{
+    uint64_t key [2];       // address, or network with the host part 0
+    uint64_t last;          // ms of the last refill
+    int32_t tokens;         // in thousandths of a connection
+    unsigned char kind;     // 0 for unused
+    unsigned char limited;  // has gone over, reported once
+};
+
+struct connect_rate
+{
+    int rate;               // per second, 0 for none
+    int burst;
+};
+
+static struct connect_bucket *connect_table;
+static spin_t connect_locks [CONNECT_LIMIT_LOCKS];
+static struct connect_rate addr_limit, net_limit;
+static uint64_t connect_seed;
+
+
+void connect_limit_initialize (void)
+{
+    int i;
+
+    for (i = 0; i < CONNECT_LIMIT_LOCKS; i++)
+        thread_spin_create (&connect_locks [i]);
+    connect_table = NULL;
+    connect_seed = timing_get_time_us();
+}
+
+
+void connect_limit_shutdown (void)
+{
+    int i;
+
+    for (i = 0; i < CONNECT_LIMIT_LOCKS; i++)
+        thread_spin_destroy (&connect_locks [i]);
+    free (connect_table);
+    connect_table = NULL;
+}
+
+
+/* called before the acceptors start */
+void connect_limit_setup (ice_config_t *config)
+{
+    addr_limit.rate = config->connect_rate > 0 ? config->connect_rate : 0;
+    addr_limit.burst = config->connect_burst > 0 ? config->connect_burst : addr_limit.rate * 2;
+    net_limit.rate = config->connect_net_rate > 0 ? config->connect_net_rate : 0;
+    net_limit.burst = config->connect_net_burst > 0 ? config->connect_net_burst : net_limit.rate * 2;
+
+    if (addr_limit.rate == 0 && net_limit.rate == 0)
+        return;
+    if (connect_table == NULL)
+    {
+        connect_table = calloc (CONNECT_LIMIT_SETS * CONNECT_LIMIT_WAYS, sizeof (struct connect_bucket));
+        if (connect_table == NULL)
+            abort();
+    }
+    INFO4 ("new connections limited to %d/s (burst %d) per address, %d/s (burst %d) per network",
+            addr_limit.rate, addr_limit.burst, net_limit.rate, net_limit.burst);
+}
+
+
+static unsigned int connect_limit_hash (const uint64_t *key, int kind)
+{
+    uint64_t h = (key[0] ^ connect_seed) * 0x9E3779B97F4A7C15ULL;
+
+    h = (h ^ key[1] ^ kind) * 0xFF51AFD7ED558CCDULL;
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+
+static int connect_limit_take (const unsigned char *addr, int kind, struct connect_rate *limit, uint64_t now)
+{
+    struct connect_bucket *b, *use = NULL, *oldest;
+    int32_t full = limit->burst * 1000;
+    unsigned int set, i;
+    uint64_t key [2];
+    int ret = 1;
+
+    memcpy (key, addr, sizeof (key));
+    set = connect_limit_hash (key, kind) & (CONNECT_LIMIT_SETS - 1);
+    b = oldest = &connect_table [set * CONNECT_LIMIT_WAYS];
+
+    thread_spin_lock (&connect_locks [set & (CONNECT_LIMIT_LOCKS - 1)]);
+    for (i = 0; i < CONNECT_LIMIT_WAYS; i++, b++)
+    {
+        if (b->kind == kind && b->key[0] == key[0] && b->key[1] == key[1])
+        {
+            use = b;
+            break;
+        }
+        if (b->last < oldest->last)
+            oldest = b;
+    }
+    if (use == NULL)
+    {
+        use = oldest;
+        use->key[0] = key[0];
+        use->key[1] = key[1];
+        use->kind = kind;
+        use->tokens = full;
+        use->limited = 0;
+        use->last = now;
+    }
+    else if (now > use->last)
+    {
+        int64_t tokens = use->tokens + (int64_t)(now - use->last) * limit->rate;
+
+        use->tokens = tokens > full ? full : (int32_t)tokens;
+        use->last = now;
+    }
+    if (use->tokens >= 1000)
+    {
+        use->tokens -= 1000;
+        use->limited = 0;
+    }
+    else
+    {
+        ret = use->limited ? 0 : -1;
+        use->limited = 1;
+    }
+    thread_spin_unlock (&connect_locks [set & (CONNECT_LIMIT_LOCKS - 1)]);
+    return ret;
+}
+
+
+int connect_limit_check (const char *ip, uint64_t now_ms)
+{
+    unsigned char addr [16];
+    int ret = 1;
+
+    if (connect_table == NULL || (addr_limit.rate == 0 && net_limit.rate == 0))
+        return 1;
+    memset (addr, 0, sizeof (addr));
+#ifdef HAVE_INET_PTON
+    if (strchr (ip, ':'))
+    {
+        if (inet_pton (AF_INET6, ip, addr) != 1)
+            return 1;
+    }
+    else
+    {
+        addr[10] = addr[11] = 0xff;
+        if (inet_pton (AF_INET, ip, addr + 12) != 1)
+            return 1;
+    }
+#else
+    addr[10] = addr[11] = 0xff;
+    if (strchr (ip, ':') || inet_aton (ip, (struct in_addr *)(addr + 12)) == 0)
+        return 1;
+#endif
+    if (addr_limit.rate)
+        ret = connect_limit_take (addr, CONNECT_KIND_ADDR, &addr_limit, now_ms);
+    if (ret > 0 && net_limit.rate)
+    {
+        if (addr[10] == 0xff && addr[11] == 0xff && memcmp (addr, "\0\0\0\0\0\0\0\0\0\0", 10) == 0)
+            addr[15] = 0;
+        else
+            memset (addr + 8, 0, 8);
+        ret = connect_limit_take (addr, CONNECT_KIND_NET, &net_limit, now_ms);
+    }
+    return ret;
+}
@@ -0,0 +1,29 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* connlimit.h
+ *
+ * rate limits on new connections by address and by network
+ *
+ */
+
+#ifndef __CONNLIMIT_H__
+#define __CONNLIMIT_H__
+
+#include "compat.h"
+#include "cfgfile.h"
+
+void connect_limit_initialize (void);
+void connect_limit_shutdown (void);
+
+/* take up the rates in the config, the table is kept over a reload */
+void connect_limit_setup (ice_config_t *config);
+
+/* 1 if a connection from ip can go ahead now, 0 if it is over the rate or -1
+ * if it has just gone over */
+int  connect_limit_check (const char *ip, uint64_t now_ms);
+
+#endif  /* __CONNLIMIT_H__ */
@@ -35,7 +35,7 @@ void event_config_read (void)
     int ret;
     char *filename;
     ice_config_t *config;
-    ice_config_t new_config, old_config;
+    ice_config_t new_config;
     /* reread config file */
 
     INFO0("Re-reading XML");
@@ -69,7 +69,7 @@ void event_config_read (void)
         config = config_grab_config();
 
         restart_logging (&new_config);
-        config_set_config (&new_config, &old_config);
+        config_set_config (&new_config);
         config_release_config();
 
         connection_thread_shutdown();
@@ -80,6 +80,8 @@ void event_config_read (void)
         yp_recheck_config (config);
         fserve_recheck_mime_types (config);
         stats_global (config);
+        workers_placement (config->worker_cpus, config->worker_nodes);
+        workers_send_batching (config->io_uring);
         workers_adjust (config->workers_count);
         connection_listen_sockets_close (config, 0);
         redirector_setup (config);
@@ -87,7 +89,7 @@ void event_config_read (void)
         config_release_config();
 
         slave_restart();
-        config_clear (&old_config);
+        config_reclaim ();
     }
     free (filename);
 }
@@ -47,6 +47,30 @@ struct flvmeta
 
 #define FLVHEADER       11
 
+/* details at the start and end of a queue block wrapped for all flv listeners,
+ * the tags follow it
+ */
+struct flv_block_hdr
+{
+    int64_t start_samples;
+    int64_t end_samples;
+    uint64_t start_ms;
+    uint64_t end_ms;
+    void *start_meta;
+    uint32_t start_tagsize;
+    uint32_t end_tagsize;
+};
+
+
+/* write an onMetaData tag if the block has different metadata to before */
+static void flv_check_metadata (struct flv *flv)
+{
+    struct metadata_block *meta = flv->block->associated;
+
+    if (flv->seen_metadata != meta)
+        flv_write_metadata (flv, meta, flv->client ? flv->client->mount : flv->mpeg_sync.reference);
+}
+
 
 static void flv_hdr (struct flv *flv, unsigned int len)
 {
@@ -90,10 +114,7 @@ static int flv_mpX_hdr (struct mpeg_sync *mp, sync_callback_t *cb, unsigned char
 
     if (flv->flags & FLV_CHK_META)
     {
-        refbuf_t *ref = flv->client->refbuf;
-        struct metadata_block *meta = ref->associated;
-        if (flv->seen_metadata != meta)
-            flv_write_metadata (flv, meta, flv->client->mount);
+        flv_check_metadata (flv);
         flv->flags &= ~FLV_CHK_META;
     }
 
@@ -133,12 +154,7 @@ static int flv_aac_hdr (struct mpeg_sync *mp, sync_callback_t *cb, unsigned char
         return -1;
 
     if (flv->wrapper_offset == 0)
-    {
-        refbuf_t *ref = flv->client->refbuf;
-        struct metadata_block *meta = ref->associated;
-        if (flv->seen_metadata != meta)
-            flv_write_metadata (flv, meta, flv->client->mount);
-    }
+        flv_check_metadata (flv);
 
     // we do not put adts aac headers in FLV frames
     len -= header_len;
@@ -184,23 +200,21 @@ static int flv_aac_firsthdr (struct mpeg_sync *mp, sync_callback_t *cb, unsigned
 {
     struct flv *flv = cb->callback_key;
     int c = audio_specific_config (&flv->mpeg_sync, &flv->tag[17]);
+    char *dst = flv->wrapper->data + flv->wrapper_offset;   // after any flv header
 
     flv_hdr (flv, 2+c);
     flv->tag[15] = 0xAF; // AAC audio, need these codes first
     flv->tag[16] = 0x0;
-    memcpy (flv->wrapper->data, &flv->tag[0], 11+4+2+c);
-    connection_bufs_append (&flv->bufs, flv->wrapper->data, 11+4+2+c);
-    flv->wrapper_offset = 11+4+2+c;
+    memcpy (dst, &flv->tag[0], 11+4+2+c);
+    connection_bufs_append (&flv->bufs, dst, 11+4+2+c);
+    flv->wrapper_offset += 11+4+2+c;
     flv->prev_tagsize = 11 + 2 + c;
     flv->tag[16] = 0x01;   // as per spec. headerless frame follows this
     flv->cb.frame_callback = flv_aac_hdr;
     // DEBUG2 ("codes for audiospecificconfig are %x, %x", flv->tag[17], flv->tag[18]);
 
     // needed after the first audio specific frame
-    refbuf_t *ref = flv->client->refbuf;
-    struct metadata_block *meta = ref->associated;
-    if (flv->seen_metadata != meta)
-        flv_write_metadata (flv, meta, flv->client->mount);
+    flv_check_metadata (flv);
 
     return flv_aac_hdr (mp, cb, frame, len, headerlen);
 }
@@ -217,7 +231,10 @@ static int send_flv_buffer (client_t *client, struct flv *flv)
         if (ret < (int)len)
             client->schedule_ms += 10 + (client->throttle * ((ret < 0) ? 10 : 6));
         if (ret > 0)
+        {
             flv->block_pos += ret;
+            flv->flags |= FLV_STARTED;
+        }
     }
     if (flv->block_pos == flv->bufs.total)
     {
@@ -283,10 +300,7 @@ int flv_write_metadata (struct flv *flv, struct metadata_block *meta, const char
         if (meta_copied + 15 + flv->wrapper_offset > wrapper->len)
         {
             int newlen = meta_copied + flv->wrapper_offset + 1024;
-            void *p = realloc (wrapper->data, newlen);
-            if (p == NULL) return -1;
-            wrapper->data = p;
-            wrapper->len = newlen;
+            refbuf_resize (wrapper, newlen);
             flv->block_pos = flv->wrapper_offset = 0;
             connection_bufs_flush (&flv->bufs);
             return -1;
@@ -320,13 +334,53 @@ int flv_write_metadata (struct flv *flv, struct metadata_block *meta, const char
 
 int flv_process_buffer (struct flv *flv, refbuf_t *refbuf)
 {
+    flv->block = refbuf;
     return mpeg_complete_frames_cb (&flv->mpeg_sync, &flv->cb, refbuf, 0);
 }
 
 
-int write_flv_buf_to_client (client_t *client)
+/* send the tags made by the source for the block. Once it is all sent, the
+ * listener flv details are moved on to where the source was at the end of it
+ */
+static int send_flv_shared (client_t *client, struct flv *flv, refbuf_t *shared)
 {
     refbuf_t *ref = client->refbuf;
+    struct flv_block_hdr *hdr = (struct flv_block_hdr *)shared->data;
+    unsigned int len = shared->len - sizeof (*hdr) - flv->block_pos;
+    int ret = 0;
+
+    if (len)
+    {
+        ret = client_send_bytes (client, shared->data + sizeof (*hdr) + flv->block_pos, len);
+        if (ret > 0)
+        {
+            flv->block_pos += ret;
+            flv->flags |= FLV_STARTED;
+        }
+        if (ret < (int)len)
+        {
+            client->schedule_ms += 10 + (client->throttle * ((ret < 0) ? 10 : 6));
+            flv->flags |= FLV_SHARED;
+            flv->block = ref;
+            return ret;
+        }
+    }
+    flv->flags &= ~FLV_SHARED;
+    flv->block_pos = 0;
+    flv->samples = hdr->end_samples;
+    flv->prev_ms = hdr->end_ms;
+    flv->prev_tagsize = hdr->end_tagsize;
+    flv->seen_metadata = ref->associated;
+    client->queue_pos += ref->len - client->pos;
+    client->counter += ref->len - client->pos;
+    client->pos = ref->len;
+    return ret;
+}
+
+
+int write_flv_buf_to_client (client_t *client)
+{
+    refbuf_t *ref = client->refbuf, *shared = NULL;
     struct metadata_block *meta = ref->associated;
     struct flv *flv = client->format_data;
     int ret, repack = 0;
@@ -340,14 +394,37 @@ int write_flv_buf_to_client (client_t *client)
     if (client->pos == ref->len)
         return -1;
 
+    if (ref->derived)
+        shared = refbuf_derived (ref, REFBUF_DERIVED_FLV);
+    if (flv->flags & FLV_SHARED)
+    {
+        if (shared && flv->block == ref)
+            return send_flv_shared (client, flv, shared);
+        flv->flags &= ~FLV_SHARED;     // block has changed, wrap from the listener position
+        flv->block_pos = 0;
+    }
+    else if (shared && client->pos == 0 && flv->wrapper_offset == 0)
+    {
+        struct flv_block_hdr *hdr = (struct flv_block_hdr *)shared->data;
+
+        if ((flv->flags & FLV_STARTED) == 0 && flv->samples == 0)
+        {
+            // new listener, so use the timestamps of the source to allow the switch later
+            flv->samples = hdr->start_samples;
+            flv->prev_ms = hdr->start_ms;
+        }
+        if (flv->samples == hdr->start_samples && flv->prev_tagsize == hdr->start_tagsize &&
+                flv->seen_metadata == hdr->start_meta)
+            return send_flv_shared (client, flv, shared);
+    }
+
     /* check for metadata updates and insert if needed */
     if (flv->wrapper_offset == 0)
         repack = 1;
     else if (flv->bufs.count > 0) // if ref has changed then references are now invalid
     {
-        char *p1 = IO_VECTOR_BASE (&flv->bufs.block[1]), *p2 = ref->data;
-        if (p1 != flv->wrapper->data) // either metadata (in wrapper) or refers to usual data buffer
-            p1 = IO_VECTOR_BASE (&flv->bufs.block[3]);
+        // each tag is followed by its frame, so the last entry refers to the usual data buffer
+        char *p1 = IO_VECTOR_BASE (&flv->bufs.block[flv->bufs.count-1]), *p2 = ref->data;
         int diff = (p1 < p2) ? p2-p1 : p1-p2;
         if (diff > ref->len) // original buffer must of been copied, need to repack to keep valid
             repack = 1;
@@ -358,7 +435,7 @@ int write_flv_buf_to_client (client_t *client)
         flv->wrapper_offset = 0;
         connection_bufs_flush (&flv->bufs);
         flv->flags |= FLV_CHK_META;
-        if (client->connection.sent_bytes == 0)  // needs initial short header
+        if ((flv->flags & FLV_STARTED) == 0)  // needs initial short header
         {
             char header[10];
             snprintf (header, 10, "FLV\x1\x4%c%c%c\x9", 0,0,0);
@@ -369,6 +446,7 @@ int write_flv_buf_to_client (client_t *client)
         flv->samples -= flv->samples_in_buffer; // role back the sample count;
 
         uint64_t prev_samples = flv->samples;
+        flv->block = ref;
         int unprocessed = mpeg_complete_frames_cb (&flv->mpeg_sync, &flv->cb, ref, client->pos);
 
         if (unprocessed < 0)
@@ -393,6 +471,98 @@ int write_flv_buf_to_client (client_t *client)
 }
 
 
+/* flv details kept by the source for wrapping the queue blocks once for all
+ * flv listeners
+ */
+struct flv *flv_source_create (format_plugin_t *plugin)
+{
+    struct flv *flv = calloc (1, sizeof (struct flv));
+
+    if (flv == NULL)
+        abort();
+    mpeg_setup (&flv->mpeg_sync, plugin->mount);
+    mpeg_check_numframes (&flv->mpeg_sync, 1);
+    flv->wrapper = refbuf_new (4096);
+    flv->tag[4] = 8;    // Audio details only
+    if (plugin->type == FORMAT_TYPE_AAC)
+        flv->cb.frame_callback = flv_aac_firsthdr;
+    else
+    {
+        flv->tag[15] = 0x22;
+        flv->cb.frame_callback = flv_mpX_hdr;
+    }
+    flv->cb.callback_key = flv;
+    flv->seen_metadata = (void*)flv;
+    connection_bufs_init (&flv->bufs, 10);
+    return flv;
+}
+
+
+void flv_source_free (struct flv *flv)
+{
+    if (flv == NULL)
+        return;
+    mpeg_cleanup (&flv->mpeg_sync);
+    refbuf_release (flv->wrapper);
+    connection_bufs_release (&flv->bufs);
+    free (flv);
+}
+
+
+/* wrap the frames of a block about to be queued in flv tags, and attach
+ * them to the block for listeners in step with the source
+ */
+void flv_wrap_block (struct flv *flv, refbuf_t *block)
+{
+    struct flv_block_hdr *hdr;
+    refbuf_t *wrapped;
+    unsigned int len = block->len, max = block->len * 3 + 4096;  // tags can exceed small frames
+    char *out;
+    int i;
+
+    if (flv->wrapper->len < max)
+        refbuf_resize (flv->wrapper, max);
+    flv->wrapper_offset = 0;
+    connection_bufs_flush (&flv->bufs);
+
+    wrapped = refbuf_new (sizeof (*hdr));
+    hdr = (struct flv_block_hdr *)wrapped->data;
+    hdr->start_samples = flv->samples;
+    hdr->start_ms = flv->prev_ms;
+    hdr->start_tagsize = flv->prev_tagsize;
+    hdr->start_meta = flv->seen_metadata;
+
+    block->flags |= REFBUF_SHARED;  // queued next, the frame parsing must leave it as is
+    flv->block = block;
+    flv->flags |= FLV_CHK_META;
+    if (mpeg_complete_frames_cb (&flv->mpeg_sync, &flv->cb, block, 0) < 0)
+    {
+        block->len = len;
+        refbuf_release (wrapped);
+        flv->seen_metadata = (void*)flv;   // listeners cannot be in step after this
+        return;
+    }
+    block->len = len;
+    flv->seen_metadata = block->associated;
+
+    hdr->end_samples = flv->samples;
+    hdr->end_ms = flv->prev_ms;
+    hdr->end_tagsize = flv->prev_tagsize;
+    refbuf_resize (wrapped, sizeof (*hdr) + flv->bufs.total);
+    hdr = (struct flv_block_hdr *)wrapped->data;
+    out = wrapped->data + sizeof (*hdr);
+    for (i = 0; i < flv->bufs.count; i++)
+    {
+        memcpy (out, IO_VECTOR_BASE (&flv->bufs.block[i]), IO_VECTOR_LEN (&flv->bufs.block[i]));
+        out += IO_VECTOR_LEN (&flv->bufs.block[i]);
+    }
+    wrapped->flags |= REFBUF_DERIVED_FLV;
+    refbuf_add_derived (block, wrapped);
+    flv->wrapper_offset = 0;
+    connection_bufs_flush (&flv->bufs);
+}
+
+
 void flv_write_BE64 (void *where, void *val)
 {
     int len = sizeof (uint64_t);
@@ -26,6 +26,7 @@ struct flv
     uint16_t wrapper_offset;
     unsigned int samples_in_buffer;
     refbuf_t *wrapper;
+    refbuf_t *block;
     client_t *client;
     uint64_t prev_ms;
     int64_t samples;
@@ -37,11 +38,16 @@ struct flv
 };
 
 #define FLV_CHK_META                    1<<0
+#define FLV_SHARED                      1<<1
+#define FLV_STARTED                     1<<2    // listener has been sent data
 
 int  write_flv_buf_to_client (client_t *client);
 void flv_create_client_data (format_plugin_t *plugin, client_t *client);
 void free_flv_client_data (client_t *client);
 int  flv_process_buffer (struct flv *flv, refbuf_t *refbuf);
+struct flv *flv_source_create (format_plugin_t *plugin);
+void flv_source_free (struct flv *flv);
+void flv_wrap_block (struct flv *flv, refbuf_t *block);
 
 refbuf_t *flv_meta_allocate (size_t len);
 void flv_meta_append_string (refbuf_t *buffer, const char *tag, const char *value);
@@ -187,6 +187,8 @@ static void mpeg_apply_client (format_plugin_t *plugin, client_t *client)
 
     metadata_blk_release (source_mp3->metadata);
     source_mp3->metadata = NULL;
+    flv_source_free (source_mp3->flv);
+    source_mp3->flv = NULL;
     free (plugin->contenttype);
     plugin->contenttype = NULL;
 
@@ -380,6 +382,8 @@ static void format_mp3_apply_settings (format_plugin_t *format, mount_proxy *mou
 
     source_mp3->qblock_sz = 4096;
     source_mp3->max_send_size = 0;
+    source_mp3->icy_cache = 0;
+    source_mp3->flv_cache = 0;
     format->flags &= ~FORMAT_FL_ALLOW_HTTPCHUNKED;
     if (mount)
     {
@@ -391,6 +395,8 @@ static void format_mp3_apply_settings (format_plugin_t *format, mount_proxy *mou
             format->charset = strdup (mount->charset);
         if (mount->allow_chunked)
            format->flags |= FORMAT_FL_ALLOW_HTTPCHUNKED;
+        source_mp3->icy_cache = mount->mp3_meta_cache;
+        source_mp3->flv_cache = mount->flv_cache;
     }
     if (source_mp3->icy_interval < 0)
         source_mp3->icy_interval = ICY_METADATA_INTERVAL;
@@ -564,6 +570,121 @@ static void metadata_setup (source_t *source)
 }
 
 
+/* layout of the interleaved copy of a queue block, the data follows it */
+struct icy_cache_hdr
+{
+    void *prev_meta;            // metadata block inserted last before this block
+    unsigned int interval;
+    unsigned int since;         // bytes since that insert at the start of the block
+    unsigned int first;         // block offset of the first insert, block length if none
+    unsigned int first_len;     // length of the first insert, any others are a nul byte
+};
+
+
+/* work out where the listener is within the interleaved copy of the block,
+ * -1 if the listener is not in step with it
+ */
+static int icy_cache_offset (client_t *client, refbuf_t *cache)
+{
+    struct icy_cache_hdr *hdr = (struct icy_cache_hdr *)cache->data;
+    mp3_client_data *client_mp3 = client->format_data;
+    struct metadata_block *mb = client->refbuf->associated;
+    unsigned int pos = client->pos, since = client_mp3->since_meta_block;
+    unsigned int inserts = 0, offset;
+    void *meta = hdr->prev_meta;
+
+    if (hdr->interval != client_mp3->interval)
+        return -1;
+    if (mb == NULL || mb->icy == NULL)
+        mb = &blank_meta;
+    if (pos > hdr->first)
+    {
+        inserts = (pos - hdr->first - 1) / hdr->interval + 1;
+        meta = mb;
+    }
+    offset = pos + (inserts ? hdr->first_len + inserts - 1 : 0);
+    if (pos < hdr->first)
+    {
+        if (since != hdr->since + pos)
+            return -1;
+    }
+    else if ((pos - hdr->first) % hdr->interval)
+    {
+        if (since != (pos - hdr->first) % hdr->interval)
+            return -1;
+    }
+    else if (since == 0)
+    {
+        offset += inserts ? 1 : hdr->first_len;    // insert already sent
+        meta = mb;
+    }
+    else if (since == hdr->interval)
+    {
+        if (client->flags & CLIENT_IN_METADATA)
+            offset += client_mp3->metadata_offset;
+    }
+    else
+        return -1;
+    if (meta != client_mp3->associated)
+        return -1;
+    return offset;
+}
+
+
+/* send from the interleaved copy of the block, and update the listener
+ * details as if the metadata had been inserted separately
+ */
+static int send_icy_cache (client_t *client, refbuf_t *cache, unsigned int offset)
+{
+    struct icy_cache_hdr *hdr = (struct icy_cache_hdr *)cache->data;
+    mp3_client_data *client_mp3 = client->format_data;
+    struct metadata_block *mb = client->refbuf->associated;
+    char *data = cache->data + sizeof (*hdr);
+    unsigned int len = cache->len - sizeof (*hdr) - offset, pos, since;
+    int ret;
+
+    if (len > 100000)
+        len = 100000; // do not send a huge amount out in one go
+    ret = client_send_bytes (client, data + offset, len);
+    if (ret > 0)
+    {
+        if (mb == NULL || mb->icy == NULL)
+            mb = &blank_meta;
+        offset += ret;
+        client->flags &= ~CLIENT_IN_METADATA;
+        client_mp3->metadata_offset = 0;
+        if (offset <= hdr->first)
+        {
+            pos = offset;
+            since = hdr->since + offset;
+        }
+        else if (offset < hdr->first + hdr->first_len)
+        {
+            pos = hdr->first;       // part way through the first insert
+            since = hdr->interval;
+            client->flags |= CLIENT_IN_METADATA;
+            client_mp3->metadata_offset = offset - hdr->first;
+        }
+        else
+        {
+            // after the first insert, the rest are interval bytes then a nul byte
+            unsigned int after = offset - hdr->first - hdr->first_len;
+
+            since = after % (hdr->interval + 1);
+            pos = hdr->first + (after / (hdr->interval + 1)) * hdr->interval + since;
+            client_mp3->associated = mb;
+        }
+        client->queue_pos += pos - client->pos;
+        client->counter += pos - client->pos;
+        client->pos = pos;
+        client_mp3->since_meta_block = since;
+    }
+    if (ret < (int)len)
+        client->schedule_ms += 10 + (client->throttle * ((ret < 0) ? 10 : 6));
+    return ret;
+}
+
+
 /* send the appropriate metadata, and return the number of bytes written
  * which is 0 or greater.  Check the client in_metadata value afterwards
  * to see if all metadata has been sent
@@ -648,6 +769,28 @@ static int format_mp3_write_buf_to_client (client_t *client)
     mp3_client_data *client_mp3 = client->format_data;
     refbuf_t *refbuf = client->refbuf;
 
+    if (client_mp3->interval && refbuf->derived && (client->flags & CLIENT_CHUNKED) == 0)
+    {
+        refbuf_t *cache = refbuf_derived (refbuf, REFBUF_DERIVED_ICY);
+
+        if (cache)
+        {
+            struct icy_cache_hdr *hdr = (struct icy_cache_hdr *)cache->data;
+
+            if (client->counter == 0 && client->pos == 0 && client_mp3->since_meta_block == 0 &&
+                    client_mp3->associated == NULL && hdr->interval == client_mp3->interval)
+            {
+                // nothing sent yet, so start at an insert point to be in step with the copy
+                client->pos = hdr->first;
+                client->queue_pos += hdr->first;
+                if (client->pos == refbuf->len)
+                    return 0;
+            }
+            len = icy_cache_offset (client, cache);
+            if (len >= 0)
+                return send_icy_cache (client, cache, len);
+        }
+    }
     if (client_mp3->interval && client_mp3->interval == client_mp3->since_meta_block)
         return send_icy_metadata (client, refbuf);
 
@@ -668,7 +811,10 @@ static int format_mp3_write_buf_to_client (client_t *client)
             struct connection_bufs bufs;
 
             connection_bufs_init (&bufs, 4);
-            connection_chunk_start (&client->connection, &bufs, chunk_hdr, len);
+            if (client->pos == 0 && len == refbuf->len && refbuf->chunk_hdrlen)
+                connection_bufs_append (&bufs, refbuf->chunk_hdr, refbuf->chunk_hdrlen); // whole block, framed on queueing
+            else
+                connection_chunk_start (&client->connection, &bufs, chunk_hdr, len);
             connection_bufs_append (&bufs, buf, len);
             overall = connection_chunk_end (&client->connection, &bufs, chunk_hdr, len);
 
@@ -790,6 +936,8 @@ static void format_mp3_free_plugin (format_plugin_t *plugin, client_t *client)
     free (source_mp3->url);
     free (source_mp3->extra_icy_meta);
     metadata_blk_release (source_mp3->metadata);
+    metadata_blk_release (source_mp3->icy_cache_meta);
+    flv_source_free (source_mp3->flv);
     free (source_mp3);
 }
 
@@ -917,11 +1065,10 @@ static int validate_mpeg (source_t *source, refbuf_t *refbuf)
 
         if (mpeg_block_expanded (mpeg_sync))
         {
-            in_icy->read_data = refbuf_new (0);
-            in_icy->read_data->data = refbuf->data;
-            in_icy->read_data->len = refbuf->len;
+            // keep the enlarged block for completing the read
+            refbuf_addref (refbuf);
+            in_icy->read_data = refbuf;
             in_icy->read_count = unprocessed;
-            refbuf->data = NULL;
             client->pos = unprocessed;
             return -1;
         }
@@ -957,6 +1104,100 @@ static int validate_mpeg (source_t *source, refbuf_t *refbuf)
 }
 
 
+/* make a copy of the queue block with the icy metadata inserted for the
+ * default interval. Listeners in step with it can send it as is, instead
+ * of splitting the sends around their own metadata inserts
+ */
+static void icy_cache_block (mp3_state *source_mp3, refbuf_t *refbuf)
+{
+    struct metadata_block *mb = refbuf->associated;
+    struct icy_cache_hdr *hdr;
+    refbuf_t *cache, *icy;
+    unsigned int interval = source_mp3->icy_interval, since, pos = 0, inserts = 0, len;
+    char *out;
+
+    if (source_mp3->icy_cache == 0 || interval == 0 || interval > 65535)
+        return;
+    if (source_mp3->icy_cache_interval != interval)
+    {
+        // a different interval, so start over as a new listener would
+        metadata_blk_release (source_mp3->icy_cache_meta);
+        source_mp3->icy_cache_meta = NULL;
+        source_mp3->icy_cache_since = 0;
+        source_mp3->icy_cache_interval = interval;
+    }
+    if (mb == NULL || mb->icy == NULL)
+        mb = &blank_meta;
+    icy = mb->icy;
+    since = source_mp3->icy_cache_since;
+
+    len = refbuf->len;
+    if (interval - since < refbuf->len)
+    {
+        inserts = (refbuf->len - (interval - since) - 1) / interval + 1;
+        len += inserts - 1 + (mb == source_mp3->icy_cache_meta ? 1 : icy->len);
+    }
+    cache = refbuf_new (sizeof (*hdr) + len);
+    cache->flags |= REFBUF_DERIVED_ICY;
+    hdr = (struct icy_cache_hdr *)cache->data;
+    hdr->prev_meta = source_mp3->icy_cache_meta;
+    hdr->interval = interval;
+    hdr->since = since;
+    hdr->first = inserts ? interval - since : refbuf->len;
+    hdr->first_len = mb == source_mp3->icy_cache_meta ? 1 : icy->len;
+
+    out = cache->data + sizeof (*hdr);
+    while (pos < refbuf->len)
+    {
+        unsigned int n = interval - since;
+
+        if (n == 0)
+        {
+            if (mb == source_mp3->icy_cache_meta)
+                *out++ = '\0';
+            else
+            {
+                memcpy (out, icy->data, icy->len);
+                out += icy->len;
+                metadata_blk_ref_inc (mb);
+                metadata_blk_release (source_mp3->icy_cache_meta);
+                source_mp3->icy_cache_meta = mb;
+            }
+            since = 0;
+            continue;
+        }
+        if (n > refbuf->len - pos)
+            n = refbuf->len - pos;
+        memcpy (out, refbuf->data + pos, n);
+        out += n;
+        pos += n;
+        since += n;
+    }
+    source_mp3->icy_cache_since = since;
+    refbuf_add_derived (refbuf, cache);
+}
+
+
+/* prepare the alternative forms of the block for listeners, before it is queued */
+static void mp3_derive_block (format_plugin_t *plugin, refbuf_t *refbuf)
+{
+    mp3_state *source_mp3 = plugin->_state;
+
+    icy_cache_block (source_mp3, refbuf);
+    if (source_mp3->flv_cache && (plugin->type == FORMAT_TYPE_MPEG || plugin->type == FORMAT_TYPE_AAC))
+    {
+        if (source_mp3->flv == NULL)
+            source_mp3->flv = flv_source_create (plugin);
+        flv_wrap_block (source_mp3->flv, refbuf);
+    }
+    else if (source_mp3->flv)
+    {
+        flv_source_free (source_mp3->flv);
+        source_mp3->flv = NULL;
+    }
+}
+
+
 /* read an mp3 stream which does not have shoutcast style metadata */
 static refbuf_t *mp3_get_no_meta (source_t *source)
 {
@@ -983,6 +1224,7 @@ static refbuf_t *mp3_get_no_meta (source_t *source)
     metadata_blk_ref_inc (source_mp3->metadata);
     source_mp3->metadata->on_queue = 1;
     refbuf->flags |= SOURCE_BLOCK_SYNC;
+    mp3_derive_block (source->format, refbuf);
     return refbuf;
 }
 
@@ -1089,6 +1331,7 @@ static refbuf_t *mp3_get_filter_meta (source_t *source)
     metadata_blk_ref_inc (source_mp3->metadata);
     source_mp3->metadata->on_queue = 1;
     refbuf->flags |= SOURCE_BLOCK_SYNC;
+    mp3_derive_block (source->format, refbuf);
 
     return refbuf;
 }
@@ -72,6 +72,17 @@ typedef struct {
     char *extra_icy_meta;
 
     struct metadata_block *metadata;
+
+    /* queue blocks with icy metadata already inserted at icy_interval */
+    int icy_cache;
+    unsigned int icy_cache_interval;
+    unsigned int icy_cache_since;
+    struct metadata_block *icy_cache_meta;
+
+    /* queue blocks wrapped in flv tags */
+    int flv_cache;
+    struct flv *flv;
+
     unsigned short qblock_sz;
     unsigned short max_send_size;
 
@@ -425,6 +425,8 @@ static refbuf_t *process_theora_page (ogg_state_t *ogg_info, ogg_codec_t *codec,
     if (has_keyframe && codec->possible_start)
     {
         codec->possible_start->flags |= SOURCE_BLOCK_SYNC;
+        if (codec->possible_start != refbuf)
+            refbuf->flags |= SOURCE_BLOCK_RESYNC;
         refbuf_release (codec->possible_start);
         codec->possible_start = NULL;
     }
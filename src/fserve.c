@@ -766,7 +766,8 @@ static int prefile_send (client_t *client)
                     refbuf_release (client->refbuf);
                     client->refbuf = NULL;
                     client->pos = 0;
-                    client->intro_offset = fh->frame_start_pos;
+                    if ((client->flags & CLIENT_RANGE_END) == 0)
+                        client->intro_offset = fh->frame_start_pos; // a range sets its own start
                     if (fh->finfo.limit)
                     {
                         client->ops = &throttled_file_content_ops;
@@ -809,6 +810,42 @@ static int prefile_send (client_t *client)
 }
 
 
+/* send straight from the file to the socket, for clients that take the file content
+ * unaltered. Returns the bytes sent, 0 at the end of the file or range, -1 if the
+ * socket would block and -2 if the file is to be read and sent as usual.
+ */
+static int fserve_sendfile (client_t *client, fh_node *fh, unsigned int max)
+{
+    refbuf_t *refbuf = client->refbuf;
+    uint64_t len = max;
+    int bytes;
+
+    if (client->check_buffer != format_generic_write_to_client || (client->flags & CLIENT_WANTS_FLV) ||
+            (fh->format && fh->format->align_buffer) || file_in_use (fh->f) == 0)
+        return -2;
+    if (refbuf && (client->pos < refbuf->len || refbuf->next))
+        return -2;      // buffered content goes first
+    if (client->flags & CLIENT_RANGE_END)
+    {
+        if ((uint64_t)client->intro_offset > client->connection.discon.offset)
+            return 0;
+        if (client->connection.discon.offset - client->intro_offset + 1 < len)
+            len = client->connection.discon.offset - client->intro_offset + 1;
+    }
+    else if (client->connection.discon.time && client->worker->current_time.tv_sec >= client->connection.discon.time)
+        return 0;
+
+    bytes = connection_sendfile (&client->connection, fh->f, client->intro_offset, len);
+    if (bytes > 0)
+    {
+        client->intro_offset += bytes;
+        client->queue_pos += bytes;
+        client->counter += bytes;
+    }
+    return bytes;
+}
+
+
 /* fast send routine */
 static int file_send (client_t *client)
 {
@@ -835,9 +872,15 @@ static int file_send (client_t *client)
         loop--;
         if (fserve_running == 0 || client->connection.error)
             return -1;
-        if (format_file_read (client, fh->format, fh->f) < 0)
-            return -1;
-        bytes = client->check_buffer (client);
+        bytes = fserve_sendfile (client, fh, 48000 - written);
+        if (bytes == -2)
+        {
+            if (format_file_read (client, fh->format, fh->f) < 0)
+                return -1;
+            bytes = client->check_buffer (client);
+        }
+        else if (bytes == 0)
+            return -1;      // all sent
         if (bytes < 0)
         {
             client->schedule_ms += (written ? 80 : 150);
@@ -854,7 +897,7 @@ static int file_send (client_t *client)
 /* send routine for files sent at a target bitrate, eg fallback files. */
 static int throttled_file_send (client_t *client)
 {
-    int  bytes;
+    int  bytes, restart = 0;
     fh_node *fh = client->shared_data;
     time_t now;
     worker_t *worker = client->worker;
@@ -888,18 +931,30 @@ static int throttled_file_send (client_t *client)
         if (client->counter > 8192)
             return 0; // allow an initial amount without throttling
     }
-    switch (format_file_read (client, fh->format, fh->f))
+    bytes = fserve_sendfile (client, fh, 8192);
+    if (bytes == 0)
+        restart = 1;
+    else if (bytes == -2)
     {
-        case -1: // DEBUG0 ("loop of file triggered");
-            client->intro_offset = 0;
-            client->schedule_ms += client->throttle ? client->throttle : 150;
-            return 0;
-        case -2: // DEBUG0 ("major failure on read, better leave");
-            return -1;
-        default: //DEBUG1 ("reading from offset %ld", client->intro_offset);
-            break;
+        switch (format_file_read (client, fh->format, fh->f))
+        {
+            case -1:
+                restart = 1;
+                break;
+            case -2: // DEBUG0 ("major failure on read, better leave");
+                return -1;
+            default: //DEBUG1 ("reading from offset %ld", client->intro_offset);
+                bytes = client->check_buffer (client);
+                break;
+        }
+    }
+    if (restart)
+    {
+        // DEBUG0 ("loop of file triggered");
+        client->intro_offset = 0;
+        client->schedule_ms += client->throttle ? client->throttle : 150;
+        return 0;
     }
-    bytes = client->check_buffer (client);
     if (bytes < 0)
         bytes = 0;
     //DEBUG3 ("bytes %d, counter %ld, %ld", bytes, client->counter, client->worker->time_ms - (client->timer_start*1000));
@@ -982,7 +1037,7 @@ int fserve_setup_client_fb (client_t *client, fbinfo *finfo)
         if (fh->finfo.limit)
         {
             client->timer_start = client->worker->current_time.tv_sec;
-            if (client->connection.sent_bytes == 0)
+            if (connection_bytes_taken (&client->connection) == 0)
                 client->timer_start -= 2;
             client->counter = 0;
             global_reduce_bitrate_sampling (global.out_bitrate);
@@ -38,6 +38,7 @@ void global_initialize(void)
 {
     memset (&global, 0, sizeof (global));
     global.source_tree = avl_tree_new(source_compare_sources, NULL);
+    source_index_initialize();
 #ifdef MY_ALLOC
     global.alloc_tree = avl_tree_new(compare_allocs, NULL);
 #endif
@@ -51,6 +52,7 @@ void global_shutdown(void)
     thread_rwlock_destroy(&global.workers_rw);
     thread_mutex_destroy(&_global_mutex);
     avl_tree_free(global.source_tree, NULL);
+    source_index_shutdown();
     rate_free (global.out_bitrate);
     global.out_bitrate = NULL;
 #ifdef MY_ALLOC
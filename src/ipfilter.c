@@ -0,0 +1,823 @@
+/* -*- c-basic-offset: 4; -*- */
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* ipfilter.c
+ *
+ * The ban and allow lists are checked for each accepted connection, so they
+ * are held in a radix tree of address prefixes, with IPv4 mapped into the
+ * IPv6 space as ::ffff:a.b.c.d. A lookup is a walk down at most 128 bits,
+ * however large the list is. Entries can be single addresses, CIDR ranges
+ * or IPv4 patterns ending in .* which are ranges by another name. Any other
+ * pattern is kept in a list and tried with fnmatch as before.
+ *
+ * Lookups take no lock. A change copies the path from the root to the node
+ * altered and publishes the new root as a new version, so the tree is never
+ * changed under a reader. As with the config snapshots, a reader sets the
+ * version it walks in a per-thread hold, and a replaced version is freed,
+ * along with the nodes only it could reach, once no hold refers to it or to
+ * anything older. Changes are serialised by the filter lock.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+#include "compat.h"
+#include "avl/avl.h"
+#include "net/sock.h"
+#include "ipfilter.h"
+#include "util.h"
+#include "logging.h"
+
+#define CATMODULE "ipfilter"
+
+/* an address still trying to connect keeps its timed ban for at least this */
+#define IP_FILTER_BAN_EXTEND    300
+
+struct ip_filter_entry
+{
+    time_t timeout;             // 0 for none
+    char text [1];              // as added, for the logs
+};
+
+struct ip_filter_node
+{
+    struct ip_filter_node *child [2];
+    struct ip_filter_entry *entry;  // NULL if only joining the children
+    unsigned char bits;             // prefix length
+    unsigned char key [16];         // bits past the prefix are 0
+};
+
+struct ip_filter_version
+{
+    struct ip_filter_version *next;     // when retired
+    struct ip_filter_node *root;
+    struct cache_list_node *patterns;
+    long count;
+    int free_all;               // replaced by a reload, so the tree and patterns go too
+    void **garbage;             // what the change that replaced this one dropped
+    unsigned int garbage_count, garbage_alloc;
+};
+
+struct ip_filter_hold
+{
+    struct ip_filter_hold *next;
+    struct ip_filter_version *snap;     // not freed while set here
+};
+
+static struct ip_filter_hold *ip_filter_holds;
+static pthread_key_t ip_filter_hold_key;
+static spin_t ip_filter_hold_lock;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+#define ipf_ptr_load(p)         __atomic_load_n (p, __ATOMIC_SEQ_CST)
+#define ipf_ptr_store(p,v)      __atomic_store_n (p, v, __ATOMIC_SEQ_CST)
+#define ipf_time_load(p)        __atomic_load_n (p, __ATOMIC_RELAXED)
+#define ipf_time_store(p,v)     __atomic_store_n (p, v, __ATOMIC_RELAXED)
+#define ipf_hold_lock()         do {} while(0)
+#define ipf_hold_unlock()       do {} while(0)
+#else
+/* no atomics, so setting a hold and checking them are serialised instead */
+#define ipf_ptr_load(p)         (*(p))
+#define ipf_ptr_store(p,v)      (*(p) = (v))
+#define ipf_time_load(p)        (*(p))
+#define ipf_time_store(p,v)     (*(p) = (v))
+#define ipf_hold_lock()         thread_spin_lock (&ip_filter_hold_lock)
+#define ipf_hold_unlock()       thread_spin_unlock (&ip_filter_hold_lock)
+#endif
+
+
+static void ipf_hold_exit (void *arg)
+{
+    struct ip_filter_hold *hold = arg, **p;
+
+    thread_spin_lock (&ip_filter_hold_lock);
+    for (p = &ip_filter_holds; *p; p = &(*p)->next)
+    {
+        if (*p == hold)
+        {
+            *p = hold->next;
+            break;
+        }
+    }
+    thread_spin_unlock (&ip_filter_hold_lock);
+    free (hold);
+}
+
+
+static struct ip_filter_hold *ipf_hold_get (void)
+{
+    struct ip_filter_hold *hold = pthread_getspecific (ip_filter_hold_key);
+
+    if (hold == NULL)
+    {
+        hold = calloc (1, sizeof (struct ip_filter_hold));
+        if (hold == NULL)
+            abort();
+        pthread_setspecific (ip_filter_hold_key, hold);
+        thread_spin_lock (&ip_filter_hold_lock);
+        hold->next = ip_filter_holds;
+        ip_filter_holds = hold;
+        thread_spin_unlock (&ip_filter_hold_lock);
+    }
+    return hold;
+}
+
+
+static int ipf_version_held (struct ip_filter_version *v)
+{
+    struct ip_filter_hold *hold;
+    int held = 0;
+
+    thread_spin_lock (&ip_filter_hold_lock);
+    for (hold = ip_filter_holds; hold; hold = hold->next)
+    {
+        if (ipf_ptr_load (&hold->snap) == v)
+        {
+            held = 1;
+            break;
+        }
+    }
+    thread_spin_unlock (&ip_filter_hold_lock);
+    return held;
+}
+
+
+void ip_filter_initialize (void)
+{
+    thread_spin_create (&ip_filter_hold_lock);
+    pthread_key_create (&ip_filter_hold_key, ipf_hold_exit);
+}
+
+
+static int ipf_pton (int af, const char *src, void *dst)
+{
+#ifdef HAVE_INET_PTON
+    return inet_pton (af, src, dst) == 1 ? 0 : -1;
+#else
+    if (af == AF_INET && inet_aton (src, dst))
+        return 0;
+    return -1;
+#endif
+}
+
+
+/* the key for an address, IPv4 is mapped into IPv6 */
+static int ipf_address (const char *ip, unsigned char *key)
+{
+    memset (key, 0, 16);
+    if (strchr (ip, ':'))
+        return ipf_pton (AF_INET6, ip, key);
+    key[10] = key[11] = 0xff;
+    return ipf_pton (AF_INET, ip, key + 12);
+}
+
+
+/* the key and prefix length for an address, a CIDR range or an IPv4 pattern
+ * like 10.1.* , -1 for anything else */
+static int ipf_parse (const char *str, unsigned char *key, unsigned int *bits)
+{
+    char buf [64], *slash, *p;
+    unsigned int prefix, max, base, i;
+
+    if (strlen (str) >= sizeof (buf))
+        return -1;
+    strcpy (buf, str);
+    slash = strchr (buf, '/');
+    if (slash)
+        *slash++ = '\0';
+    p = buf + strcspn (buf, "*?[");
+    if (*p)
+    {
+        unsigned int octets = 0, parts;
+        char *s = buf;
+
+        // whole octets, then * and .* for the rest
+        if (slash || *p != '*' || p == buf || p[-1] != '.')
+            return -1;
+        while (s < p)
+        {
+            unsigned int len = strspn (s, "0123456789");
+            if (octets == 3 || len == 0 || len > 3 || s[len] != '.' || atoi (s) > 255)
+                return -1;
+            key [12 + octets++] = atoi (s);
+            s += len + 1;
+        }
+        for (parts = octets + 1, s = p + 1; *s; parts++, s += 2)
+            if (s[0] != '.' || s[1] != '*')
+                return -1;
+        if (parts > 4)
+            return -1;
+        memset (key, 0, 12);
+        memset (key + 12 + octets, 0, 4 - octets);
+        key[10] = key[11] = 0xff;
+        *bits = 96 + octets * 8;
+        return 0;
+    }
+    if (ipf_address (buf, key) < 0)
+        return -1;
+    max = strchr (buf, ':') ? 128 : 32;
+    base = 128 - max;
+    prefix = max;
+    if (slash)
+    {
+        char *end;
+
+        prefix = strtoul (slash, &end, 10);
+        if (*slash == '\0' || *end || prefix > max)
+            return -1;
+    }
+    *bits = base + prefix;
+    for (i = *bits; i < 128; i++)
+        key [i>>3] &= ~(0x80 >> (i&7));
+    return 0;
+}
+
+
+static inline int ipf_bit (const unsigned char *key, unsigned int bit)
+{
+    return (key [bit>>3] >> (7 - (bit&7))) & 1;
+}
+
+
+/* how many leading bits, up to max, are the same in both */
+static unsigned int ipf_common (const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+    unsigned int i;
+
+    for (i = 0; i < max; i += 8)
+    {
+        unsigned char x = a [i>>3] ^ b [i>>3];
+        if (x)
+        {
+            while ((x & 0x80) == 0)
+            {
+                x <<= 1;
+                i++;
+            }
+            break;
+        }
+    }
+    return i < max ? i : max;
+}
+
+
+/* something the previous version can still reach, freed when it is. With no
+ * previous version the tree is not yet published so it can go now */
+static void ipf_garbage (struct ip_filter_version *old, void *ptr)
+{
+    if (old == NULL)
+    {
+        free (ptr);
+        return;
+    }
+    if (old->garbage_count == old->garbage_alloc)
+    {
+        old->garbage_alloc = old->garbage_alloc ? old->garbage_alloc * 2 : 16;
+        old->garbage = realloc (old->garbage, old->garbage_alloc * sizeof (void *));
+        if (old->garbage == NULL)
+            abort();
+    }
+    old->garbage [old->garbage_count++] = ptr;
+}
+
+
+static struct ip_filter_node *ipf_node_new (const unsigned char *key, unsigned int bits, struct ip_filter_entry *entry)
+{
+    struct ip_filter_node *node = calloc (1, sizeof (struct ip_filter_node));
+    unsigned int i;
+
+    if (node == NULL)
+        abort();
+    memcpy (node->key, key, 16);
+    for (i = bits; i < 128; i++)
+        node->key [i>>3] &= ~(0x80 >> (i&7));
+    node->bits = bits;
+    node->entry = entry;
+    return node;
+}
+
+
+/* a node to change, the tree being built for a reload is changed in place */
+static struct ip_filter_node *ipf_node_copy (struct ip_filter_version *old, struct ip_filter_node *node)
+{
+    struct ip_filter_node *copy;
+
+    if (old == NULL)
+        return node;
+    copy = malloc (sizeof (struct ip_filter_node));
+    if (copy == NULL)
+        abort();
+    memcpy (copy, node, sizeof (struct ip_filter_node));
+    ipf_garbage (old, node);
+    return copy;
+}
+
+
+static struct ip_filter_node *ipf_insert (struct ip_filter_version *old, struct ip_filter_node *node,
+        const unsigned char *key, unsigned int bits, struct ip_filter_entry *entry, int *added)
+{
+    struct ip_filter_node *copy;
+    unsigned int common;
+
+    if (node == NULL)
+    {
+        *added = 1;
+        return ipf_node_new (key, bits, entry);
+    }
+    common = ipf_common (node->key, key, node->bits < bits ? node->bits : bits);
+    if (common == node->bits)
+    {
+        copy = ipf_node_copy (old, node);
+        if (common == bits)
+        {
+            if (copy->entry)
+                ipf_garbage (old, copy->entry);
+            else
+                *added = 1;
+            copy->entry = entry;
+        }
+        else
+        {
+            int b = ipf_bit (key, common);
+            copy->child [b] = ipf_insert (old, copy->child [b], key, bits, entry, added);
+        }
+        return copy;
+    }
+    // the new prefix splits off before the end of this one
+    *added = 1;
+    if (common == bits)
+    {
+        copy = ipf_node_new (key, bits, entry);
+        copy->child [ipf_bit (node->key, common)] = node;
+        return copy;
+    }
+    copy = ipf_node_new (key, common, NULL);
+    copy->child [ipf_bit (node->key, common)] = node;
+    copy->child [ipf_bit (key, common)] = ipf_node_new (key, bits, entry);
+    return copy;
+}
+
+
+static struct ip_filter_node *ipf_delete (struct ip_filter_version *old, struct ip_filter_node *node,
+        const unsigned char *key, unsigned int bits, int *removed)
+{
+    struct ip_filter_node *copy, *next;
+    int b;
+
+    if (node == NULL || node->bits > bits || ipf_common (node->key, key, node->bits) < node->bits)
+        return node;
+    if (node->bits == bits)
+    {
+        if (node->entry == NULL)
+            return node;
+        *removed = 1;
+        ipf_garbage (old, node->entry);
+        if (node->child[0] && node->child[1])
+        {
+            copy = ipf_node_copy (old, node);
+            copy->entry = NULL;
+            return copy;
+        }
+        next = node->child[0] ? node->child[0] : node->child[1];
+        ipf_garbage (old, node);
+        return next;
+    }
+    b = ipf_bit (key, node->bits);
+    next = ipf_delete (old, node->child [b], key, bits, removed);
+    if (next == node->child [b])
+        return node;
+    if (next == NULL && node->entry == NULL)
+    {
+        // only joined two, so the other takes its place
+        next = node->child [b^1];
+        ipf_garbage (old, node);
+        return next;
+    }
+    copy = ipf_node_copy (old, node);
+    copy->child [b] = next;
+    return copy;
+}
+
+
+static struct ip_filter_entry *ipf_lookup (struct ip_filter_node *node, const unsigned char *key, time_t now)
+{
+    while (node && ipf_common (node->key, key, node->bits) == node->bits)
+    {
+        struct ip_filter_entry *entry = node->entry;
+
+        if (entry)
+        {
+            time_t timeout = ipf_time_load (&entry->timeout);
+            if (timeout == 0 || timeout > now)
+                return entry;
+        }
+        if (node->bits == 128)
+            break;
+        node = node->child [ipf_bit (key, node->bits)];
+    }
+    return NULL;
+}
+
+
+static void ipf_tree_free (struct ip_filter_node *node)
+{
+    if (node == NULL)
+        return;
+    ipf_tree_free (node->child[0]);
+    ipf_tree_free (node->child[1]);
+    free (node->entry);
+    free (node);
+}
+
+
+static struct ip_filter_version *ipf_version_new (struct ip_filter_version *from)
+{
+    struct ip_filter_version *v = calloc (1, sizeof (struct ip_filter_version));
+
+    if (v == NULL)
+        abort();
+    if (from)
+    {
+        v->root = from->root;
+        v->patterns = from->patterns;
+        v->count = from->count;
+    }
+    return v;
+}
+
+
+static void ipf_version_free (struct ip_filter_version *v)
+{
+    unsigned int i;
+
+    for (i = 0; i < v->garbage_count; i++)
+        free (v->garbage [i]);
+    free (v->garbage);
+    if (v->free_all)
+    {
+        ipf_tree_free (v->root);
+        while (v->patterns)
+        {
+            struct cache_list_node *entry = v->patterns;
+            v->patterns = entry->next;
+            free (entry->content);
+            free (entry);
+        }
+    }
+    free (v);
+}
+
+
+/* add to a version not yet published, old is the one it is replacing */
+static void ipf_version_add (ip_filter_t *filter, struct ip_filter_version *v,
+        struct ip_filter_version *old, const char *text, time_t timeout)
+{
+    unsigned char key [16];
+    unsigned int bits;
+
+    if (ipf_parse (text, key, &bits) == 0)
+    {
+        size_t len = strlen (text);
+        struct ip_filter_entry *entry = malloc (sizeof (struct ip_filter_entry) + len);
+        int added = 0;
+
+        if (entry == NULL)
+            abort();
+        entry->timeout = timeout;
+        memcpy (entry->text, text, len + 1);
+        v->root = ipf_insert (old, v->root, key, bits, entry, &added);
+        v->count += added;
+        if (timeout && (filter->next_expiry == 0 || timeout < filter->next_expiry))
+            filter->next_expiry = timeout;
+    }
+    else
+    {
+        struct cache_list_node *entry = calloc (1, sizeof (struct cache_list_node));
+
+        if (entry == NULL || (entry->content = strdup (text)) == NULL)
+            abort();
+        entry->next = v->patterns;
+        v->patterns = entry;
+        v->count++;
+        DEBUG1 ("Adding wildcard entry \"%.30s\"", text);
+    }
+}
+
+
+/* filter lock held. Retired versions go oldest first, as the nodes dropped
+ * by one change may also be reachable from the versions before it */
+static void ipf_reclaim (ip_filter_t *filter)
+{
+    while (filter->retired && ipf_version_held (filter->retired) == 0)
+    {
+        struct ip_filter_version *v = filter->retired;
+
+        filter->retired = v->next;
+        ipf_version_free (v);
+    }
+}
+
+
+/* filter lock held, v replaces the current version */
+static void ipf_publish (ip_filter_t *filter, struct ip_filter_version *v, int free_all)
+{
+    struct ip_filter_version *old = filter->current, **p;
+
+    ipf_hold_lock();
+    ipf_ptr_store (&filter->current, v);
+    ipf_hold_unlock();
+    if (old)
+    {
+        old->free_all = free_all;
+        for (p = &filter->retired; *p; p = &(*p)->next)
+            ;
+        *p = old;
+    }
+    ipf_reclaim (filter);
+}
+
+
+static void ipf_expired (struct ip_filter_node *node, time_t now, struct ip_filter_node ***list,
+        unsigned int *count, unsigned int *alloc, time_t *next)
+{
+    time_t timeout;
+
+    if (node == NULL)
+        return;
+    if (node->entry && (timeout = ipf_time_load (&node->entry->timeout)))
+    {
+        if (timeout <= now)
+        {
+            if (*count == *alloc)
+            {
+                *alloc = *alloc ? *alloc * 2 : 16;
+                *list = realloc (*list, *alloc * sizeof (struct ip_filter_node *));
+                if (*list == NULL)
+                    abort();
+            }
+            (*list) [(*count)++] = node;
+        }
+        else if (*next == 0 || timeout < *next)
+            *next = timeout;
+    }
+    ipf_expired (node->child[0], now, list, count, alloc, next);
+    ipf_expired (node->child[1], now, list, count, alloc, next);
+}
+
+
+/* filter lock held, drop the entries whose time is up */
+static void ipf_expire (ip_filter_t *filter, time_t now)
+{
+    struct ip_filter_version *cur = filter->current, *v;
+    struct ip_filter_node **list = NULL;
+    unsigned int i, count = 0, alloc = 0;
+    time_t next = 0;
+
+    if (cur == NULL)
+    {
+        filter->next_expiry = 0;
+        return;
+    }
+    ipf_expired (cur->root, now, &list, &count, &alloc, &next);
+    filter->next_expiry = next;
+    if (count == 0)
+        return;
+    v = ipf_version_new (cur);
+    for (i = 0; i < count; i++)
+    {
+        int removed = 0;
+
+        INFO1 ("removing %s from ban list for now", list[i]->entry->text);
+        v->root = ipf_delete (cur, v->root, list[i]->key, list[i]->bits, &removed);
+        v->count -= removed;
+    }
+    free (list);
+    ipf_publish (filter, v, 0);
+}
+
+
+void ip_filter_init (ip_filter_t *filter)
+{
+    memset (filter, 0, sizeof (ip_filter_t));
+    thread_mutex_create (&filter->lock);
+}
+
+
+void ip_filter_set_file (ip_filter_t *filter, const char *filename)
+{
+    thread_mutex_lock (&filter->lock);
+    free (filter->filename);
+    filter->filename = filename ? strdup (filename) : NULL;
+    filter->file_mtime = 0;
+    filter->file_recheck = 0;
+    thread_mutex_unlock (&filter->lock);
+}
+
+
+void ip_filter_clear (ip_filter_t *filter)
+{
+    thread_mutex_lock (&filter->lock);
+    ipf_publish (filter, NULL, 1);
+    free (filter->filename);
+    filter->filename = NULL;
+    filter->file_mtime = 0;
+    filter->file_recheck = 0;
+    filter->next_expiry = 0;
+    thread_mutex_unlock (&filter->lock);
+}
+
+
+/* no lookups can be running now */
+void ip_filter_destroy (ip_filter_t *filter)
+{
+    ip_filter_clear (filter);
+    while (filter->retired)
+    {
+        struct ip_filter_version *v = filter->retired;
+
+        filter->retired = v->next;
+        ipf_version_free (v);
+    }
+    thread_mutex_destroy (&filter->lock);
+}
+
+
+void ip_filter_recheck (ip_filter_t *filter, time_t now)
+{
+    struct ip_filter_version *v;
+    struct stat file_stat;
+    FILE *file;
+    int count = 0;
+    char line [MAX_LINE_LEN];
+
+    if (now < filter->file_recheck)
+       return;      //  common case;
+    thread_mutex_lock (&filter->lock);
+    do
+    {
+        if (now < filter->file_recheck)
+            break; // was racing, updated so get out of here
+
+        filter->file_recheck = now + 10;
+        if (filter->next_expiry && filter->next_expiry <= now)
+            ipf_expire (filter, now);
+
+        if (filter->filename == NULL)
+        {
+            if (filter->current)
+                ipf_publish (filter, NULL, 1);
+            break;
+        }
+        if (stat (filter->filename, &file_stat) < 0)
+        {
+            WARN2 ("failed to check status of \"%s\": %s", filter->filename, strerror(errno));
+            break;
+        }
+        if (file_stat.st_mtime == filter->file_mtime)
+            break; /* common case when checking, no update to file */
+
+        filter->file_mtime = file_stat.st_mtime;
+
+        file = fopen (filter->filename, "r");
+        if (file == NULL)
+        {
+            WARN2("Failed to open file \"%s\": %s", filter->filename, strerror (errno));
+            break;
+        }
+        v = ipf_version_new (NULL);
+        filter->next_expiry = 0;
+        while (get_line (file, line, MAX_LINE_LEN))
+        {
+            if(!line[0] || line[0] == '#')
+                continue;
+            count++;
+            ipf_version_add (filter, v, NULL, line, 0);
+        }
+        fclose (file);
+        ipf_publish (filter, v, 1);
+        INFO2 ("%d entries read from file \"%s\"", count, filter->filename);
+
+    } while (0);
+    thread_mutex_unlock (&filter->lock);
+}
+
+
+int ip_filter_search (ip_filter_t *filter, const char *ip, time_t now)
+{
+    struct ip_filter_hold *hold = ipf_hold_get();
+    struct ip_filter_version *v;
+    unsigned char key [16];
+    int ret = -1;
+
+    ipf_hold_lock();
+    do
+    {
+        v = ipf_ptr_load (&filter->current);
+        ipf_ptr_store (&hold->snap, v);
+    } while (v != ipf_ptr_load (&filter->current));
+    ipf_hold_unlock();
+
+    if (v)
+    {
+        struct cache_list_node *pattern;
+
+        ret = 0;
+        if (ipf_address (ip, key) == 0)
+        {
+            struct ip_filter_entry *entry = ipf_lookup (v->root, key, now);
+
+            if (entry)
+            {
+                time_t timeout = ipf_time_load (&entry->timeout);
+
+                if (timeout && now + IP_FILTER_BAN_EXTEND > timeout)
+                    ipf_time_store (&entry->timeout, now + IP_FILTER_BAN_EXTEND);
+                ret = 1;
+            }
+        }
+        for (pattern = v->patterns; ret == 0 && pattern; pattern = pattern->next)
+        {
+            if (cached_pattern_compare (ip, pattern->content) == 0)
+                ret = 1;
+        }
+    }
+    ipf_ptr_store (&hold->snap, NULL);
+    return ret;
+}
+
+
+int ip_filter_add (ip_filter_t *filter, const char *ip, time_t timeout)
+{
+    struct ip_filter_version *v;
+
+    thread_mutex_lock (&filter->lock);
+    if (filter->current == NULL)
+    {
+        thread_mutex_unlock (&filter->lock);
+        return -1;
+    }
+    v = ipf_version_new (filter->current);
+    ipf_version_add (filter, v, filter->current, ip, timeout);
+    ipf_publish (filter, v, 0);
+    thread_mutex_unlock (&filter->lock);
+    return 0;
+}
+
+
+void ip_filter_remove (ip_filter_t *filter, const char *ip)
+{
+    unsigned char key [16];
+    unsigned int bits;
+
+    if (ipf_parse (ip, key, &bits) < 0)
+        return;
+    thread_mutex_lock (&filter->lock);
+    if (filter->current)
+    {
+        struct ip_filter_version *v = ipf_version_new (filter->current);
+        int removed = 0;
+
+        v->root = ipf_delete (filter->current, v->root, key, bits, &removed);
+        if (removed)
+        {
+            v->count--;
+            ipf_publish (filter, v, 0);
+        }
+        else
+            free (v);
+    }
+    thread_mutex_unlock (&filter->lock);
+}
+
+
+long ip_filter_count (ip_filter_t *filter)
+{
+    long count = 0;
+
+    thread_mutex_lock (&filter->lock);
+    if (filter->current)
+        count = filter->current->count;
+    thread_mutex_unlock (&filter->lock);
+    return count;
+}
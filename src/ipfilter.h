@@ -0,0 +1,52 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* ipfilter.h
+ *
+ * lists of IP addresses and CIDR ranges, for the ban and allow files
+ *
+ */
+
+#ifndef __IPFILTER_H__
+#define __IPFILTER_H__
+
+#include <time.h>
+#include "thread/thread.h"
+
+struct ip_filter_version;
+
+typedef struct ip_filter
+{
+    mutex_t lock;                       // for changes, lookups do not take it
+    char *filename;
+    time_t file_recheck;
+    time_t file_mtime;
+    time_t next_expiry;
+    struct ip_filter_version *current;  // NULL if there is no list
+    struct ip_filter_version *retired;  // oldest first
+} ip_filter_t;
+
+void ip_filter_initialize (void);
+
+void ip_filter_init (ip_filter_t *filter);
+void ip_filter_destroy (ip_filter_t *filter);
+
+/* the file is read on the next recheck, clear drops the file and the list */
+void ip_filter_set_file (ip_filter_t *filter, const char *filename);
+void ip_filter_clear (ip_filter_t *filter);
+
+/* reload the file if it has changed, and drop expired entries */
+void ip_filter_recheck (ip_filter_t *filter, time_t now);
+
+/* -1 if there is no list, 0 if ip is not in it, 1 if it is */
+int  ip_filter_search (ip_filter_t *filter, const char *ip, time_t now);
+
+/* timeout of 0 for no expiry, returns -1 if there is no list */
+int  ip_filter_add (ip_filter_t *filter, const char *ip, time_t timeout);
+void ip_filter_remove (ip_filter_t *filter, const char *ip);
+long ip_filter_count (ip_filter_t *filter);
+
+#endif  /* __IPFILTER_H__ */
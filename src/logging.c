@@ -49,7 +49,8 @@ int playlistlog = 0;
 ** DATE = _make_date(client->con->con_time)
 ** REQUEST = build from client->parser
 ** CODE = client->respcode
-** BYTES = client->con->sent_bytes
+** BYTES = client->con->sent_bytes, what the socket took, client_destroy sends
+**         anything held first and data that never goes out is not counted
 ** REFERER = get from client->parser
 ** AGENT = get from client->parser
 ** TIME = timing_get_time() - client->con->con_time
@@ -307,6 +308,35 @@ int restart_logging (ice_config_t *config)
 }
 
 
+/* reopen the logs in use, as after an external rotation. The snapshot is the
+ * running one which readers share without the lock, so the log ids are left as
+ * they are, logs not open are picked up by a reread of the configuration */
+void reopen_logging (ice_config_t *config)
+{
+    int ids[] = { config->error_log.logid, config->preroll_log.logid,
+        config->access_log.logid, config->playlist_log.logid };
+    mount_proxy *m;
+    avl_node *node;
+    int i;
+
+    for (i = 0; i < sizeof (ids)/sizeof (ids[0]); i++)
+        if (ids[i] >= 0)
+            log_reopen (ids[i]);
+    // any logs for template based mounts
+    for (m = config->mounts; m; m = m->next)
+        if (m->access_log.logid >= 0)
+            log_reopen (m->access_log.logid);
+    // any logs for specifically named mounts
+    node = config->mounts_tree ? avl_get_first (config->mounts_tree) : NULL;
+    for (; node; node = avl_get_next (node))
+    {
+        m = (mount_proxy *)node->key;
+        if (m->access_log.logid >= 0)
+            log_reopen (m->access_log.logid);
+    }
+}
+
+
 int init_logging (ice_config_t *config)
 {
     worker_logger_init();
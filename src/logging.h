@@ -91,6 +91,7 @@ void logging_access(client_t *client);
 void logging_playlist(const char *mount, const char *metadata, long listeners);
 void logging_preroll (int log_id, const char *intro_name, client_t *client);
 int  restart_logging (ice_config_t *config);
+void reopen_logging (ice_config_t *config);
 int init_logging (ice_config_t *config);
 int  start_logging(ice_config_t *config);
 void stop_logging(void);
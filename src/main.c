@@ -106,6 +106,7 @@ void initialize_subsystems(void)
     config_initialize();
     connection_initialize();
     refbuf_initialize();
+    client_initialize();
 
     stats_initialize();
     xslt_initialize();
@@ -122,6 +123,7 @@ void shutdown_subsystems(void)
     xslt_shutdown();
 
     config_shutdown();
+    client_shutdown();
     refbuf_shutdown();
     resolver_shutdown();
     sock_shutdown();
@@ -0,0 +1,331 @@
+/* -*- c-basic-offset: 4; -*- */
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* mountmatch.c
+ *
+ * Mount names with wildcards are looked up when there is no exact <mount>
+ * for a stream. Rather than trying each template in turn with fnmatch, the
+ * templates are merged at config load into a trie of pattern elements, a
+ * literal character, ?, * or a [] set. Common prefixes share nodes, so a
+ * lookup steps through the mount name once keeping the set of nodes reached
+ * so far, which stays small however many templates there are.
+ *
+ * The patterns are read as fnmatch does without flags, so * and ? also match
+ * '/', and a \ quotes the next character. Where several templates match, the
+ * one earliest in the config wins, as with the previous list scan.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "mountmatch.h"
+#include "logging.h"
+
+#define CATMODULE "mountmatch"
+
+#define MATCH_LITERAL   0
+#define MATCH_ANY       1
+#define MATCH_STAR      2
+#define MATCH_SET       3
+
+#define MATCH_STACK_STATES  128
+
+struct match_node
+{
+    unsigned int child;         // first child, the root is never a child so 0 is none
+    unsigned int sibling;
+    unsigned char type;         // the element taken from the parent to get here
+    unsigned char ch;           // for MATCH_LITERAL
+    char *set;                  // [] expression for MATCH_SET
+    mount_proxy *mount;         // a template ends here
+    unsigned int order;         // position of that template in the config
+};
+
+struct mount_match
+{
+    struct match_node *nodes;
+    unsigned int count, alloc;
+};
+
+struct match_states
+{
+    unsigned int *ids;
+    unsigned int count, alloc;
+    unsigned int stack [MATCH_STACK_STATES];
+};
+
+
+/* find the closing ] of the set starting at p, NULL if there is none in which
+ * case the [ is an ordinary character */
+static const char *match_set_end (const char *p)
+{
+    const char *s = p + 1;
+
+    if (*s == '!' || *s == '^')
+        s++;
+    if (*s == ']')
+        s++;
+    while (*s && *s != ']')
+    {
+        if (*s == '[' && (s[1] == ':' || s[1] == '=' || s[1] == '.'))
+        {
+            char delim = s[1];
+            const char *e = s + 2;
+
+            while (*e && (e[0] != delim || e[1] != ']'))
+                e++;
+            if (*e == '\0')
+                return NULL;
+            s = e + 2;
+            continue;
+        }
+        if (*s == '\\' && s[1])
+            s++;
+        s++;
+    }
+    return *s ? s : NULL;
+}
+
+
+static unsigned int match_node_new (mount_match_t *match, int type, unsigned char ch, const char *set, size_t setlen)
+{
+    struct match_node *node;
+
+    if (match->count == match->alloc)
+    {
+        match->alloc = match->alloc ? match->alloc * 2 : 64;
+        match->nodes = realloc (match->nodes, match->alloc * sizeof (struct match_node));
+        if (match->nodes == NULL)
+            abort();
+    }
+    node = &match->nodes [match->count];
+    memset (node, 0, sizeof (*node));
+    node->type = type;
+    node->ch = ch;
+    if (type == MATCH_SET)
+    {
+        node->set = malloc (setlen + 1);
+        if (node->set == NULL)
+            abort();
+        memcpy (node->set, set, setlen);
+        node->set [setlen] = '\0';
+    }
+    return match->count++;
+}
+
+
+/* the child of parent for the element, added if not already there */
+static unsigned int match_node_add (mount_match_t *match, unsigned int parent, int type, unsigned char ch, const char *set, size_t setlen)
+{
+    unsigned int id = match->nodes [parent].child, last = 0;
+
+    for (; id; id = match->nodes [id].sibling)
+    {
+        struct match_node *node = &match->nodes [id];
+
+        if (node->type == type)
+        {
+            if (type == MATCH_ANY || type == MATCH_STAR)
+                return id;
+            if (type == MATCH_LITERAL && node->ch == ch)
+                return id;
+            if (type == MATCH_SET && strlen (node->set) == setlen && strncmp (node->set, set, setlen) == 0)
+                return id;
+        }
+        last = id;
+    }
+    id = match_node_new (match, type, ch, set, setlen);
+    if (last)
+        match->nodes [last].sibling = id;
+    else
+        match->nodes [parent].child = id;
+    return id;
+}
+
+
+static void match_insert (mount_match_t *match, mount_proxy *mountinfo, unsigned int order)
+{
+    const char *p = mountinfo->mountname;
+    unsigned int id = 0;
+
+    for (; *p; p++)
+    {
+        const char *end;
+
+        switch (*p)
+        {
+            case '*':
+                while (p[1] == '*')
+                    p++;
+                id = match_node_add (match, id, MATCH_STAR, 0, NULL, 0);
+                break;
+            case '?':
+                id = match_node_add (match, id, MATCH_ANY, 0, NULL, 0);
+                break;
+            case '[':
+                end = match_set_end (p);
+                if (end)
+                {
+                    id = match_node_add (match, id, MATCH_SET, 0, p, end - p + 1);
+                    p = end;
+                }
+                else
+                    id = match_node_add (match, id, MATCH_LITERAL, '[', NULL, 0);
+                break;
+            case '\\':
+                if (p[1] == '\0')
+                {
+                    WARN1 ("mount %s ends in \\ so cannot match", mountinfo->mountname);
+                    return;
+                }
+                p++;
+                /* fall through */
+            default:
+                id = match_node_add (match, id, MATCH_LITERAL, (unsigned char)*p, NULL, 0);
+                break;
+        }
+    }
+    if (match->nodes [id].mount == NULL || order < match->nodes [id].order)
+    {
+        match->nodes [id].mount = mountinfo;
+        match->nodes [id].order = order;
+    }
+}
+
+
+mount_match_t *mount_match_compile (mount_proxy *mounts)
+{
+    mount_match_t *match;
+    mount_proxy *mountinfo;
+    unsigned int total = 0, i = 0;
+
+    for (mountinfo = mounts; mountinfo; mountinfo = mountinfo->next)
+        total++;
+    if (total == 0)
+        return NULL;
+    match = calloc (1, sizeof (mount_match_t));
+    if (match == NULL)
+        abort();
+    match_node_new (match, MATCH_LITERAL, 0, NULL, 0);   // the root
+
+    // the list is in reverse order of the config file
+    for (mountinfo = mounts; mountinfo; mountinfo = mountinfo->next, i++)
+        match_insert (match, mountinfo, total - i - 1);
+    DEBUG2 ("%u mount templates compiled into %u states", total, match->count);
+    return match;
+}
+
+
+void mount_match_free (mount_match_t *match)
+{
+    unsigned int i;
+
+    if (match == NULL)
+        return;
+    for (i = 0; i < match->count; i++)
+        free (match->nodes [i].set);
+    free (match->nodes);
+    free (match);
+}
+
+
+/* add a node and any * following it, as those can match nothing */
+static void match_state_add (mount_match_t *match, struct match_states *states, unsigned int id)
+{
+    unsigned int i, child;
+
+    for (i = 0; i < states->count; i++)
+        if (states->ids [i] == id)
+            return;
+    if (states->count == states->alloc)
+    {
+        unsigned int *ids = malloc (states->alloc * 2 * sizeof (unsigned int));
+        if (ids == NULL)
+            abort();
+        memcpy (ids, states->ids, states->count * sizeof (unsigned int));
+        if (states->ids != states->stack)
+            free (states->ids);
+        states->ids = ids;
+        states->alloc *= 2;
+    }
+    states->ids [states->count++] = id;
+    for (child = match->nodes [id].child; child; child = match->nodes [child].sibling)
+        if (match->nodes [child].type == MATCH_STAR)
+            match_state_add (match, states, child);
+}
+
+
+static int match_set (const char *set, unsigned char c)
+{
+    char str[2] = { c, '\0' };
+
+    return fnmatch (set, str, 0) == 0;
+}
+
+
+mount_proxy *mount_match_find (mount_match_t *match, const char *mount)
+{
+    struct match_states a, b, *cur = &a, *next = &b;
+    mount_proxy *mountinfo = NULL;
+    unsigned int i, order = 0;
+
+    if (match == NULL)
+        return NULL;
+    a.ids = a.stack;
+    b.ids = b.stack;
+    a.alloc = b.alloc = MATCH_STACK_STATES;
+    a.count = b.count = 0;
+
+    match_state_add (match, cur, 0);
+    for (; *mount && cur->count; mount++)
+    {
+        unsigned char c = (unsigned char)*mount;
+        struct match_states *swap;
+
+        next->count = 0;
+        for (i = 0; i < cur->count; i++)
+        {
+            struct match_node *node = &match->nodes [cur->ids [i]];
+            unsigned int child;
+
+            if (node->type == MATCH_STAR)
+                match_state_add (match, next, cur->ids [i]);
+            for (child = node->child; child; child = match->nodes [child].sibling)
+            {
+                struct match_node *n = &match->nodes [child];
+
+                if ((n->type == MATCH_LITERAL && n->ch == c) || n->type == MATCH_ANY ||
+                        (n->type == MATCH_SET && match_set (n->set, c)))
+                    match_state_add (match, next, child);
+            }
+        }
+        swap = cur;
+        cur = next;
+        next = swap;
+    }
+    if (*mount == '\0')
+    {
+        for (i = 0; i < cur->count; i++)
+        {
+            struct match_node *node = &match->nodes [cur->ids [i]];
+
+            if (node->mount && (mountinfo == NULL || node->order < order))
+            {
+                mountinfo = node->mount;
+                order = node->order;
+            }
+        }
+    }
+    if (a.ids != a.stack) free (a.ids);
+    if (b.ids != b.stack) free (b.ids);
+    return mountinfo;
+}
@@ -0,0 +1,28 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* mountmatch.h
+ *
+ * wildcard <mount> names compiled into one automaton for lookups
+ *
+ */
+
+#ifndef __MOUNTMATCH_H__
+#define __MOUNTMATCH_H__
+
+typedef struct mount_match mount_match_t;
+
+#include "cfgfile.h"
+
+/* built from the template list of a config, NULL if there are no templates */
+mount_match_t *mount_match_compile (mount_proxy *mounts);
+void mount_match_free (mount_match_t *match);
+
+/* the template the mount matches, as fnmatch would, with the earliest in the
+ * config file taking precedence */
+mount_proxy *mount_match_find (mount_match_t *match, const char *mount);
+
+#endif  /* __MOUNTMATCH_H__ */
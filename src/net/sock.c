@@ -730,6 +730,7 @@ struct _server_sockets
 {
     struct addrinfo *res;
     struct addrinfo *next;
+    int reuseport;
 };
 
 
@@ -906,6 +907,11 @@ int sock_get_next_server_socket (sock_server_t _s, sock_t *serversock)
         /* reuse it if we can */
         setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof(on));
 #endif
+#ifdef SO_REUSEPORT
+        /* several listening sockets can share the address */
+        if (s->reuseport)
+            setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, (void *)&on, sizeof(on));
+#endif
 #ifdef IPV6_V6ONLY
         on = 1;
         setsockopt (sock, IPPROTO_IPV6, IPV6_V6ONLY, (void*)&on, sizeof on);
@@ -928,6 +934,22 @@ int sock_get_next_server_socket (sock_server_t _s, sock_t *serversock)
 }
 
 
+/* mark the sockets to be created as shareable with others bound to the same
+ * address, returns -1 if not supported */
+int sock_server_reuseport (sock_server_t _s)
+{
+#ifdef SO_REUSEPORT
+    struct _server_sockets *s = _s;
+    if (s)
+    {
+        s->reuseport = 1;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+
 #else
 
 #define _server_sockets sockaddr_in
@@ -1098,6 +1120,11 @@ void sock_free_server_sockets (sock_server_t _s)
     struct _server_sockets *s = _s;
     free (s);
 }
+
+int sock_server_reuseport (sock_server_t _s)
+{
+    return -1;
+}
 #endif
 
 void *sock_get_server_sockets (int port, const char *sinterface)
@@ -1155,7 +1182,7 @@ int sock_listen(sock_t serversock, int backlog)
     return (listen(serversock, backlog) == 0);
 }
 
-sock_t sock_accept(sock_t serversock, char *ip, size_t len)
+static sock_t _sock_accept (sock_t serversock, char *ip, size_t len, int nonblocking)
 {
 #ifdef HAVE_GETNAMEINFO
     struct sockaddr_storage sa;
@@ -1166,11 +1193,22 @@ sock_t sock_accept(sock_t serversock, char *ip, size_t len)
     socklen_t slen;
 
     slen = sizeof(sa);
+#ifdef HAVE_ACCEPT4
+    ret = accept4 (serversock, (struct sockaddr *)&sa, &slen, SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+#else
     ret = accept(serversock, (struct sockaddr *)&sa, &slen);
+#endif
 
     if (ret != SOCK_ERROR)
     {
+#ifndef HAVE_ACCEPT4
         sock_set_cloexec (ret);
+        if (nonblocking && sock_set_blocking (ret, 0) < 0)
+        {
+            sock_close (ret);
+            return SOCK_ERROR;
+        }
+#endif
         if (ip)
         {
 #ifdef HAVE_GETNAMEINFO
@@ -1188,6 +1226,17 @@ sock_t sock_accept(sock_t serversock, char *ip, size_t len)
     return ret;
 }
 
+sock_t sock_accept (sock_t serversock, char *ip, size_t len)
+{
+    return _sock_accept (serversock, ip, len, 0);
+}
+
+/* as sock_accept but the returned socket is non-blocking */
+sock_t sock_accept_nonblocking (sock_t serversock, char *ip, size_t len)
+{
+    return _sock_accept (serversock, ip, len, 1);
+}
+
 #ifdef _WIN32
 int sock_create_pipe_emulation (SOCKET handles[2])
 {
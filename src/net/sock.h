@@ -150,10 +150,12 @@ int sock_read_pending(sock_t sock, unsigned timeout);
 sock_server_t sock_get_server_sockets (int port, const char *sinterface);
 int sock_get_next_server_socket (sock_server_t, sock_t *socket);
 void sock_free_server_sockets (sock_server_t);
+int sock_server_reuseport (sock_server_t);
 
 sock_t sock_get_server_socket(int port, const char *sinterface);
 int sock_listen(sock_t serversock, int backlog);
 sock_t sock_accept(sock_t serversock, char *ip, size_t len);
+sock_t sock_accept_nonblocking (sock_t serversock, char *ip, size_t len);
 
 #ifndef HAVE_INET_ATON
 int inet_aton(const char *s, struct in_addr *a);
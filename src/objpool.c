@@ -0,0 +1,266 @@
+/* -*- c-basic-offset: 4; -*- */
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* objpool.c
+ *
+ * Fixed size objects are kept on release, first in a cache for the releasing
+ * thread and then, when that grows past its limit, in a depot shared by all
+ * threads. A thread with an empty cache refills it from the depot. Objects are
+ * often allocated by one thread and released by another (the acceptor and a
+ * worker, a source and the last listener), the depot lets them go back round
+ * without malloc. The thread caches are held with a pthread key so they are
+ * passed to the depot when a thread exits.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "objpool.h"
+#include "logging.h"
+#include "global.h"
+
+#define CATMODULE "objpool"
+
+#define objpool_next(o)     (*(void **)(o))
+
+struct objpool_cache
+{
+    struct objpool_cache *next;
+    void *head;
+    unsigned int count;
+    uint64_t hits, misses;
+};
+
+
+/* move upto count objects from the cache to the depot, freeing any it has no room for */
+static void objpool_depot_put (objpool_t *pool, struct objpool_cache *cache, unsigned int count)
+{
+    void *head = cache->head, *tail = head;
+    unsigned int n = 1;
+
+    if (head == NULL || count == 0)
+        return;
+    while (n < count && objpool_next (tail))
+    {
+        tail = objpool_next (tail);
+        n++;
+    }
+    cache->head = objpool_next (tail);
+    cache->count -= n;
+    objpool_next (tail) = NULL;
+
+    thread_spin_lock (&pool->lock);
+    if (pool->depot_count + n <= pool->depot_limit)
+    {
+        objpool_next (tail) = pool->depot;
+        pool->depot = head;
+        pool->depot_count += n;
+        head = NULL;
+    }
+    thread_spin_unlock (&pool->lock);
+
+    while (head)
+    {
+        void *to_go = head;
+        head = objpool_next (to_go);
+        free (to_go);
+    }
+}
+
+
+/* take upto count objects from the depot into the cache */
+static void objpool_depot_get (objpool_t *pool, struct objpool_cache *cache, unsigned int count)
+{
+    void *head, *tail;
+    unsigned int n = 1;
+
+    thread_spin_lock (&pool->lock);
+    head = tail = pool->depot;
+    if (head)
+    {
+        while (n < count && objpool_next (tail))
+        {
+            tail = objpool_next (tail);
+            n++;
+        }
+        pool->depot = objpool_next (tail);
+        pool->depot_count -= n;
+    }
+    thread_spin_unlock (&pool->lock);
+
+    if (head)
+    {
+        objpool_next (tail) = cache->head;
+        cache->head = head;
+        cache->count += n;
+    }
+}
+
+
+static void objpool_cache_release (objpool_t *pool, struct objpool_cache *cache)
+{
+    struct objpool_cache **trail;
+
+    objpool_depot_put (pool, cache, cache->count);
+
+    thread_spin_lock (&pool->lock);
+    pool->hits += cache->hits;
+    pool->misses += cache->misses;
+    for (trail = &pool->caches; *trail; trail = &(*trail)->next)
+    {
+        if (*trail == cache)
+        {
+            *trail = cache->next;
+            break;
+        }
+    }
+    thread_spin_unlock (&pool->lock);
+}
+
+
+/* thread exit, the key destructor only gets the cache so it keeps the pool after it */
+struct objpool_thread_cache
+{
+    struct objpool_cache cache;
+    objpool_t *pool;
+};
+
+static void objpool_thread_exit (void *arg)
+{
+    struct objpool_thread_cache *tc = arg;
+
+    objpool_cache_release (tc->pool, &tc->cache);
+    free (tc);
+}
+
+
+static struct objpool_cache *objpool_cache_get (objpool_t *pool)
+{
+    struct objpool_thread_cache *tc;
+
+    if (pool->active == 0)
+        return NULL;
+    tc = pthread_getspecific (pool->key);
+    if (tc == NULL)
+    {
+        tc = calloc (1, sizeof (struct objpool_thread_cache));
+        if (tc == NULL)
+            abort();
+        tc->pool = pool;
+        pthread_setspecific (pool->key, tc);
+        thread_spin_lock (&pool->lock);
+        tc->cache.next = pool->caches;
+        pool->caches = &tc->cache;
+        thread_spin_unlock (&pool->lock);
+    }
+    return &tc->cache;
+}
+
+
+void objpool_initialize (objpool_t *pool, const char *name, unsigned int limit)
+{
+    memset (pool, 0, sizeof (objpool_t));
+    pool->name = name;
+    pool->limit = limit < 2 ? 2 : limit;
+    pool->depot_limit = pool->limit * 8;
+    thread_spin_create (&pool->lock);
+    if (pthread_key_create (&pool->key, objpool_thread_exit) == 0)
+        pool->active = 1;
+}
+
+
+/* only the calling thread is expected to remain */
+void objpool_shutdown (objpool_t *pool)
+{
+    struct objpool_thread_cache *tc;
+
+    if (pool->active == 0)
+        return;
+    pool->active = 0;
+    tc = pthread_getspecific (pool->key);
+    if (tc)
+    {
+        pthread_setspecific (pool->key, NULL);
+        objpool_cache_release (pool, &tc->cache);
+        free (tc);
+    }
+    pthread_key_delete (pool->key);
+    while (pool->depot)
+    {
+        void *to_go = pool->depot;
+        pool->depot = objpool_next (to_go);
+        free (to_go);
+    }
+    DEBUG3 ("%s pool, %" PRIu64 " hits, %" PRIu64 " misses", pool->name, pool->hits, pool->misses);
+    thread_spin_destroy (&pool->lock);
+}
+
+
+void *objpool_get (objpool_t *pool)
+{
+    struct objpool_cache *cache = objpool_cache_get (pool);
+    void *obj;
+
+    if (cache == NULL)
+        return NULL;
+    if (cache->head == NULL)
+        objpool_depot_get (pool, cache, pool->limit / 2);
+    obj = cache->head;
+    if (obj == NULL)
+    {
+        cache->misses++;
+        return NULL;
+    }
+    cache->head = objpool_next (obj);
+    cache->count--;
+    cache->hits++;
+    return obj;
+}
+
+
+void objpool_put (objpool_t *pool, void *obj)
+{
+    struct objpool_cache *cache;
+
+    if (obj == NULL)
+        return;
+    cache = objpool_cache_get (pool);
+    if (cache == NULL)
+    {
+        free (obj);
+        return;
+    }
+    objpool_next (obj) = cache->head;
+    cache->head = obj;
+    cache->count++;
+    if (cache->count > pool->limit)
+        objpool_depot_put (pool, cache, pool->limit / 2);
+}
+
+
+void objpool_counts (objpool_t *pool, uint64_t *hits, uint64_t *misses, uint64_t *cached)
+{
+    struct objpool_cache *cache;
+
+    if (pool->active == 0)
+        return;
+    thread_spin_lock (&pool->lock);
+    *hits += pool->hits;
+    *misses += pool->misses;
+    *cached += pool->depot_count;
+    for (cache = pool->caches; cache; cache = cache->next)
+    {
+        *hits += cache->hits;
+        *misses += cache->misses;
+        *cached += cache->count;
+    }
+    thread_spin_unlock (&pool->lock);
+}
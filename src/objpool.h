@@ -0,0 +1,47 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* objpool.h
+ *
+ * recycling of fixed size objects, cached per thread with a shared depot
+ *
+ */
+
+#ifndef __OBJPOOL_H__
+#define __OBJPOOL_H__
+
+#include "compat.h"
+#include "thread/thread.h"
+
+struct objpool_cache;
+
+typedef struct objpool
+{
+    const char *name;
+    unsigned int limit;             // objects cached per thread
+    unsigned int depot_limit;       // objects held in the depot
+    int active;
+    pthread_key_t key;
+    spin_t lock;
+    struct objpool_cache *caches;   // all thread caches, for the counters
+    uint64_t hits, misses;          // from threads now gone
+    void *depot;
+    unsigned int depot_count;
+} objpool_t;
+
+void objpool_initialize (objpool_t *pool, const char *name, unsigned int limit);
+void objpool_shutdown (objpool_t *pool);
+
+/* objects are held as released, NULL is returned when none are available so
+ * the caller allocates. Objects must be at least pointer sized and can be freed
+ * rather than put back, put frees them when the pool is not active. */
+void *objpool_get (objpool_t *pool);
+void objpool_put (objpool_t *pool, void *obj);
+
+/* add the pool counters to those passed */
+void objpool_counts (objpool_t *pool, uint64_t *hits, uint64_t *misses, uint64_t *cached);
+
+#endif  /* __OBJPOOL_H__ */
@@ -25,6 +25,7 @@
 #include <string.h>
 
 #include "refbuf.h"
+#include "objpool.h"
 
 #define CATMODULE "refbuf"
 
@@ -32,66 +33,189 @@
 #include "global.h"
 
 
+/* Blocks are a single allocation, the header followed by the payload. Requests
+ * up to the largest size class are rounded up to a class, each class having an
+ * object pool so released blocks are reused. Blocks are often allocated by the
+ * source reading but released by the last listener, so rely on the pool depot.
+ */
+#ifndef MY_ALLOC
+#define REFBUF_POOLS
+#endif
+
+#define REFBUF_CLASSES          8
+#define REFBUF_CLASS_MIN        128         // payload of the smallest class, each following one doubles
+#define REFBUF_CACHE_BYTES      (256*1024)  // rough payload held per class per thread
+
+#define refbuf_inline(r)        ((char*)((r)+1))
+
+#ifdef REFBUF_POOLS
+static objpool_t refbuf_pools [REFBUF_CLASSES];
+
+
+static int refbuf_class (unsigned int size)
+{
+    int idx = 0;
+
+    while (idx < REFBUF_CLASSES)
+    {
+        if (size <= (REFBUF_CLASS_MIN << idx))
+            return idx;
+        idx++;
+    }
+    return -1;
+}
+
+
+static unsigned int refbuf_class_limit (unsigned int idx)
+{
+    unsigned int limit = REFBUF_CACHE_BYTES / (REFBUF_CLASS_MIN << idx);
+
+    if (limit > 256) return 256;
+    if (limit < 16) return 16;
+    return limit;
+}
+#endif
+
+
+static refbuf_t *refbuf_setup (refbuf_t *refbuf, unsigned int size, unsigned int space, int idx)
+{
+    refbuf->flags = 0;
+    refbuf->_count = 1;
+    refbuf->next = NULL;
+    refbuf->associated = NULL;
+    refbuf->data = refbuf_inline (refbuf);
+    refbuf->len = size;
+    refbuf->_size = space;
+    refbuf->_pool = idx + 1;
+    refbuf->chunk_hdrlen = 0;
+    refbuf->derived = NULL;
+    return refbuf;
+}
+
+
 void refbuf_initialize(void)
 {
+#ifdef REFBUF_POOLS
+    int idx;
+
+    for (idx = 0; idx < REFBUF_CLASSES; idx++)
+        objpool_initialize (&refbuf_pools [idx], "refbuf", refbuf_class_limit (idx));
+#endif
 }
 
 void refbuf_shutdown(void)
 {
+#ifdef REFBUF_POOLS
+    int idx;
+
+    for (idx = 0; idx < REFBUF_CLASSES; idx++)
+        objpool_shutdown (&refbuf_pools [idx]);
+#endif
+}
+
+
+void refbuf_pool_counts (uint64_t *hits, uint64_t *misses, uint64_t *cached)
+{
+    *hits = *misses = *cached = 0;
+#ifdef REFBUF_POOLS
+    int idx;
+
+    for (idx = 0; idx < REFBUF_CLASSES; idx++)
+        objpool_counts (&refbuf_pools [idx], hits, misses, cached);
+#endif
 }
 
+
 #ifdef MY_ALLOC
 refbuf_t *refbuf_new_s (unsigned int size, const char *file, const int line)
 {
-    refbuf_t *refbuf;
+    refbuf_t *refbuf = (refbuf_t *)my_calloc (file, line, 1, sizeof(refbuf_t) + size);
 
-    refbuf = (refbuf_t *)my_calloc (file, line, 1, sizeof(refbuf_t));
     if (refbuf == NULL)
         abort();
-    refbuf->data = NULL;
-    if (size)
-    {
-        refbuf->data = my_calloc (file, line, 1, size);
-        if (refbuf->data == NULL)
-            abort();
-    }
-    refbuf->len = size;
-    refbuf->_count = 1;
-    refbuf->next = NULL;
-    refbuf->associated = NULL;
-
-    return refbuf;
+    return refbuf_setup (refbuf, size, size, -1);
 }
 #else
 refbuf_t *refbuf_new (unsigned int size)
 {
-    refbuf_t *refbuf;
+    refbuf_t *refbuf = NULL;
+    unsigned int space = size;
+    int idx = refbuf_class (size);
 
-    refbuf = (refbuf_t *)calloc(1, sizeof(refbuf_t));
+    if (idx >= 0)
+    {
+        space = REFBUF_CLASS_MIN << idx;
+        refbuf = objpool_get (&refbuf_pools [idx]);
+    }
     if (refbuf == NULL)
-        abort();
-    refbuf->data = NULL;
-    if (size)
     {
-        refbuf->data = malloc (size);
-        if (refbuf->data == NULL)
+        refbuf = malloc (sizeof (refbuf_t) + space);
+        if (refbuf == NULL)
             abort();
     }
-    refbuf->len = size;
-    refbuf->_count = 1;
-    refbuf->next = NULL;
-    refbuf->associated = NULL;
+    return refbuf_setup (refbuf, size, space, idx);
+}
+#endif
 
-    return refbuf;
+
+/* change the length of the payload, like realloc the content upto the new length
+ * is kept. Anything larger than the space allocated with the block goes on the heap
+ */
+void refbuf_resize (refbuf_t *refbuf, unsigned int len)
+{
+    if (refbuf->data == refbuf_inline (refbuf))
+    {
+        if (len > refbuf->_size)
+        {
+            char *p = malloc (len);
+            if (p == NULL)
+                abort();
+            memcpy (p, refbuf->data, refbuf->_size);
+            refbuf->data = p;
+        }
+    }
+    else
+    {
+        char *p = realloc (refbuf->data, len ? len : 1);
+        if (p == NULL)
+            abort();
+        refbuf->data = p;
+    }
+    refbuf->len = len;
 }
+
+
+static void refbuf_free (refbuf_t *self)
+{
+    if (self->data != refbuf_inline (self))
+        free (self->data);
+#ifdef REFBUF_POOLS
+    if (self->_pool)
+    {
+        objpool_put (&refbuf_pools [self->_pool - 1], self);
+        return;
+    }
 #endif
+    free (self);
+}
+
 
+/* counts are atomic where possible, as blocks on a source queue can be held by
+ * listeners for in-flight zerocopy sends, and released outside of the source lock
+ */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define refbuf_count_inc(r)     __atomic_add_fetch (&(r)->_count, 1, __ATOMIC_RELAXED)
+#define refbuf_count_dec(r)     __atomic_sub_fetch (&(r)->_count, 1, __ATOMIC_ACQ_REL)
+#else
+#define refbuf_count_inc(r)     (++(r)->_count)
+#define refbuf_count_dec(r)     (--(r)->_count)
+#endif
 
 void refbuf_addref(refbuf_t *self)
 {
     if (self == NULL)
         return;
-    self->_count++;
+    refbuf_count_inc (self);
 }
 
 
@@ -136,18 +260,37 @@ void refbuf_release(refbuf_t *self)
 {
     if (self == NULL)
         return;
-    self->_count--;
-    if (self->_count == 0)
+    if (refbuf_count_dec (self) == 0)
     {
         refbuf_release_associated (self->associated);
+        refbuf_release (self->derived);
         if (self->next)
             DEBUG0 ("next not null");
-        free(self->data);
-        free(self);
+        refbuf_free (self);
     }
 }
 
 
+/* attach a rendering of the refbuf data for some other output, it is released
+ * along with the refbuf
+ */
+void refbuf_add_derived (refbuf_t *refbuf, refbuf_t *derived)
+{
+    derived->derived = refbuf->derived;
+    refbuf->derived = derived;
+}
+
+
+refbuf_t *refbuf_derived (refbuf_t *refbuf, unsigned int flags)
+{
+    refbuf_t *derived = refbuf->derived;
+
+    while (derived && (derived->flags & flags) != flags)
+        derived = derived->derived;
+    return derived;
+}
+
+
 int refbuf_appendv (refbuf_t *refbuf, int max_len, const char *fmt, va_list ap)
 {
     char *buf = (char*)refbuf->data + refbuf->len;
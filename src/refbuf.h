@@ -21,6 +21,7 @@
 
 #include <stdarg.h>
 #include <sys/types.h>
+#include "compat.h"
 
 typedef struct _refbuf_tag
 {
@@ -30,6 +31,11 @@ typedef struct _refbuf_tag
     void *associated;
     char *data;
     unsigned int len;
+    unsigned int _size;     // payload space allocated after the header
+    unsigned int _pool;     // size class + 1, 0 if not pooled
+    unsigned char chunk_hdrlen;
+    char chunk_hdr [11];    // HTTP chunk header for the length, shared by chunked listeners
+    struct _refbuf_tag *derived;    // other renderings of this data, chained through their derived
 
 } refbuf_t;
 
@@ -46,6 +52,10 @@ void refbuf_addref(refbuf_t *self);
 void refbuf_release(refbuf_t *self);
 refbuf_t *refbuf_copy(refbuf_t *orig);
 refbuf_t *refbuf_copy_default (refbuf_t *orig);
+void refbuf_resize (refbuf_t *refbuf, unsigned int len);
+void refbuf_pool_counts (uint64_t *hits, uint64_t *misses, uint64_t *cached);
+void refbuf_add_derived (refbuf_t *refbuf, refbuf_t *derived);
+refbuf_t *refbuf_derived (refbuf_t *refbuf, unsigned int flags);
 
 int refbuf_appendv (refbuf_t *refbuf, int max_len, const char *fmt, va_list ap);
 int refbuf_append (refbuf_t *refbuf, int max_len, const char *fmt, ...);
@@ -57,6 +67,8 @@ int refbuf_append (refbuf_t *refbuf, int max_len, const char *fmt, ...);
 #define WRITE_BLOCK_GENERIC     01000
 #define REFBUF_SHARED           02000
 #define BUFFER_LOCAL_USE        04000
+#define REFBUF_DERIVED_ICY      010000
+#define REFBUF_DERIVED_FLV      020000
 
 #endif  /* __REFBUF_H__ */
 
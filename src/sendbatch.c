@@ -0,0 +1,292 @@
+/* -*- c-basic-offset: 4; -*- */
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* sendbatch.c
+ *
+ * Batched sends for listeners. Rather than a syscall per listener write, the
+ * data taken for each connection is held on it, with a reference on the
+ * queue block it is from rather than a copy, and the connection is queued
+ * here. Once per pass over its clients, the worker prepares a sendmsg for
+ * each over the held pieces and submits the lot with a single io_uring_enter.
+ *
+ * The data is accepted before the socket has seen it, which is the same as
+ * the socket buffer being a little larger. The completions say how much the
+ * socket took, only that is dropped from what is held and counted as sent.
+ * The rest is sent first next time. Sends are flagged MSG_DONTWAIT, so each
+ * completes within the submit call and nothing refers to the held pieces
+ * after it returns.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(HAVE_IO_URING) && defined(HAVE_ATOMIC_BUILTINS)
+#define SEND_BATCH_URING    1   // the blocks held are released outside the source lock
+#endif
+
+#ifdef SEND_BATCH_URING
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "sendbatch.h"
+#include "logging.h"
+
+#define CATMODULE "sendbatch"
+
+#ifdef SEND_BATCH_URING
+
+#define ring_load(p)        __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define ring_store(p,v)     __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+
+struct send_batch_entry
+{
+    connection_t *con;
+    struct msghdr msg;
+};
+
+struct send_batch
+{
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned int entries, queued;
+
+    struct send_batch_entry *pending;   // connections queued, by submission slot
+};
+
+
+send_batch_t *send_batch_create (unsigned int entries)
+{
+    struct io_uring_params p;
+    send_batch_t *batch;
+    void *ptr;
+    int fd;
+
+    memset (&p, 0, sizeof p);
+    fd = syscall (__NR_io_uring_setup, entries, &p);
+    if (fd < 0)
+    {
+        INFO1 ("io_uring not available (%s), sending directly", strerror (errno));
+        return NULL;
+    }
+    if ((p.features & IORING_FEAT_FAST_POLL) == 0)
+    {
+        INFO0 ("io_uring lacks socket send support, sending directly");
+        close (fd);
+        return NULL;
+    }
+    batch = calloc (1, sizeof (send_batch_t));
+    if (batch == NULL)
+        abort();
+    batch->fd = fd;
+    batch->entries = p.sq_entries;
+    batch->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    batch->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (batch->cq_ring_size > batch->sq_ring_size)
+            batch->sq_ring_size = batch->cq_ring_size;
+        batch->cq_ring_size = 0;
+    }
+    do
+    {
+        ptr = mmap (NULL, batch->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (ptr == MAP_FAILED)
+            break;
+        batch->sq_ring = ptr;
+        if (batch->cq_ring_size)
+        {
+            ptr = mmap (NULL, batch->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (ptr == MAP_FAILED)
+                break;
+        }
+        batch->cq_ring = ptr;
+        batch->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+        ptr = mmap (NULL, batch->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (ptr == MAP_FAILED)
+            break;
+        batch->sqes = ptr;
+
+        batch->sq_head  = (unsigned int *)((char *)batch->sq_ring + p.sq_off.head);
+        batch->sq_tail  = (unsigned int *)((char *)batch->sq_ring + p.sq_off.tail);
+        batch->sq_mask  = (unsigned int *)((char *)batch->sq_ring + p.sq_off.ring_mask);
+        batch->sq_array = (unsigned int *)((char *)batch->sq_ring + p.sq_off.array);
+        batch->cq_head  = (unsigned int *)((char *)batch->cq_ring + p.cq_off.head);
+        batch->cq_tail  = (unsigned int *)((char *)batch->cq_ring + p.cq_off.tail);
+        batch->cq_mask  = (unsigned int *)((char *)batch->cq_ring + p.cq_off.ring_mask);
+        batch->cqes = (struct io_uring_cqe *)((char *)batch->cq_ring + p.cq_off.cqes);
+
+        batch->pending = calloc (batch->entries, sizeof (struct send_batch_entry));
+        if (batch->pending == NULL)
+            abort();
+        return batch;
+    } while (0);
+
+    WARN1 ("unable to map io_uring (%s), sending directly", strerror (errno));
+    send_batch_destroy (batch);
+    return NULL;
+}
+
+
+void send_batch_destroy (send_batch_t *batch)
+{
+    if (batch == NULL)
+        return;
+    send_batch_flush (batch);
+    if (batch->sqes)
+        munmap (batch->sqes, batch->sqes_size);
+    if (batch->cq_ring && batch->cq_ring != batch->sq_ring)
+        munmap (batch->cq_ring, batch->cq_ring_size);
+    if (batch->sq_ring)
+        munmap (batch->sq_ring, batch->sq_ring_size);
+    close (batch->fd);
+    free (batch->pending);
+    free (batch);
+}
+
+
+/* the socket took res bytes of what is held for the connection */
+static void send_batch_complete (connection_t *con, int res)
+{
+    con->batch_queued = NULL;
+    if (res < 0)
+    {
+        if (!sock_recoverable (-res))
+            con->error = 1;
+        res = 0;
+    }
+    connection_held_sent (con, res);
+}
+
+
+/* prepare the sends for the queued connections, over the pieces they hold */
+static void send_batch_prepare (send_batch_t *batch)
+{
+    unsigned int tail = *batch->sq_tail, idx;
+
+    for (idx = 0; idx < batch->queued; idx++, tail++)
+    {
+        struct send_batch_entry *e = &batch->pending [idx];
+        unsigned int slot = tail & *batch->sq_mask;
+        struct io_uring_sqe *sqe = &batch->sqes [slot];
+
+        memset (&e->msg, 0, sizeof (e->msg));
+        e->msg.msg_iov = e->con->held->iov;
+        e->msg.msg_iovlen = e->con->held->count;
+
+        memset (sqe, 0, sizeof (*sqe));
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = e->con->sock;
+        sqe->addr = (uintptr_t)&e->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT|MSG_NOSIGNAL;
+        sqe->user_data = idx;
+        batch->sq_array [slot] = slot;
+    }
+    ring_store (batch->sq_tail, tail);
+}
+
+
+/* submit everything queued and process the results, so none of the held data
+ * is referred to by the ring on return
+ */
+void send_batch_flush (send_batch_t *batch)
+{
+    unsigned int submitted = 0, completed = 0;
+
+    if (batch == NULL || batch->queued == 0)
+        return;
+    send_batch_prepare (batch);
+    while (completed < batch->queued)
+    {
+        unsigned int head, tail;
+        int ret = syscall (__NR_io_uring_enter, batch->fd, batch->queued - submitted,
+                batch->queued - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EBUSY)
+            {
+                unsigned int idx;
+
+                // not expected, but the stream order is lost so drop those affected
+                ERROR1 ("io_uring submit failed, %s", strerror (errno));
+                ring_store (batch->sq_tail, ring_load (batch->sq_head));
+                for (idx = 0; idx < batch->queued; idx++)
+                {
+                    connection_t *con = batch->pending [idx].con;
+                    if (con == NULL) continue;
+                    con->batch_queued = NULL;
+                    con->error = 1;
+                }
+                break;
+            }
+            ret = 0;
+        }
+        submitted += ret;
+        head = *batch->cq_head;
+        tail = ring_load (batch->cq_tail);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &batch->cqes [head & *batch->cq_mask];
+            struct send_batch_entry *e = &batch->pending [cqe->user_data];
+
+            if (e->con == NULL)
+                continue;   // left from a failed submit
+            send_batch_complete (e->con, cqe->res);
+            e->con = NULL;
+            completed++;
+        }
+        ring_store (batch->cq_head, head);
+    }
+    memset (batch->pending, 0, batch->queued * sizeof (struct send_batch_entry));
+    batch->queued = 0;
+}
+
+
+/* the connection has data held to send, it goes out with the next flush */
+void send_batch_queue (send_batch_t *batch, connection_t *con)
+{
+    if (con->batch_queued || con->held == NULL)
+        return;
+    if (batch->queued == batch->entries)
+        send_batch_flush (batch);
+    batch->pending [batch->queued++].con = con;
+    con->batch_queued = batch;
+}
+
+#else
+
+send_batch_t *send_batch_create (unsigned int entries)
+{
+    INFO0 ("io_uring not built in, sending directly");
+    return NULL;
+}
+
+void send_batch_destroy (send_batch_t *batch) { }
+
+void send_batch_queue (send_batch_t *batch, connection_t *con) { }
+
+void send_batch_flush (send_batch_t *batch) { }
+
+#endif
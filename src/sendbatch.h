@@ -0,0 +1,28 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ */
+
+/* sendbatch.h
+ *
+ * batched socket sends for a worker, submitted in one go through io_uring
+ *
+ */
+
+#ifndef __SENDBATCH_H__
+#define __SENDBATCH_H__
+
+typedef struct send_batch send_batch_t;
+
+#include "connection.h"
+
+/* returns NULL if batching is not available, callers then send directly */
+send_batch_t *send_batch_create (unsigned int entries);
+void send_batch_destroy (send_batch_t *batch);
+
+/* the data held on the connection is sent on the next flush */
+void send_batch_queue (send_batch_t *batch, connection_t *con);
+void send_batch_flush (send_batch_t *batch);
+
+#endif  /* __SENDBATCH_H__ */
@@ -252,6 +252,7 @@ void slave_initialize(void)
     _slave_thread ();
     yp_stop ();
     workers_adjust(0);
+    workers_placement (NULL, NULL);
 }
 
 
@@ -649,7 +650,7 @@ static int _drop_relay (void *a)
     if (r->source)
     {
         client_t *client = r->source->client;
-        client->schedule_ms = 0;
+        client_wakeup (client);
     }
     r->flags &= ~RELAY_IN_LIST;
     DEBUG2 ("dropped relay %s (%p)", r->localmount, r);
@@ -715,13 +716,13 @@ int relay_has_source (relay_server *relay, client_t *client)
 
 static int relay_installed (relay_server *relay)
 {
-    client_t *client = calloc (1, sizeof (client_t));
+    client_t *client = client_new ();
 
     connection_init (&client->connection, SOCK_ERROR, NULL);
     switch (relay_has_source (relay, client))
     {
         case -1:
-            free (client);
+            client_free (client);
             return 0;
         case 1:
             thread_rwlock_unlock (&relay->source->lock);
@@ -1152,6 +1153,8 @@ static void slave_startup (void)
 
     redirector_setup (config);
     stats_global (config);
+    workers_placement (config->worker_cpus, config->worker_nodes);
+    workers_send_batching (config->io_uring);
     workers_adjust (config->workers_count);
     yp_initialize (config);
     update_relays (config);
@@ -1192,6 +1195,8 @@ static void _slave_thread(void)
         global_add_bitrates (global.out_bitrate, 0L, THREAD_TIME_MS(&current));
         if (do_reread)
             event_config_read ();
+        else
+            config_reclaim ();
 
         if (streamlist_check <= current.tv_sec)
         {
@@ -1234,6 +1239,7 @@ static void _slave_thread(void)
 
         stats_global_calc (current.tv_sec);
         fserve_scan (current.tv_sec);
+        connection_linger (current.tv_sec);
 
         /* allow for terminating icecast if no streams running */
         if (inactivity_timer)
@@ -1493,6 +1499,7 @@ static int relay_read (client_t *client)
             }
             else
             {
+                // the relay connection only reads, nothing is held for it
                 if (client->connection.sent_bytes < 500000 && source->flags & SOURCE_TIMEOUT)
                 {
                     WARN1 ("stream for %s timed out, skipping server for now", relay->localmount);
@@ -1740,15 +1747,11 @@ static int relay_startup (client_t *client)
         start_relay = source->listeners; // 0 or non-zero
         source->flags |= SOURCE_ON_DEMAND;
         thread_rwlock_unlock (&source->lock);
-        mountinfo = config_find_mount (config_get_config(), source->mount);
+        ice_config_t *config = config_get_config();
+        mountinfo = config_find_mount (config, source->mount);
 
-        if (mountinfo && mountinfo->fallback_mount)
-        {
-            avl_tree_rlock (global.source_tree);
-            if (fallback_count (config_get_config_unlocked(), mountinfo->fallback_mount) > 0)
-                start_relay = 1;
-            avl_tree_unlock (global.source_tree);
-        }
+        if (mountinfo && mountinfo->fallback_mount && fallback_count (config, mountinfo->fallback_mount) > 0)
+            start_relay = 1;
         config_release_config();
         if (start_relay == 0)
         {
@@ -1793,13 +1796,14 @@ int fallback_count (ice_config_t *config, const char *mount)
     if (strstr (mount, "${")) return -1;
     while (m && loop--)
     {
-        if (avl_tree_tryrlock (global.source_tree) < 0)
+        struct source_shard *shard = source_index_tryrlock (m);
+        if (shard == NULL)
             return -2;
         source_t *fallback = source_find_mount_raw (m);
         if (fallback == NULL || source_running (fallback) == 0)
         {
             unsigned int len;
-            avl_tree_unlock (global.source_tree);
+            source_index_unlock (shard);
             mount_proxy *mountinfo = config_find_mount (config, m);
             if (fallback == NULL)
             {
@@ -1828,8 +1832,8 @@ int fallback_count (ice_config_t *config, const char *mount)
             m = buffer;
             continue;
         }
-        avl_tree_unlock (global.source_tree);
         count = fallback->listeners;
+        source_index_unlock (shard);
         break;
     }
     return count;
@@ -137,6 +137,103 @@ struct _client_functions source_client_start_ops =
 };
 
 
+/* Sources are found by name through a hash index, split into shards each with
+ * their own lock. The lookups of listener connects, fallbacks and admin are
+ * then only held up by a source being added or dropped in the same shard, and
+ * not by anything else going on with the source tree, which is for walking the
+ * sources in order. The shard lock is taken before any source lock, as with
+ * the tree lock.
+ */
+#define SOURCE_INDEX_SHARDS     64
+#define SOURCE_INDEX_BUCKETS    128
+
+struct source_shard
+{
+    rwlock_t lock;
+    source_t *buckets [SOURCE_INDEX_BUCKETS];
+};
+
+static struct source_shard source_index [SOURCE_INDEX_SHARDS];
+
+#define source_index_shard(h)   (&source_index [(h) & (SOURCE_INDEX_SHARDS-1)])
+#define source_index_bucket(h)  (((h) / SOURCE_INDEX_SHARDS) & (SOURCE_INDEX_BUCKETS-1))
+
+static unsigned int source_index_hash (const char *mount)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*mount)
+        hash = (hash ^ (unsigned char)*mount++) * 16777619u;
+    return hash;
+}
+
+void source_index_initialize (void)
+{
+    int i;
+
+    memset (source_index, 0, sizeof (source_index));
+    for (i = 0; i < SOURCE_INDEX_SHARDS; i++)
+        thread_rwlock_create (&source_index[i].lock);
+}
+
+void source_index_shutdown (void)
+{
+    int i;
+
+    for (i = 0; i < SOURCE_INDEX_SHARDS; i++)
+        thread_rwlock_destroy (&source_index[i].lock);
+}
+
+/* lock the part of the index holding mount, for source_find_mount_raw */
+struct source_shard *source_index_rlock (const char *mount)
+{
+    struct source_shard *shard = source_index_shard (source_index_hash (mount));
+
+    thread_rwlock_rlock (&shard->lock);
+    return shard;
+}
+
+/* as above, but NULL if it would have to wait */
+struct source_shard *source_index_tryrlock (const char *mount)
+{
+    struct source_shard *shard = source_index_shard (source_index_hash (mount));
+
+    if (thread_rwlock_tryrlock (&shard->lock) < 0)
+        return NULL;
+    return shard;
+}
+
+void source_index_unlock (struct source_shard *shard)
+{
+    thread_rwlock_unlock (&shard->lock);
+}
+
+/* shard write lock held */
+static void source_index_add (source_t *source)
+{
+    source_t **bucket = &source_index_shard (source->hash)->buckets [source_index_bucket (source->hash)];
+
+    source->hash_next = *bucket;
+    *bucket = source;
+}
+
+/* shard write lock held */
+static void source_index_remove (source_t *source)
+{
+    source_t **p = &source_index_shard (source->hash)->buckets [source_index_bucket (source->hash)];
+
+    for (; *p; p = &(*p)->hash_next)
+    {
+        if (*p == source)
+        {
+            *p = source->hash_next;
+            source->hash_next = NULL;
+            break;
+        }
+    }
+}
+
+
 /* Allocate a new source with the stated mountpoint, if one already
  * exists with that mountpoint in the global source tree then return
  * NULL.
@@ -145,6 +242,8 @@ struct _client_functions source_client_start_ops =
 int source_reserve (const char *mount, source_t **sp, int flags)
 {
     int rc = 0;
+    unsigned int hash = source_index_hash (mount);
+    struct source_shard *shard = source_index_shard (hash);
     source_t *src;
 
     do
@@ -154,6 +253,12 @@ int source_reserve (const char *mount, source_t **sp, int flags)
             *sp = NULL;
             return 0;
         }
+        if (thread_rwlock_trywlock (&shard->lock) < 0)
+        {
+            avl_tree_unlock (global.source_tree);
+            *sp = NULL;
+            return 0;
+        }
         src = source_find_mount_raw (mount);
         if (src)
         {
@@ -172,6 +277,7 @@ int source_reserve (const char *mount, source_t **sp, int flags)
 
         /* make duplicates for strings or similar */
         src->mount = strdup (mount);
+        src->hash = hash;
         src->listener_send_trigger = 16000;
         src->format = calloc (1, sizeof(format_plugin_t));
         src->clients = avl_tree_new (client_compare, NULL);
@@ -183,6 +289,7 @@ int source_reserve (const char *mount, source_t **sp, int flags)
         src->flags |= SOURCE_RESERVED;
 
         avl_insert (global.source_tree, src);
+        source_index_add (src);
         rc = 1;
 
     } while (0);
@@ -197,6 +304,7 @@ int source_reserve (const char *mount, source_t **sp, int flags)
             rc = 0;
         }
     }
+    thread_rwlock_unlock (&shard->lock);
     avl_tree_unlock (global.source_tree);
     *sp = src;
     return rc;
@@ -204,28 +312,21 @@ int source_reserve (const char *mount, source_t **sp, int flags)
 
 
 /* Find a mount with this raw name - ignoring fallbacks. You should have the
- * global source tree locked to call this.
+ * index locked for the mount to call this.
  */
 source_t *source_find_mount_raw(const char *mount)
 {
     source_t *source;
-    avl_node *node;
-    int cmp;
+    unsigned int hash;
 
     if (!mount) {
         return NULL;
     }
-    /* get the root node */
-    node = global.source_tree->root->right;
-
-    while (node) {
-        source = (source_t *)node->key;
-        cmp = strcmp (mount, source->mount);
-        if (cmp < 0)
-            node = node->left;
-        else if (cmp > 0)
-            node = node->right;
-        else
+    hash = source_index_hash (mount);
+    source = source_index_shard (hash)->buckets [source_index_bucket (hash)];
+    for (; source; source = source->hash_next)
+    {
+        if (source->hash == hash && strcmp (mount, source->mount) == 0)
             return source;
     }
 
@@ -234,51 +335,121 @@ source_t *source_find_mount_raw(const char *mount)
 }
 
 
-/* Search for mount, if the mount is there but not currently running then
- * check the fallback, and so on.  Must have a global source lock to call
- * this function.
+int source_compare_sources(void *arg, void *a, void *b)
+{
+    source_t *srca = (source_t *)a;
+    source_t *srcb = (source_t *)b;
+
+    return strcmp(srca->mount, srcb->mount);
+}
+
+
+/* The blocks on the stream queue are also held in a ring by their position in
+ * the stream, along with a second ring of the sync points. Positions are totals
+ * of the block lengths, so the distance from a block to the end is the lag a
+ * listener starting there would have. Burst and minimum queue points are then
+ * found by binary search rather than walking the list.
  */
-source_t *source_find_mount (const char *mount)
+#define QUEUE_INDEX_INITIAL     1024
+
+#define queue_index_block(q,s)  (&(q)->blocks [(s) & (q)->mask])
+#define queue_index_sync(q,i)   ((q)->syncs [(i) & (q)->mask])
+
+static void queue_index_grow (struct source_queue_index *q)
+{
+    unsigned int size = q->blocks ? (q->mask + 1) << 1 : QUEUE_INDEX_INITIAL;
+    struct queue_index_entry *blocks = calloc (size, sizeof (struct queue_index_entry));
+    uint64_t *syncs = calloc (size, sizeof (uint64_t)), i;
+
+    if (blocks == NULL || syncs == NULL)
+        abort();
+    for (i = q->first; i < q->next; i++)
+        blocks [i & (size-1)] = *queue_index_block (q, i);
+    for (i = q->sync_first; i < q->sync_next; i++)
+        syncs [i & (size-1)] = queue_index_sync (q, i);
+    free (q->blocks);
+    free (q->syncs);
+    q->blocks = blocks;
+    q->syncs = syncs;
+    q->mask = size - 1;
+}
+
+
+static void queue_index_add (struct source_queue_index *q, refbuf_t *r)
 {
-    source_t *source = NULL;
-    ice_config_t *config;
-    mount_proxy *mountinfo;
-    int depth = 0;
+    uint64_t seq = q->next;
+    struct queue_index_entry *e;
 
-    config = config_get_config();
-    while (mount && depth < MAX_FALLBACK_DEPTH)
+    if (q->blocks == NULL || seq - q->first > q->mask)
+        queue_index_grow (q);
+    e = queue_index_block (q, seq);
+    e->pos = q->end;
+    e->block = r;
+    if (r->flags & SOURCE_BLOCK_RESYNC)
     {
-        source = source_find_mount_raw (mount);
+        // look back for those marked since the last known sync point
+        uint64_t i = q->first;
 
-        if (source)
-        {
-            if (source_available (source))
-                break;
-        }
+        if (q->sync_next > q->sync_first)
+            i = queue_index_sync (q, q->sync_next - 1) + 1;
+        for (; i < seq; i++)
+            if (queue_index_block (q, i)->block->flags & SOURCE_BLOCK_SYNC)
+                queue_index_sync (q, q->sync_next++) = i;
+    }
+    if (r->flags & SOURCE_BLOCK_SYNC)
+        queue_index_sync (q, q->sync_next++) = seq;
+    q->next = seq + 1;
+    q->end += r->len;
+}
 
-        /* we either have a source which is not active (relay) or no source
-         * at all. Check the mounts list for fallback settings
-         */
-        mountinfo = config_find_mount (config, mount);
-        source = NULL;
 
-        if (mountinfo == NULL)
-            break;
-        mount = mountinfo->fallback_mount;
-        depth++;
+/* drop the oldest block */
+static void queue_index_remove (struct source_queue_index *q)
+{
+    q->first++;
+    while (q->sync_first < q->sync_next && queue_index_sync (q, q->sync_first) < q->first)
+        q->sync_first++;
+}
+
+
+/* position in the sync ring of the first sync point at or after pos */
+static uint64_t queue_index_search (struct source_queue_index *q, uint64_t pos)
+{
+    uint64_t lo = q->sync_first, hi = q->sync_next;
+
+    while (lo < hi)
+    {
+        uint64_t mid = lo + ((hi - lo) >> 1);
+        if (queue_index_block (q, queue_index_sync (q, mid))->pos < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    config_release_config();
-    return source;
+
+/* block sequence number of the first sync point at or after pos, next if none */
+static uint64_t queue_index_sync_after (struct source_queue_index *q, uint64_t pos)
+{
+    uint64_t i = queue_index_search (q, pos);
+    return i < q->sync_next ? queue_index_sync (q, i) : q->next;
 }
 
 
-int source_compare_sources(void *arg, void *a, void *b)
+/* block sequence number of the last sync point before pos, next if none */
+static uint64_t queue_index_sync_before (struct source_queue_index *q, uint64_t pos)
 {
-    source_t *srca = (source_t *)a;
-    source_t *srcb = (source_t *)b;
+    uint64_t i = queue_index_search (q, pos);
+    return i > q->sync_first ? queue_index_sync (q, i - 1) : q->next;
+}
 
-    return strcmp(srca->mount, srcb->mount);
+
+static void queue_index_free (struct source_queue_index *q)
+{
+    free (q->blocks);
+    free (q->syncs);
+    memset (q, 0, sizeof (*q));
 }
 
 
@@ -305,6 +476,7 @@ void source_clear_source (source_t *source)
     }
     source->min_queue_point = NULL;
     source->stream_data_tail = NULL;
+    queue_index_free (&source->queue_index);
 
     source->min_queue_size = 0;
     source->min_queue_offset = 0;
@@ -371,8 +543,13 @@ static void drop_source_from_tree (source_t *source)
 {
     if (source->flags & SOURCE_RESERVED)
     {
+        struct source_shard *shard = source_index_shard (source->hash);
+
         avl_tree_wlock (global.source_tree);
+        thread_rwlock_wlock (&shard->lock);
         avl_delete (global.source_tree, source, NULL);
+        source_index_remove (source);
+        thread_rwlock_unlock (&shard->lock);
 
         source->flags &= ~SOURCE_RESERVED;
         // this is only called from the sources client processing
@@ -551,6 +728,8 @@ void source_add_queue_buffer (source_t *source, refbuf_t *r)
     source->bytes_read_since_update += r->len;
 
     r->flags |= SOURCE_QUEUE_BLOCK;
+    if (source->format->flags & FORMAT_FL_ALLOW_HTTPCHUNKED)
+        r->chunk_hdrlen = connection_chunk_header (r->chunk_hdr, r->len);
 
     /* append buffer to the in-flight data queue,  */
     if (source->stream_data == NULL)
@@ -575,7 +754,7 @@ void source_add_queue_buffer (source_t *source, refbuf_t *r)
 
     source->stream_data_tail = r;
     source->queue_size += r->len;
-    source->wakeup = 1;
+    queue_index_add (&source->queue_index, r);
 
     /* move the starting point for new listeners */
     source->min_queue_offset += r->len;
@@ -615,7 +794,6 @@ int source_read (source_t *source)
     global_unlock();
     do
     {
-        source->wakeup = 0;
         client->schedule_ms = client->worker->time_ms;
         if (source->flags & SOURCE_LISTENERS_SYNC)
         {
@@ -715,26 +893,25 @@ int source_read (source_t *source)
 
         if (source->queue_size != prev_qsize)
         {
-            uint64_t sync_off = source->min_queue_offset, off = sync_off;
-            refbuf_t *sync_point = source->min_queue_point, *ref = sync_point;
-            while (off > source->min_queue_size)
+            // move the minimum queue point up to the latest sync point still beyond the
+            // minimum queue size, never the last block
+            struct source_queue_index *q = &source->queue_index;
+            uint64_t limit = q->end - source->stream_data_tail->len;
+
+            if (q->end < source->min_queue_size)
+                limit = 0;
+            else if (q->end - source->min_queue_size < limit)
+                limit = q->end - source->min_queue_size;
+            uint64_t seq = queue_index_sync_before (q, limit);
+            if (seq < q->next)
             {
-                refbuf_t *to_release = ref;
-                if (to_release && to_release->next)
+                struct queue_index_entry *e = queue_index_block (q, seq);
+                if (q->end - e->pos < source->min_queue_offset)
                 {
-                    if (to_release->flags & SOURCE_BLOCK_SYNC)
-                    {
-                        sync_off = off;
-                        sync_point = ref;
-                    }
-                    off -= to_release->len;
-                    ref = to_release->next;
-                    continue;
+                    source->min_queue_offset = q->end - e->pos;
+                    source->min_queue_point = e->block;
                 }
-                break;
             }
-            source->min_queue_offset = sync_off;
-            source->min_queue_point = sync_point;
             source->skip_duration = (long)(source->skip_duration * 0.9);
         }
 
@@ -766,6 +943,7 @@ int source_read (source_t *source)
                 source->min_queue_point = to_go->next;
             }
             to_go->next = NULL;
+            queue_index_remove (&source->queue_index);
             if (source->format->detach_queue_block)
                 source->format->detach_queue_block (source, to_go);
             refbuf_release (to_go);
@@ -790,13 +968,7 @@ void source_listeners_wakeup (source_t *source)
         client_t *client = (client_t *)node->key;
         if (s->schedule_ms + 100 < client->schedule_ms)
             DEBUG2 ("listener on %s was ahead by %ld", source->mount, (long)(client->schedule_ms - s->schedule_ms));
-        worker_t *w = client->worker;
-        if (s->worker != w)
-        {
-            thread_spin_lock (&w->lock);
-            client->schedule_ms = 0;
-            thread_spin_unlock (&w->lock);
-        }
+        client_wakeup (client);
         node = avl_get_next (node);
     }
     thread_rwlock_unlock (&workers_lock);
@@ -918,6 +1090,7 @@ static int source_queue_advance (client_t *client)
     source_t *source = client->shared_data;
     refbuf_t *refbuf;
     uint64_t lag;
+    int ms;
 
     if (client->refbuf == NULL && locate_start_on_queue (source, client) < 0)
         return -1;
@@ -929,10 +1102,13 @@ static int source_queue_advance (client_t *client)
     if (lag == 0)
     {
         client->schedule_ms += 5 + ((source->incoming_adj>>1));
-        client->wakeup = &source->wakeup; // allow for quick wakeup
         return -1;
     }
-    client->wakeup = NULL;
+    if ((ms = connection_zerocopy_wait (&client->connection, lag, source->incoming_rate)))
+    {
+        client->schedule_ms += ms;
+        return -1;
+    }
     if (lag > source->queue_size || (lag == source->queue_size && client->pos))
     {
         INFO4 ("Client %" PRIu64 " (%s) has fallen too far behind (%"PRIu64") on %s, removing",
@@ -983,7 +1159,11 @@ static int source_queue_advance (client_t *client)
         int ret = 0;
 
         if (client->pos < refbuf->len)
+        {
+            client->connection.shared_block = refbuf;  // so sends from it can hold a reference
             ret = source->format->write_buf_to_client (client);
+            client->connection.shared_block = NULL;
+        }
         if (ret > 0)
             written += ret;
         if (client->pos >= refbuf->len)
@@ -1005,8 +1185,10 @@ static int source_queue_advance (client_t *client)
 
 static int locate_start_on_queue (source_t *source, client_t *client)
 {
+    struct source_queue_index *q = &source->queue_index;
+    struct queue_index_entry *e;
     refbuf_t *refbuf;
-    long lag = 0;
+    uint64_t start, seq, sent;
 
     /* we only want to attempt a burst at connection time, not midstream
      * however streams like theora may not have the most recent page marked as
@@ -1014,13 +1196,10 @@ static int locate_start_on_queue (source_t *source, client_t *client)
     if (client->connection.error || source->stream_data_tail == NULL)
         return -1;
     refbuf = source->stream_data_tail;
-    if (client->connection.sent_bytes > source->min_queue_offset && (refbuf->flags & SOURCE_BLOCK_SYNC))
-    {
-        lag = refbuf->len;
-    }
-    else
+    start = q->end - refbuf->len;
+    sent = connection_bytes_taken (&client->connection);
+    if (sent <= source->min_queue_offset || (refbuf->flags & SOURCE_BLOCK_SYNC) == 0)
     {
-        size_t size = source->min_queue_size;
         uint32_t v = -1;
         const char *param = httpp_getvar (client->parser, "initial-burst");
 
@@ -1040,41 +1219,28 @@ static int locate_start_on_queue (source_t *source, client_t *client)
         else
             v = source->default_burst_size;
 
-        if (v > client->connection.sent_bytes)
+        if (v > sent)
         {
-            v -= client->connection.sent_bytes; /* have we sent data already */
-            refbuf = source->min_queue_point;
-            lag = source->min_queue_offset;
-            // DEBUG3 ("size %lld, v %lld, lag %ld", size, v, lag);
-            while (size > v && refbuf && refbuf->next)
-            {
-                size -= refbuf->len;
-                lag -= refbuf->len;
-                refbuf = refbuf->next;
-            }
-            if (lag < 0)
-                ERROR1 ("Odd, lag is negative %ld", lag);
+            uint64_t min_point = q->end - source->min_queue_offset;
+
+            v -= sent; /* have we sent data already */
+            start = (v < q->end && q->end - v > min_point) ? q->end - v : min_point;
         }
-        else
-            lag = refbuf->len;
     }
 
-    while (refbuf)
+    seq = queue_index_sync_after (q, start);
+    if (seq < q->next)
     {
-        if (refbuf->flags & SOURCE_BLOCK_SYNC)
-        {
-            client_set_queue (client, NULL);
-            client->refbuf = refbuf;
-            client->intro_offset = -1;
-            client->pos = 0;
-            client->counter = 0;
-            client->queue_pos = source->client->queue_pos - lag;
-            client->flags &= ~CLIENT_HAS_INTRO_CONTENT;
-            DEBUG4 ("%s Joining queue on %s (%"PRIu64 ", %"PRIu64 ")", &client->connection.ip[0], source->mount, source->client->queue_pos, client->queue_pos);
-            return 0;
-        }
-        lag -= refbuf->len;
-        refbuf = refbuf->next;
+        e = queue_index_block (q, seq);
+        client_set_queue (client, NULL);
+        client->refbuf = e->block;
+        client->intro_offset = -1;
+        client->pos = 0;
+        client->counter = 0;
+        client->queue_pos = source->client->queue_pos - (q->end - e->pos);
+        client->flags &= ~CLIENT_HAS_INTRO_CONTENT;
+        DEBUG4 ("%s Joining queue on %s (%"PRIu64 ", %"PRIu64 ")", &client->connection.ip[0], source->mount, source->client->queue_pos, client->queue_pos);
+        return 0;
     }
     client->schedule_ms += 150;
     return -1;
@@ -1131,8 +1297,9 @@ static int http_source_introfile (client_t *client)
     if (client->timer_start == 0)
     {
         long to_send = 0;
-        if (client->connection.sent_bytes < source->default_burst_size)
-            to_send = source->default_burst_size - client->connection.sent_bytes;
+        uint64_t sent = connection_bytes_taken (&client->connection);
+        if (sent < source->default_burst_size)
+            to_send = source->default_burst_size - sent;
         duration = (long)((float)to_send / rate);
         client->aux_data = duration + 8;
         client->timer_start = client->worker->current_time.tv_sec - client->aux_data;
@@ -1253,7 +1420,6 @@ static int http_source_listener (client_t *client)
 // detach client from the source, enter with lock (probably read) and exit with write lock.
 void source_listener_detach (source_t *source, client_t *client)
 {
-    client->wakeup = NULL;
     if (client->check_buffer != http_source_listener) // not in http headers
     {
         refbuf_t *ref = client->refbuf;
@@ -1439,7 +1605,7 @@ static int send_listener (source_t *source, client_t *client)
     /* check for limited listener time */
     if (client->flags & CLIENT_RANGE_END)
     {
-        if (client->connection.discon.offset <= client->connection.sent_bytes)
+        if (client->connection.discon.offset <= connection_bytes_taken (&client->connection))
             return -1;
     }
     else if (client->connection.discon.time && now >= client->connection.discon.time)
@@ -1483,6 +1649,9 @@ static int send_listener (source_t *source, client_t *client)
     }
     // set between 1 and 25
     client->throttle = source->incoming_adj > 25 ? 25 : (source->incoming_adj > 0 ? source->incoming_adj : 1);
+    // zerocopy connections gather their own sends instead
+    if (plain_send_connection (&client->connection) && client->connection.zc == NULL)
+        client->connection.send_batch = worker->send_batch;
     while (1)
     {
         /* lets not send too much to one client in one go, but don't
@@ -1507,6 +1676,9 @@ static int send_listener (source_t *source, client_t *client)
         total_written += bytes;
         loop--;
     }
+    if (client->connection.held && client->connection.send_batch == NULL)
+        connection_send_held (&client->connection);     // what was gathered but is short of a zerocopy send
+    client->connection.send_batch = NULL;
     if (total_written)
     {
         rate_add_sum (source->out_bitrate, total_written, worker->time_ms, &source->format->sent_bytes);
@@ -1641,30 +1813,29 @@ static int source_set_override (mount_proxy *mountinfo, source_t *dest_source, f
     config_mount_ref (mountinfo, 1);
     config_release_config ();
     INFO2 ("for %s set to %s", dest_source->mount, mountinfo->fallback_mount);
-    avl_tree_rlock (global.source_tree);
     while (loop--)
     {
+        struct source_shard *shard;
+
         len = sizeof buffer;
         if (util_expand_pattern (mount, mountinfo->fallback_mount, buffer, &len) < 0)
-        {
-            avl_tree_unlock (global.source_tree);
             break;
-        }
         mount = buffer;
 
         DEBUG2 ("checking for %s on %s", mount, dest);
+        shard = source_index_rlock (mount);
         source = source_find_mount_raw (mount);
         if (source)
         {
             if (strcmp (source->mount, dest) == 0) // back where we started, drop out
             {
-                avl_tree_unlock (global.source_tree);
+                source_index_unlock (shard);
                 break;
             }
             thread_rwlock_wlock (&source->lock);
+            source_index_unlock (shard);
             if (source_running (source))
             {
-                avl_tree_unlock (global.source_tree);
                 if (source->format->type == type)
                 {
                     if (source->listeners && source->fallback.mount == NULL)
@@ -1687,12 +1858,13 @@ static int source_set_override (mount_proxy *mountinfo, source_t *dest_source, f
             }
             thread_rwlock_unlock (&source->lock);
         }
+        else
+            source_index_unlock (shard);
         mount_proxy *m = config_lock_mount (NULL, mount);
         config_release_mount (mountinfo);
         mountinfo = m;
         if (mountinfo == NULL || mountinfo->fallback_mount == NULL || mountinfo->fallback_override == 0)
         {
-            avl_tree_unlock (global.source_tree);
             if (mount)
                 ret = fserve_set_override (mount, dest, type);
             break;
@@ -1890,12 +2062,13 @@ static int compare_intro_ipcache (void *arg, void *a, void *b)
 
 int source_apply_preroll (mount_proxy *mountinfo, source_t *source)
 {
+    ice_config_t *config = config_get_config ();    // nested, as the caller has it
+
     do
     {
         if (mountinfo == NULL || mountinfo->preroll_log.name == NULL)
             break;
 
-        ice_config_t *config = config_get_config_unlocked ();
         struct error_log *preroll = &mountinfo->preroll_log;
         unsigned int len = 4096;
         int ret;
@@ -1921,9 +2094,11 @@ int source_apply_preroll (mount_proxy *mountinfo, source_t *source)
         log_set_archive_timestamp (source->preroll_log_id, archive);
         //DEBUG4 ("log %s, size %ld, duration %u, archive %d", preroll->name, max_size, preroll->duration, archive);
         log_reopen (source->preroll_log_id);
+        config_release_config ();
         return 0;
     } while (0);
 
+    config_release_config ();
     log_close (source->preroll_log_id);
     source->preroll_log_id = -1;
     return -1;
@@ -2348,9 +2523,10 @@ static void source_run_script (char *command, char *mountpoint)
 //
 static int _get_source_listeners (const char *mount)
 {
+    struct source_shard *shard = source_index_tryrlock (mount);
     int rc = -2;
 
-    if (avl_tree_tryrlock (global.source_tree) == 0)
+    if (shard)
     {
         source_t *source = source_find_mount_raw (mount);
         if (source == NULL)
@@ -2363,7 +2539,7 @@ static int _get_source_listeners (const char *mount)
                 rc = -1;
             thread_rwlock_unlock (&source->lock);
         }
-        avl_tree_unlock (global.source_tree);
+        source_index_unlock (shard);
     }
     return rc;
 }
@@ -2604,6 +2780,7 @@ int source_add_listener (const char *mount, mount_proxy *mountinfo, client_t *cl
         int64_t stream_bitrate = 0;
         int flags = 0;
         char buffer[4096];
+        struct source_shard *shard;
 
         do
         {
@@ -2614,7 +2791,7 @@ int source_add_listener (const char *mount, mount_proxy *mountinfo, client_t *cl
                     config_release_mount (minfo);
                 return client_send_403 (client, "Fallback through too many mountpoints");
             }
-            avl_tree_rlock (global.source_tree);
+            shard = source_index_rlock (mount);
             source = source_find_mount_raw (mount);
             if (source)
             {
@@ -2623,7 +2800,7 @@ int source_add_listener (const char *mount, mount_proxy *mountinfo, client_t *cl
                     break;
                 thread_rwlock_unlock (&source->lock);
             }
-            avl_tree_unlock (global.source_tree);
+            source_index_unlock (shard);
             if (minfo && minfo->limit_rate)
                 rate = minfo->limit_rate/8;
             if (minfo == NULL || minfo->fallback_mount == NULL)
@@ -2666,7 +2843,7 @@ int source_add_listener (const char *mount, mount_proxy *mountinfo, client_t *cl
         } while (1);
 
         /* ok, we found a source and it is locked */
-        avl_tree_unlock (global.source_tree);
+        source_index_unlock (shard);
 
         if (client->flags & CLIENT_IS_SLAVE)
         {
@@ -2871,7 +3048,7 @@ void source_setup_listener (source_t *source, client_t *client)
     client->mount = source->mount;
     client->flags &= ~CLIENT_IN_FSERVE;
 
-    if (client->connection.sent_bytes > 0)
+    if (connection_bytes_taken (&client->connection) > 0)
         client->check_buffer = http_source_introfile; // may need incomplete data sending
     else
         client->check_buffer = http_source_listener; // special case for headers
@@ -2887,11 +3064,7 @@ void source_setup_listener (source_t *source, client_t *client)
         worker_t *worker = source->client->worker;
         client->schedule_ms += (worker == client->worker) ? 5 : 300;
 
-        thread_spin_lock (&worker->lock);
-        source->client->schedule_ms = 0;
-        thread_spin_unlock (&worker->lock);
-
-        worker_wakeup (worker);
+        client_wakeup (source->client);
         DEBUG1 ("woke up relay on %s", source->mount);
     }
 }
@@ -2979,7 +3152,6 @@ static void source_swap_client (source_t *source, client_t *client)
     client->shared_data = source;
     source->client = client;
 
-    old_client->schedule_ms = client->worker->time_ms;
     old_client->shared_data = NULL;
     old_client->flags &= ~CLIENT_AUTHENTICATED;
     old_client->connection.sent_bytes = source->format->read_bytes;
@@ -2990,7 +3162,7 @@ static void source_swap_client (source_t *source, client_t *client)
     if (source->format->swap_client)
         source->format->swap_client (client, old_client);
 
-    worker_wakeup (old_client->worker);
+    client_wakeup (old_client);
 }
 
 
@@ -3164,11 +3336,21 @@ int listener_change_worker (client_t *client, source_t *source)
         locked = 1;
         dest_worker = source->client->worker;
         if (this_worker == dest_worker)
-            dest_worker = worker_selected ();
+            dest_worker = worker_selected_near (this_worker);
 
         if (dest_worker && this_worker != dest_worker)
         {
             int move = 0;
+
+            if (dest_worker->load > this_worker->load + WORKER_LOAD_SLACK && is_worker_incoming (this_worker) == 0)
+            {
+                // source worker is already busier than this one, but one on the same node still helps
+                dest_worker = dest_worker->least_near;
+                if (dest_worker == NULL || dest_worker == this_worker || dest_worker->node == this_worker->node)
+                    break;
+                if (dest_worker->load > this_worker->load + WORKER_LOAD_SLACK)
+                    break;
+            }
             int adj = ((client->connection.id & 7) << 6) + 100;
 
             thread_spin_lock (&dest_worker->lock);
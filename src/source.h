@@ -23,12 +23,30 @@
 
 #include <stdio.h>
 
+/* blocks on the stream queue by their position in the stream, see source.c */
+struct queue_index_entry
+{
+    uint64_t pos;
+    refbuf_t *block;
+};
+
+struct source_queue_index
+{
+    struct queue_index_entry *blocks;   // ring, by block sequence number
+    uint64_t *syncs;                    // ring, sequence numbers of the sync points
+    uint64_t first, next;               // range of block sequence numbers held
+    uint64_t sync_first, sync_next;
+    uint64_t end;                       // stream position after the last block
+    unsigned int mask;
+};
+
 typedef struct source_tag
 {
     char *mount;
     unsigned int flags;
+    unsigned int hash;              // of the mount, for the index
+    struct source_tag *hash_next;   // chain in the index bucket
     int listener_send_trigger;
-    char wakeup;
 
     rwlock_t lock;
 
@@ -95,6 +113,7 @@ typedef struct source_tag
 
     refbuf_t *stream_data;
     refbuf_t *stream_data_tail;
+    struct source_queue_index queue_index;
 
     util_dict *audio_info;
 
@@ -119,8 +138,12 @@ int  source_startup (client_t *client, const char *uri);
 void source_update_settings (ice_config_t *config, source_t *source, mount_proxy *mountinfo);
 void source_clear_listeners (source_t *source);
 void source_clear_source (source_t *source);
-source_t *source_find_mount(const char *mount);
 source_t *source_find_mount_raw(const char *mount);
+void source_index_initialize (void);
+void source_index_shutdown (void);
+struct source_shard *source_index_rlock (const char *mount);
+struct source_shard *source_index_tryrlock (const char *mount);
+void source_index_unlock (struct source_shard *shard);
 client_t *source_find_client(source_t *source, uint64_t id);
 int source_compare_sources(void *arg, void *a, void *b);
 void source_free_source(source_t *source);
@@ -139,6 +162,7 @@ void source_listeners_wakeup (source_t *source);
 int check_duplicate_logins (const char *mount, avl_tree *tree, client_t *client, auth_t *auth);
 
 #define SOURCE_BLOCK_SYNC           01
+#define SOURCE_BLOCK_RESYNC         02      // an earlier block has since been marked as sync
 #define SOURCE_QUEUE_BLOCK          REFBUF_SHARED
 
 #endif
@@ -208,7 +208,7 @@ void stats_clients_wakeup (void)
     {
         client_t *client = listener->client;
         if (client)
-            client->schedule_ms = 0;
+            client_wakeup (client);
         listener = listener->next;
     }
     thread_mutex_unlock (&_stats.listeners_lock);
@@ -935,7 +935,6 @@ static void _register_listener (client_t *client)
 {
     event_listener_t *listener = client->shared_data;
     avl_node *node;
-    worker_t *worker = client->worker;
     stats_event_t stats_count;
     refbuf_t *refbuf, *biglist = NULL, **full_p = &biglist, *last = NULL;
     size_t size = 8192, len = 0;
@@ -1075,9 +1074,8 @@ static void _register_listener (client_t *client)
     listener->recent_block = last;
     thread_mutex_unlock (&_stats.listeners_lock);
 
-    client->schedule_ms = 0;
     client->flags |= CLIENT_ACTIVE;
-    worker_wakeup (worker);
+    client_wakeup (client);
 }
 
 
@@ -1171,22 +1169,23 @@ xmlDocPtr stats_get_xml (int flags, const char *show_mount)
     if (show_mount && node)
     {
 		source_t *source;
+        struct source_shard *shard;
         /* show each listener */
-        avl_tree_rlock (global.source_tree);
+        shard = source_index_rlock (show_mount);
         source = source_find_mount_raw (show_mount);
 
         if (source)
         {
             thread_rwlock_rlock (&source->lock);
+            source_index_unlock (shard);
             admin_source_listeners (source, node);
             thread_rwlock_unlock (&source->lock);
-            avl_tree_unlock (global.source_tree);
         }
         else
         {
             fbinfo finfo;
 
-            avl_tree_unlock (global.source_tree);
+            source_index_unlock (shard);
             finfo.flags = FS_FALLBACK;
             finfo.mount = (char*)show_mount;
             finfo.limit = 0;
@@ -1331,6 +1330,19 @@ void stats_purge (time_t mark)
 }
 
 
+static void stats_pool_event (const char *pool, uint64_t hits, uint64_t misses, uint64_t cached)
+{
+    char name [40];
+
+    snprintf (name, sizeof name, "%s_pool_hits", pool);
+    stats_event_args (NULL, name, "%" PRIu64, hits);
+    snprintf (name, sizeof name, "%s_pool_misses", pool);
+    stats_event_args (NULL, name, "%" PRIu64, misses);
+    snprintf (name, sizeof name, "%s_pool_cached", pool);
+    stats_event_args (NULL, name, "%" PRIu64, cached);
+}
+
+
 void stats_global_calc (time_t now)
 {
     stats_event_t clients, listeners;
@@ -1338,6 +1350,7 @@ void stats_global_calc (time_t now)
     char buf1 [VAL_BUFSIZE];
     char buf2 [VAL_BUFSIZE];
     char buf3 [VAL_BUFSIZE];
+    uint64_t pool_hits, pool_misses, pool_cached;
 
     global_lock();
     connection_stats ();
@@ -1348,6 +1361,13 @@ void stats_global_calc (time_t now)
             (int64_t)global_getrate_avg (global.out_bitrate) * 8 / 1024);
     global_unlock();
 
+    refbuf_pool_counts (&pool_hits, &pool_misses, &pool_cached);
+    stats_pool_event ("refbuf", pool_hits, pool_misses, pool_cached);
+    client_pool_counts (0, &pool_hits, &pool_misses, &pool_cached);
+    stats_pool_event ("client", pool_hits, pool_misses, pool_cached);
+    client_pool_counts (1, &pool_hits, &pool_misses, &pool_cached);
+    stats_pool_event ("parser", pool_hits, pool_misses, pool_cached);
+
     build_event (&clients, NULL, "clients", buf1);
     clients.flags |= STATS_COUNTERS;
     process_event (&clients);
@@ -65,6 +65,28 @@ uint64_t timing_get_time(void)
 }
 
 
+/*
+ * Returns microseconds, for measuring short intervals.
+ */
+uint64_t timing_get_time_us(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+    struct timeval mtv;
+
+    gettimeofday(&mtv, NULL);
+
+    return (uint64_t)(mtv.tv_sec) * 1000000 + (uint64_t)(mtv.tv_usec);
+#elif HAVE_FTIME
+    struct timeb t;
+
+    ftime(&t);
+    return t.time * (uint64_t)1000000 + t.millitm * 1000;
+#else
+#error need time query handler
+#endif
+}
+
+
 void timing_sleep(uint64_t sleeptime)
 {
 #ifdef WIN32
@@ -23,10 +23,12 @@ typedef unsigned __int64 uint64_t;
 /* config.h should be included before we are to define _mangle */
 #ifdef _mangle
 # define timing_get_time _mangle(timing_get_time)
+# define timing_get_time_us _mangle(timing_get_time_us)
 # define timing_sleep _mangle(timing_sleep)
 #endif
 
 uint64_t timing_get_time(void);
+uint64_t timing_get_time_us(void);
 void timing_sleep(uint64_t sleeptime);
 
 #endif  /* __TIMING_H__ */
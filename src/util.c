@@ -39,6 +39,9 @@
 #ifdef HAVE_FNMATCH_H
 #include <fnmatch.h>
 #endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 
 #include "net/sock.h"
 #include "thread/thread.h"
@@ -263,7 +266,7 @@ char *util_get_path_from_normalised_uri(const char *uri, int use_admin)
 {
     char *fullpath;
     char *root;
-    ice_config_t *config = config_get_config_unlocked();
+    ice_config_t *config = config_get_config();   // the snapshot already held
 
     if (use_admin)
         root = config->adminroot_dir;
@@ -273,6 +276,7 @@ char *util_get_path_from_normalised_uri(const char *uri, int use_admin)
     fullpath = malloc(strlen(uri) + strlen(root) + 1);
     if (fullpath)
         sprintf (fullpath, "%s%s", root, uri);
+    config_release_config();
 
     return fullpath;
 }
@@ -1286,3 +1290,125 @@ int util_expand_pattern (const char *mount, const char *pattern, char *buf, unsi
    return 0;
 }
 
+
+
+/* parse a list of cpu numbers and ranges eg "0-3,8,10-11" into cpus, returning
+ * the number stored. Parsing stops at the first thing not understood
+ */
+int util_cpulist_parse (const char *list, int *cpus, int max)
+{
+    int count = 0;
+
+    while (list && *list && count < max)
+    {
+        char *end;
+        long first = strtol (list, &end, 10), last;
+
+        if (end == list || first < 0)
+            break;
+        last = first;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol (list, &end, 10);
+            if (end == list || last < first)
+                break;
+        }
+        for (; first <= last && count < max; first++)
+            cpus [count++] = (int)first;
+        list = end + strspn (end, ", \t\r\n");
+    }
+    return count;
+}
+
+
+/* the cpus on a NUMA node as reported by sysfs, 0 if unknown */
+int util_node_cpus (int node, int *cpus, int max)
+{
+    char path [80], line [MAX_LINE_LEN];
+    int count = 0;
+    FILE *f;
+
+    snprintf (path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen (path, "r");
+    if (f == NULL)
+        return 0;
+    if (get_line (f, line, sizeof line))
+        count = util_cpulist_parse (line, cpus, max);
+    fclose (f);
+    return count;
+}
+
+
+/* the NUMA node a cpu belongs to, or -1 if unknown */
+int util_cpu_node (int cpu)
+{
+    char path [80];
+    int node;
+
+    for (node = 0; node < 1024; node++)
+    {
+        snprintf (path, sizeof path, "/sys/devices/system/node/node%d", node);
+        if (access (path, F_OK) < 0)
+            break;
+        snprintf (path, sizeof path, "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access (path, F_OK) == 0)
+            return node;
+    }
+    return -1;
+}
+
+
+/* work out where the index'th thread of a group should run. The cpu list takes
+ * priority, with threads going round it, else threads go round the node list.
+ * -1 is returned in either for no preference
+ */
+void util_thread_placement (const char *cpulist, const char *nodelist, int index, int *cpu, int *node)
+{
+    int ids [UTIL_MAX_CPUS], count;
+
+    *cpu = *node = -1;
+    count = util_cpulist_parse (cpulist, ids, UTIL_MAX_CPUS);
+    if (count)
+    {
+        *cpu = ids [index % count];
+        *node = util_cpu_node (*cpu);
+        return;
+    }
+    count = util_cpulist_parse (nodelist, ids, UTIL_MAX_CPUS);
+    if (count)
+        *node = ids [index % count];
+}
+
+
+/* pin the calling thread to a cpu, or to the cpus of a node if no cpu is
+ * given. Returns 0 on success, -1 if it could not be done
+ */
+int util_thread_affinity (int cpu, int node)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    int ids [UTIL_MAX_CPUS], count = 0, i;
+    cpu_set_t set;
+
+    CPU_ZERO (&set);
+    if (cpu >= 0)
+        ids [count++] = cpu;
+    else if (node >= 0)
+        count = util_node_cpus (node, ids, UTIL_MAX_CPUS);
+    else
+    {
+        // no preference, so allow any that the process is allowed
+        if (sched_getaffinity (getpid(), sizeof set, &set) < 0)
+            return -1;
+        return sched_setaffinity (0, sizeof set, &set);
+    }
+    for (i = 0; i < count; i++)
+        if (ids [i] < CPU_SETSIZE)
+            CPU_SET (ids [i], &set);
+    if (CPU_COUNT (&set) == 0)
+        return -1;
+    return sched_setaffinity (0, sizeof set, &set);
+#else
+    return (cpu < 0 && node < 0) ? 0 : -1;
+#endif
+}
@@ -111,6 +111,15 @@ void rate_reduce (struct rate_calc *calc, unsigned int range);
 int get_line(FILE *file, char *buf, size_t siz);
 int util_expand_pattern (const char *mount, const char *pattern, char *buf, unsigned int *len_p);
 
+/* thread placement on cpus and NUMA nodes */
+#define UTIL_MAX_CPUS   1024
+
+int  util_cpulist_parse (const char *list, int *cpus, int max);
+int  util_node_cpus (int node, int *cpus, int max);
+int  util_cpu_node (int cpu);
+void util_thread_placement (const char *cpulist, const char *nodelist, int index, int *cpu, int *node);
+int  util_thread_affinity (int cpu, int node);
+
 void cached_file_init (cache_file_contents *cache, const char *filename, cachefile_add_func add, cachefile_compare_func compare);
 
 int cached_treenode_free (void*x);
@@ -1238,8 +1238,7 @@ void yp_stop (void)
     if (w)
     {
         ypclient.connection.error = 1;
-        ypclient.schedule_ms = 0;
-        worker_wakeup(w);
+        client_wakeup (&ypclient);
         DEBUG0 ("YP client is now stopped");
         thread_mutex_lock (&yp_pending_lock);
         if (yp_pending_thread)